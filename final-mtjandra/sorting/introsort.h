@@ -0,0 +1,149 @@
+/*!
+ * An introsort that is specialized at compile time for one element type,
+ * so that comparisons are inlined rather than made through a function
+ * pointer as with qsort().
+ *
+ * Define these before including this file, which may be included once for
+ * each type to sort:
+ *
+ *  - SORT_NAME, the name of the sort function to define,
+ *  - SORT_TYPE, the type of the elements to sort, and
+ *  - SORT_LESS(a, b), which is true if the element a points to goes before
+ *    the one b points to.
+ *
+ * This defines "static void SORT_NAME(SORT_TYPE *array, size_t n)", and
+ * undefines the three macros again.
+ */
+
+#include <stddef.h>
+
+
+#ifndef INTROSORT_H
+#define INTROSORT_H
+
+/*! Ranges with at most this many elements are left for insertion sort. */
+#define SORT_INSERTION_MAX 16
+
+#define SORT_CONCAT2(a, b) a ## _ ## b
+#define SORT_CONCAT(a, b) SORT_CONCAT2(a, b)
+
+/*! Names a helper function of the sort being defined. */
+#define SORT_FN(name) SORT_CONCAT(SORT_NAME, name)
+
+#endif /* INTROSORT_H */
+
+
+/*! Swaps two elements. */
+static inline void SORT_FN(swap)(SORT_TYPE *a, SORT_TYPE *b) {
+    SORT_TYPE tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+
+/*! Insertion-sorts an array. */
+static void SORT_FN(insertion_sort)(SORT_TYPE *array, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        SORT_TYPE elem = array[i];
+        size_t j = i;
+        while (j > 0 && SORT_LESS(&elem, array + j - 1)) {
+            array[j] = array[j - 1];
+            j--;
+        }
+        array[j] = elem;
+    }
+}
+
+
+/*!
+ * Moves the element at root of a binary max-heap of n elements down to
+ * where it belongs.
+ */
+static void SORT_FN(sift_down)(SORT_TYPE *array, size_t root, size_t n) {
+    while (2 * root + 1 < n) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < n && SORT_LESS(array + child, array + child + 1))
+            child++;
+        if (!SORT_LESS(array + root, array + child))
+            return;
+        SORT_FN(swap)(array + root, array + child);
+        root = child;
+    }
+}
+
+
+/*! Heapsorts an array; used when quicksort recurses too deeply. */
+static void SORT_FN(heap_sort)(SORT_TYPE *array, size_t n) {
+    for (size_t i = n / 2; i > 0; i--)
+        SORT_FN(sift_down)(array, i - 1, n);
+
+    for (size_t end = n - 1; end > 0; end--) {
+        SORT_FN(swap)(array, array + end);
+        SORT_FN(sift_down)(array, 0, end);
+    }
+}
+
+
+/*!
+ * Quicksorts an array until every range is small enough for insertion
+ * sort, switching to heapsort for any range still unsorted after depth
+ * levels of partitioning.
+ */
+static void SORT_FN(quick_sort)(SORT_TYPE *array, size_t n, int depth) {
+    while (n > SORT_INSERTION_MAX) {
+        if (depth-- == 0) {
+            SORT_FN(heap_sort)(array, n);
+            return;
+        }
+
+        // Order the first, middle and last elements, then use the median as
+        // the pivot at array[0].  The last element is now no less than the
+        // pivot, which stops the scan from the left.
+        size_t mid = n / 2;
+        if (SORT_LESS(array + mid, array))
+            SORT_FN(swap)(array + mid, array);
+        if (SORT_LESS(array + n - 1, array + mid)) {
+            SORT_FN(swap)(array + n - 1, array + mid);
+            if (SORT_LESS(array + mid, array))
+                SORT_FN(swap)(array + mid, array);
+        }
+        SORT_FN(swap)(array, array + mid);
+
+        size_t i = 0, j = n;
+        while (1) {
+            do i++; while (SORT_LESS(array + i, array));
+            do j--; while (SORT_LESS(array, array + j));
+            if (i >= j)
+                break;
+            SORT_FN(swap)(array + i, array + j);
+        }
+        SORT_FN(swap)(array, array + j);
+
+        // Recurse into the smaller side and loop on the larger one, so the
+        // stack never grows past log2(n) frames.
+        if (j < n - j - 1) {
+            SORT_FN(quick_sort)(array, j, depth);
+            array += j + 1;
+            n -= j + 1;
+        } else {
+            SORT_FN(quick_sort)(array + j + 1, n - j - 1, depth);
+            n = j;
+        }
+    }
+}
+
+
+/*! Sorts an array of n elements. */
+static void SORT_NAME(SORT_TYPE *array, size_t n) {
+    int depth = 0;
+    for (size_t i = n; i > 1; i >>= 1)
+        depth += 2;
+
+    SORT_FN(quick_sort)(array, n, depth);
+    SORT_FN(insertion_sort)(array, n);
+}
+
+
+#undef SORT_NAME
+#undef SORT_TYPE
+#undef SORT_LESS
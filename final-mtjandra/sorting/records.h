@@ -28,6 +28,7 @@ typedef struct record_t {
 } record_t;
 
 
+void generate_record(record_t *rec);
 record_t * generate_records(uint32_t num_records);
 
 
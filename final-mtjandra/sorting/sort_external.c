@@ -0,0 +1,481 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "records.h"
+#include "realtime.h"
+
+
+/*
+ * Sorts a file of records that may be much larger than memory, with an
+ * external merge sort:
+ *
+ *  1. The input is read a memory-sized run at a time.  Each run is sorted
+ *     in memory through an array of record-infos, with the inlined
+ *     introsort of sort_inline.c, and written to a temporary file.
+ *  2. All the runs are then merged into the output in a single pass, using
+ *     a loser tree to pick the smallest record among the heads of the runs
+ *     with only log2(k) comparisons for k runs.
+ *
+ * Records move between memory and disk only in large sequential chunks:
+ * each run being merged has its own input buffer, and there is one output
+ * buffer.  If the whole input fits in one run, it is written straight to
+ * the output with no merge.
+ *
+ * The program can also generate a file of random records to sort.
+ */
+
+
+#define KEY_PREFIX_SIZE 8
+
+/*! The default amount of memory to sort with, in megabytes. */
+#define DEFAULT_MEMORY_MB 256
+
+/*! The size of the buffer that sorted records are written through. */
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+
+/*! The records in OUTPUT_BUFFER_SIZE bytes. */
+#define OUTPUT_BUFFER_RECORDS (OUTPUT_BUFFER_SIZE / RECORD_SIZE)
+
+
+/*!
+ * A "record info" struct like the one in sort_inline.c, with the key
+ * prefix held as a big-endian integer.
+ */
+typedef struct recinfo_t {
+    uint64_t key_prefix;     //!< The prefix of the record's key, big-endian
+    record_t *record;        //!< A pointer to the record itself
+} recinfo_t;
+
+
+/*!
+ * Returns the first KEY_PREFIX_SIZE bytes of a key as an integer that
+ * compares like the bytes do.
+ */
+static inline uint64_t make_key_prefix(const char *key) {
+    uint64_t prefix = 0;
+    for (int i = 0; i < KEY_PREFIX_SIZE; i++)
+        prefix = (prefix << 8) | (unsigned char) key[i];
+    return prefix;
+}
+
+
+#define SORT_NAME sort_recinfos
+#define SORT_TYPE recinfo_t
+#define SORT_LESS(a, b) ((a)->key_prefix != (b)->key_prefix ? \
+    (a)->key_prefix < (b)->key_prefix : \
+    memcmp((a)->record->key, (b)->record->key, KEY_SIZE) < 0)
+#include "introsort.h"
+
+
+/*! A sorted run being merged, and the part of it in memory. */
+typedef struct run_t {
+    FILE *file;              //!< The temporary file holding the run
+    record_t *buffer;        //!< Records read from the file
+    size_t capacity;         //!< The most records the buffer holds
+    size_t num_buffered;     //!< The records now in the buffer
+    size_t next;             //!< The buffered record at the head of the run
+    uint64_t key_prefix;     //!< The key prefix of the head record
+    int done;                //!< Set once every record has been merged
+} run_t;
+
+
+/*! Total bytes read from and written to files, for reporting. */
+static uint64_t bytes_read;
+static uint64_t bytes_written;
+
+/*! Where temporary files go. */
+static const char *temp_dir = "/tmp";
+
+
+/*! Returns the seconds elapsed since start. */
+double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_get_realtime(&now);
+    return (double) (now.tv_sec - start->tv_sec) +
+           (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/*! Allocates memory, exiting if there isn't enough. */
+void * checked_malloc(size_t size) {
+    void *result = malloc(size);
+    if (result == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes!\n", size);
+        exit(1);
+    }
+    return result;
+}
+
+
+/*!
+ * Reads up to max_records records from a file.  Returns the number read,
+ * which is only less than max_records at the end of the file.
+ */
+size_t read_records(FILE *f, record_t *records, size_t max_records) {
+    size_t num = fread(records, RECORD_SIZE, max_records, f);
+    if (num < max_records && ferror(f)) {
+        perror("Couldn't read records");
+        exit(1);
+    }
+    bytes_read += (uint64_t) num * RECORD_SIZE;
+    return num;
+}
+
+
+/*! Writes some records to a file. */
+void write_records(FILE *f, const record_t *records, size_t num_records) {
+    if (fwrite(records, RECORD_SIZE, num_records, f) != num_records) {
+        perror("Couldn't write records");
+        exit(1);
+    }
+    bytes_written += (uint64_t) num_records * RECORD_SIZE;
+}
+
+
+/*! Opens a temporary file, which is removed as soon as it is closed. */
+FILE * open_temp_file(void) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sort_run_XXXXXX", temp_dir);
+
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Couldn't create a temporary file");
+        exit(1);
+    }
+    unlink(path);
+
+    FILE *f = fdopen(fd, "w+b");
+    if (f == NULL) {
+        perror("Couldn't open a temporary file");
+        exit(1);
+    }
+    return f;
+}
+
+
+/*!
+ * Writes records to a file in the order of an array of record-infos,
+ * gathering them into a buffer first so they go out in large writes.
+ */
+void write_sorted(FILE *f, recinfo_t *recinfos, size_t num_records,
+                  record_t *out) {
+    size_t num_out = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        out[num_out++] = *recinfos[i].record;
+        if (num_out == OUTPUT_BUFFER_RECORDS) {
+            write_records(f, out, num_out);
+            num_out = 0;
+        }
+    }
+    write_records(f, out, num_out);
+}
+
+
+/*!
+ * Reads the input a run at a time, sorts each run, and writes it to a new
+ * temporary file, or to the output if the input is only one run long.
+ * Returns the number of runs; their files are stored in *run_files.
+ */
+int make_runs(FILE *input, FILE *output, size_t memory, FILE ***run_files,
+              uint64_t *num_records) {
+    size_t run_records =
+        (memory - OUTPUT_BUFFER_SIZE) / (RECORD_SIZE + sizeof(recinfo_t));
+
+    record_t *records = checked_malloc(run_records * RECORD_SIZE);
+    recinfo_t *recinfos = checked_malloc(run_records * sizeof(recinfo_t));
+    record_t *out = checked_malloc(OUTPUT_BUFFER_SIZE);
+
+    int num_runs = 0, max_runs = 8;
+    *run_files = checked_malloc(max_runs * sizeof(FILE *));
+    *num_records = 0;
+
+    while (1) {
+        size_t num = read_records(input, records, run_records);
+        if (num == 0)
+            break;
+        *num_records += num;
+
+        for (size_t i = 0; i < num; i++) {
+            recinfos[i].key_prefix = make_key_prefix(records[i].key);
+            recinfos[i].record = records + i;
+        }
+        sort_recinfos(recinfos, num);
+
+        // A short first run is the whole input, which needs no merging.
+        if (num_runs == 0 && num < run_records) {
+            write_sorted(output, recinfos, num, out);
+            break;
+        }
+
+        if (num_runs == max_runs) {
+            max_runs *= 2;
+            *run_files = realloc(*run_files, max_runs * sizeof(FILE *));
+            if (*run_files == NULL) {
+                fprintf(stderr, "Couldn't grow the array of runs.\n");
+                exit(1);
+            }
+        }
+        FILE *run = open_temp_file();
+        write_sorted(run, recinfos, num, out);
+        rewind(run);
+        (*run_files)[num_runs++] = run;
+    }
+
+    free(out);
+    free(recinfos);
+    free(records);
+    return num_runs;
+}
+
+
+/*! Moves a run on to its next record, refilling its buffer as needed. */
+void advance_run(run_t *run) {
+    if (++run->next == run->num_buffered) {
+        run->num_buffered = read_records(run->file, run->buffer,
+                                         run->capacity);
+        run->next = 0;
+        if (run->num_buffered == 0) {
+            run->done = 1;
+            return;
+        }
+    }
+    run->key_prefix = make_key_prefix(run->buffer[run->next].key);
+}
+
+
+/*!
+ * Returns true if the head of run a goes before the head of run b.  Runs
+ * that are done go after all others.
+ */
+static inline int run_less(run_t *runs, int a, int b) {
+    run_t *run_a = runs + a;
+    run_t *run_b = runs + b;
+
+    if (run_a->done || run_b->done)
+        return !run_a->done;
+    if (run_a->key_prefix != run_b->key_prefix)
+        return run_a->key_prefix < run_b->key_prefix;
+    return memcmp(run_a->buffer[run_a->next].key,
+                  run_b->buffer[run_b->next].key, KEY_SIZE) < 0;
+}
+
+
+/*!
+ * Merges sorted runs into the output.  The runs are the leaves of a loser
+ * tree:  for k runs, tree[1] to tree[k - 1] each hold the run that lost the
+ * match played there, and tree[0] holds the overall winner, the run whose
+ * head is the smallest.  Leaf i sits at position k + i, and the parent of
+ * position p is p / 2.  Once the winner's head is written out, only the
+ * matches on the path from its leaf to the root have to be replayed.
+ */
+void merge_runs(FILE **run_files, int num_runs, FILE *output,
+                size_t memory) {
+    run_t *runs = checked_malloc(num_runs * sizeof(run_t));
+    int *tree = checked_malloc(num_runs * sizeof(int));
+    record_t *out = checked_malloc(OUTPUT_BUFFER_SIZE);
+
+    size_t capacity = (memory - OUTPUT_BUFFER_SIZE) / num_runs / RECORD_SIZE;
+    if (capacity == 0)
+        capacity = 1;
+
+    for (int i = 0; i < num_runs; i++) {
+        runs[i].file = run_files[i];
+        runs[i].buffer = checked_malloc(capacity * RECORD_SIZE);
+        runs[i].capacity = capacity;
+
+        // Every run has at least one record.
+        runs[i].num_buffered = read_records(runs[i].file, runs[i].buffer,
+                                            capacity);
+        runs[i].next = 0;
+        runs[i].key_prefix = make_key_prefix(runs[i].buffer[0].key);
+        runs[i].done = 0;
+    }
+
+    // Play every match bottom-up, keeping each one's winner in winners[]
+    // to play the next match up.
+    int *winners = checked_malloc(2 * num_runs * sizeof(int));
+    for (int i = 0; i < num_runs; i++)
+        winners[num_runs + i] = i;
+    for (int p = num_runs - 1; p >= 1; p--) {
+        int a = winners[2 * p];
+        int b = winners[2 * p + 1];
+        if (run_less(runs, b, a)) {
+            winners[p] = b;
+            tree[p] = a;
+        } else {
+            winners[p] = a;
+            tree[p] = b;
+        }
+    }
+    tree[0] = num_runs > 1 ? winners[1] : 0;
+    free(winners);
+
+    size_t num_out = 0;
+    while (!runs[tree[0]].done) {
+        int winner = tree[0];
+        run_t *run = runs + winner;
+
+        out[num_out++] = run->buffer[run->next];
+        if (num_out == OUTPUT_BUFFER_RECORDS) {
+            write_records(output, out, num_out);
+            num_out = 0;
+        }
+        advance_run(run);
+
+        // The new head of the winner's run replays the matches up its path;
+        // whichever side loses each one stays at that node.
+        for (int p = (num_runs + winner) / 2; p >= 1; p /= 2) {
+            if (run_less(runs, tree[p], winner)) {
+                int loser = winner;
+                winner = tree[p];
+                tree[p] = loser;
+            }
+        }
+        tree[0] = winner;
+    }
+    write_records(output, out, num_out);
+
+    for (int i = 0; i < num_runs; i++) {
+        free(runs[i].buffer);
+        fclose(runs[i].file);
+    }
+    free(out);
+    free(tree);
+    free(runs);
+}
+
+
+/*! Writes a file of random records, a buffer at a time. */
+void generate_file(const char *path, uint64_t num_records) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    record_t *out = checked_malloc(OUTPUT_BUFFER_SIZE);
+    srandom(RANDOM_SEED);
+
+    while (num_records > 0) {
+        size_t num = num_records < OUTPUT_BUFFER_RECORDS ?
+                     num_records : OUTPUT_BUFFER_RECORDS;
+        for (size_t i = 0; i < num; i++)
+            generate_record(out + i);
+        write_records(f, out, num);
+        num_records -= num;
+    }
+
+    free(out);
+    if (fclose(f) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+
+/*! Sorts the records in one file into another, and reports how it went. */
+void sort_file(const char *input_path, const char *output_path,
+               size_t memory) {
+    FILE *input = fopen(input_path, "rb");
+    if (input == NULL) {
+        perror(input_path);
+        exit(1);
+    }
+    FILE *output = fopen(output_path, "wb");
+    if (output == NULL) {
+        perror(output_path);
+        exit(1);
+    }
+
+    struct timespec start;
+    clock_get_realtime(&start);
+
+    FILE **run_files;
+    uint64_t num_records;
+    int num_runs = make_runs(input, output, memory, &run_files, &num_records);
+    double run_time = seconds_since(&start);
+
+    if (num_runs > 0)
+        merge_runs(run_files, num_runs, output, memory);
+    free(run_files);
+
+    fclose(input);
+    if (fclose(output) != 0) {
+        perror(output_path);
+        exit(1);
+    }
+    double total_time = seconds_since(&start);
+
+    double mb = (double) num_records * RECORD_SIZE / (1 << 20);
+    printf("Records\t%" PRIu64 "\n", num_records);
+    printf("Spilled Runs\t%d\n", num_runs);
+    printf("Run Time (s)\t%.3f\n", run_time);
+    printf("Merge Time (s)\t%.3f\n", total_time - run_time);
+    printf("Total Time (s)\t%.3f\n", total_time);
+    printf("Throughput (MB/s)\t%.1f\n", mb / total_time);
+    printf("MB Read\t%.1f\n", (double) bytes_read / (1 << 20));
+    printf("MB Written\t%.1f\n", (double) bytes_written / (1 << 20));
+}
+
+
+/*! Prints the program's usage information. */
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s generate FILE NUM_RECORDS\n", program);
+    fprintf(stderr, "       %s sort [-m MEMORY_MB] [-t TEMP_DIR] INPUT OUTPUT\n",
+            program);
+    exit(1);
+}
+
+
+/*! Main entry point for the program. */
+int main(int argc, char **argv) {
+    if (argc < 2)
+        usage(argv[0]);
+
+    if (strcmp(argv[1], "generate") == 0) {
+        if (argc != 4)
+            usage(argv[0]);
+        generate_file(argv[2], strtoull(argv[3], NULL, 10));
+        return 0;
+    }
+
+    if (strcmp(argv[1], "sort") != 0)
+        usage(argv[0]);
+
+    size_t memory_mb = DEFAULT_MEMORY_MB;
+    int c;
+    optind = 2;
+    while ((c = getopt(argc, argv, "m:t:")) != -1) {
+        switch (c) {
+            case 'm':
+                memory_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                temp_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    // The output buffer alone takes OUTPUT_BUFFER_SIZE bytes.
+    size_t memory = memory_mb << 20;
+    if (memory < 2 * OUTPUT_BUFFER_SIZE) {
+        fprintf(stderr, "%s: need at least %d MB of memory\n", argv[0],
+                2 * OUTPUT_BUFFER_SIZE >> 20);
+        exit(1);
+    }
+
+    fprintf(stderr, "Sorting %s into %s with %zu MB of memory\n",
+            argv[optind], argv[optind + 1], memory_mb);
+
+    sort_file(argv[optind], argv[optind + 1], memory);
+    return 0;
+}
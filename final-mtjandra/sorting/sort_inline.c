@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "records.h"
+#include "realtime.h"
+
+
+#define KEY_PREFIX_SIZE 8
+
+
+typedef record_t * record_ptr_t;
+
+
+/*!
+ * A "record info" struct like the one in sort_recinfos.c, except that the
+ * key prefix is held as an integer, whose order is the order of the bytes.
+ */
+typedef struct recinfo_t {
+    uint64_t key_prefix;     //!< The prefix of the record's key, big-endian
+    record_t *record;        //!< A pointer to the record itself
+} recinfo_t;
+
+
+/*!
+ * Returns the first KEY_PREFIX_SIZE bytes of a key as an integer that
+ * compares like the bytes do:  the first byte of the key is the most
+ * significant.  On a little-endian machine this compiles to a single
+ * byte-swap instruction.
+ */
+static inline uint64_t make_key_prefix(const char *key) {
+    uint64_t prefix = 0;
+    for (int i = 0; i < KEY_PREFIX_SIZE; i++)
+        prefix = (prefix << 8) | (unsigned char) key[i];
+    return prefix;
+}
+
+
+/* Records are compared by their keys. */
+#define SORT_NAME sort_records
+#define SORT_TYPE record_t
+#define SORT_LESS(a, b) (memcmp((a)->key, (b)->key, KEY_SIZE) < 0)
+#include "introsort.h"
+
+/* Record-pointers are compared by the keys of the records they point to. */
+#define SORT_NAME sort_record_ptrs
+#define SORT_TYPE record_ptr_t
+#define SORT_LESS(a, b) (memcmp((*(a))->key, (*(b))->key, KEY_SIZE) < 0)
+#include "introsort.h"
+
+/*
+ * Record-infos are compared by their key prefixes, and by the entire keys
+ * of their records only if the prefixes are the same.
+ */
+#define SORT_NAME sort_recinfos
+#define SORT_TYPE recinfo_t
+#define SORT_LESS(a, b) ((a)->key_prefix != (b)->key_prefix ? \
+    (a)->key_prefix < (b)->key_prefix : \
+    memcmp((a)->record->key, (b)->record->key, KEY_SIZE) < 0)
+#include "introsort.h"
+
+
+/*! The average times taken to sort each kind of array. */
+typedef struct sort_times_t {
+    uint64_t records;
+    uint64_t record_ptrs;
+    uint64_t recinfos;
+} sort_times_t;
+
+
+/*!
+ * Runs the performance test for a given number of records and a given
+ * number of repetitions.  Each repetition sorts the same records as an
+ * array of record-infos, an array of record-pointers and the array of
+ * records itself.  Returns the average total time taken for each.
+ */
+sort_times_t sort_perf(int num_records, int num_repeats) {
+    sort_times_t total = { 0, 0, 0 };
+    for (int rep = 0; rep < num_repeats; rep++) {
+        // Generate the records themselves in a contiguous memory chunk.
+        record_t *records = generate_records(num_records);
+
+        // Make arrays of record-pointers and record-info structs based on
+        // the records.
+        record_ptr_t *recptrs = malloc(num_records * sizeof(record_ptr_t));
+        recinfo_t *recinfos = malloc(num_records * sizeof(recinfo_t));
+        if (recptrs == NULL || recinfos == NULL) {
+            fprintf(stderr, "Couldn't allocate record-pointer and "
+                    "record-info arrays.\n");
+            exit(1);
+        }
+        for (int i = 0; i < num_records; i++) {
+            recptrs[i] = records + i;
+            recinfos[i].key_prefix = make_key_prefix(records[i].key);
+            recinfos[i].record = records + i;
+        }
+
+        // The records are sorted last, since the other arrays point into
+        // them.
+        uint64_t start = rdtsc();
+        sort_recinfos(recinfos, num_records);
+        uint64_t end = rdtsc();
+        total.recinfos += end - start;
+
+        start = rdtsc();
+        sort_record_ptrs(recptrs, num_records);
+        end = rdtsc();
+        total.record_ptrs += end - start;
+
+        start = rdtsc();
+        sort_records(records, num_records);
+        end = rdtsc();
+        total.records += end - start;
+
+        free(recinfos);
+        free(recptrs);
+        free(records);
+    }
+
+    sort_times_t avg = {
+        total.records / num_repeats,
+        total.record_ptrs / num_repeats,
+        total.recinfos / num_repeats
+    };
+    return avg;
+}
+
+
+/*! Main entry point for the program. */
+int main() {
+    srandom(RANDOM_SEED);
+
+    fprintf(stderr, "Sorting arrays of records, record-pointers and "
+            "record-info objects with an inlined introsort\n");
+
+    printf("N\tRecords CPE\tRecord-Ptrs CPE\tRecord-Infos CPE\n");
+
+    for (int num_records = N_START; num_records <= N_END; num_records += N_STEP) {
+        sort_times_t avg_times = sort_perf(num_records, NUM_REPEATS);
+        printf("%d\t%.2f\t%.2f\t%.2f\n", num_records,
+               (float) avg_times.records / (float) num_records,
+               (float) avg_times.record_ptrs / (float) num_records,
+               (float) avg_times.recinfos / (float) num_records);
+    }
+
+    return 0;
+}
@@ -0,0 +1,388 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "records.h"
+#include "realtime.h"
+
+
+#define KEY_PREFIX_SIZE 8
+
+/*! The most threads the sort will be run with. */
+#define MAX_THREADS 64
+
+
+/*!
+ * A "record info" struct, which holds a part of the record's key, as well
+ * as a pointer to the record itself.
+ */
+typedef struct recinfo_t {
+    char key_prefix[KEY_PREFIX_SIZE];    //!< The prefix of the record's key
+    record_t *record;                    //!< A pointer to the record itself
+} recinfo_t;
+
+
+/*!
+ * Compare two records, returning <0, 0 or >0 if record a is less than,
+ * equal to, or greater than record b.
+ *
+ * The records are referenced by "record info" structs.
+ */
+int compare_recinfos(const void *a, const void *b) {
+    recinfo_t *rec_a = (recinfo_t *) a;
+    recinfo_t *rec_b = (recinfo_t *) b;
+
+    // Compare key prefixes using memcmp. If the prefixes are the same,
+    // compare the entire key.
+    int prefix_cmp = memcmp(rec_a->key_prefix, rec_b->key_prefix, \
+                            KEY_PREFIX_SIZE);
+    if (prefix_cmp == 0) {
+        record_t *record_a = rec_a->record;
+        record_t *record_b = rec_b->record;
+        return memcmp(record_a->key, record_b->key, KEY_SIZE);
+    }
+    return prefix_cmp;
+}
+
+
+/*
+ * The sort runs on a pool of threads that is started once, so that each
+ * sort only pays for waking the threads up rather than creating them.  The
+ * main thread takes part in every sort as thread 0.
+ *
+ * A sort with T threads cuts the array into T chunks, and each thread sorts
+ * its own chunk with qsort().  The sorted runs are then merged in pairs,
+ * round after round, until only one is left.  In every round each thread
+ * writes the same share of the output, 1/T of the array, however many pairs
+ * are left to merge:  a thread finds where its share starts in each pair by
+ * binary search, so no thread sits idle while the last few large runs are
+ * merged.
+ */
+
+/*! The number of threads in the pool, including the main thread. */
+static int pool_size;
+
+/*! The pool's threads, other than the main thread. */
+static pthread_t pool[MAX_THREADS];
+
+/*! Guards the job state below, and signals new and finished jobs. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/*! Counts the jobs handed to the pool, so threads can tell a new one. */
+static int job_number;
+
+/*! How many threads work on the current job. */
+static int job_threads;
+
+/*! How many of the pool's threads are done with the current job. */
+static int job_finished;
+
+/*! Set to make the pool's threads exit. */
+static int pool_exit;
+
+/*! A barrier between the rounds of a job, for job_threads threads. */
+static pthread_cond_t round_cond = PTHREAD_COND_INITIALIZER;
+static int round_waiting;
+static int round_number;
+
+/*! The array the current job sorts, a scratch array as big, and its size. */
+static recinfo_t *job_array;
+static recinfo_t *job_scratch;
+static int job_size;
+
+
+/*! Waits until all threads of the current job have called this. */
+void wait_round(void) {
+    pthread_mutex_lock(&pool_lock);
+    int round = round_number;
+    if (++round_waiting == job_threads) {
+        round_waiting = 0;
+        round_number++;
+        pthread_cond_broadcast(&round_cond);
+    } else {
+        while (round == round_number)
+            pthread_cond_wait(&round_cond, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/*!
+ * Returns how many elements of a come first when the sorted arrays a and b
+ * are merged and cut after k elements.  Elements of a go before equal
+ * elements of b.
+ */
+int co_rank(int k, recinfo_t *a, int a_len, recinfo_t *b, int b_len) {
+    int lo = k > b_len ? k - b_len : 0;
+    int hi = k < a_len ? k : a_len;
+
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        if (compare_recinfos(a + i, b + (k - i - 1)) <= 0)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+
+/*! Merges the sorted arrays a and b into dest. */
+void merge(recinfo_t *a, int a_len, recinfo_t *b, int b_len,
+           recinfo_t *dest) {
+    recinfo_t *a_end = a + a_len;
+    recinfo_t *b_end = b + b_len;
+
+    while (a < a_end && b < b_end) {
+        if (compare_recinfos(a, b) <= 0)
+            *dest++ = *a++;
+        else
+            *dest++ = *b++;
+    }
+    memcpy(dest, a, (a_end - a) * sizeof(recinfo_t));
+    dest += a_end - a;
+    memcpy(dest, b, (b_end - b) * sizeof(recinfo_t));
+}
+
+
+/*! Does one thread's part of sorting job_array. */
+void sort_part(int id) {
+    int threads = job_threads;
+    int n = job_size;
+    int lo = (int) ((int64_t) n * id / threads);
+    int hi = (int) ((int64_t) n * (id + 1) / threads);
+
+    qsort(job_array + lo, hi - lo, sizeof(recinfo_t), compare_recinfos);
+
+    // bounds[r] is where run r starts; every thread keeps its own copy.
+    int bounds[MAX_THREADS + 1];
+    int runs = threads;
+    for (int r = 0; r <= runs; r++)
+        bounds[r] = (int) ((int64_t) n * r / threads);
+
+    recinfo_t *src = job_array;
+    recinfo_t *dest = job_scratch;
+
+    while (runs > 1) {
+        wait_round();
+
+        for (int r = 0; r < runs; r += 2) {
+            int start = bounds[r];
+            int mid = bounds[r + 1];
+            int end = r + 2 <= runs ? bounds[r + 2] : mid;
+
+            // Skip pairs that don't overlap this thread's share.
+            if (end <= lo || start >= hi)
+                continue;
+
+            int k_lo = (lo > start ? lo : start) - start;
+            int k_hi = (hi < end ? hi : end) - start;
+            int a_len = mid - start;
+            int b_len = end - mid;
+            int i_lo = co_rank(k_lo, src + start, a_len, src + mid, b_len);
+            int i_hi = co_rank(k_hi, src + start, a_len, src + mid, b_len);
+
+            merge(src + start + i_lo, i_hi - i_lo,
+                  src + mid + (k_lo - i_lo), (k_hi - i_hi) - (k_lo - i_lo),
+                  dest + start + k_lo);
+        }
+
+        // The pairs merged this round are the runs of the next one.
+        for (int r = 0; r < runs; r += 2)
+            bounds[r / 2] = bounds[r];
+        runs = (runs + 1) / 2;
+        bounds[runs] = n;
+
+        recinfo_t *tmp = src;
+        src = dest;
+        dest = tmp;
+    }
+
+    // An odd number of rounds leaves the result in the scratch array.  It
+    // can only be copied back once every thread is done reading the array.
+    if (src != job_array) {
+        wait_round();
+        memcpy(job_array + lo, src + lo, (hi - lo) * sizeof(recinfo_t));
+    }
+}
+
+
+/*! The body of each thread in the pool. */
+void * pool_thread(void *arg) {
+    int id = (int) (intptr_t) arg;
+    int job = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (job == job_number && !pool_exit)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        if (pool_exit)
+            break;
+        job = job_number;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (id < job_threads)
+            sort_part(id);
+
+        pthread_mutex_lock(&pool_lock);
+        job_finished++;
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return NULL;
+}
+
+
+/*! Starts the pool of threads. */
+void start_pool(int size) {
+    pool_size = size;
+    for (int i = 1; i < pool_size; i++) {
+        if (pthread_create(&pool[i], NULL, pool_thread,
+                           (void *) (intptr_t) i) != 0) {
+            fprintf(stderr, "Couldn't start sorting thread %d.\n", i);
+            exit(1);
+        }
+    }
+}
+
+
+/*! Stops the pool of threads. */
+void stop_pool(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_exit = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 1; i < pool_size; i++)
+        pthread_join(pool[i], NULL);
+}
+
+
+/*! Sorts an array of record-infos with the given number of threads. */
+void parallel_sort(recinfo_t *recinfos, recinfo_t *scratch, int num_records,
+                   int threads) {
+    // Small arrays aren't worth cutting up.
+    if (threads > num_records)
+        threads = num_records > 0 ? num_records : 1;
+
+    // One thread sorts just like sort_recinfos, without waking the pool.
+    if (threads == 1) {
+        qsort(recinfos, num_records, sizeof(recinfo_t), compare_recinfos);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    job_array = recinfos;
+    job_scratch = scratch;
+    job_size = num_records;
+    job_threads = threads;
+    job_finished = 0;
+    job_number++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    sort_part(0);
+
+    pthread_mutex_lock(&pool_lock);
+    while (job_finished < pool_size - 1)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/*!
+ * Runs the performance test for a given number of records and a given
+ * number of repetitions, with 1 to max_threads threads.  Each repetition
+ * sorts the same records with every number of threads.  Stores the average
+ * total time taken with t threads into avg_times[t - 1].
+ */
+void sort_perf(int num_records, int num_repeats, int max_threads,
+               uint64_t *avg_times) {
+    uint64_t total[MAX_THREADS] = { 0 };
+    for (int rep = 0; rep < num_repeats; rep++) {
+        // Generate the records themselves in a contiguous memory chunk.
+        record_t *records = generate_records(num_records);
+
+        // Make an array of record-info structs based on the records, and
+        // two more for each sort to work on.
+        recinfo_t *unsorted = malloc(num_records * sizeof(recinfo_t));
+        recinfo_t *recinfos = malloc(num_records * sizeof(recinfo_t));
+        recinfo_t *scratch = malloc(num_records * sizeof(recinfo_t));
+        if (unsorted == NULL || recinfos == NULL || scratch == NULL) {
+            fprintf(stderr, "Couldn't allocate record-info arrays.\n");
+            exit(1);
+        }
+        for (int i = 0; i < num_records; i++) {
+            memcpy(unsorted[i].key_prefix, records[i].key, KEY_PREFIX_SIZE);
+            unsorted[i].record = records + i;
+        }
+
+        for (int t = 1; t <= max_threads; t++) {
+            memcpy(recinfos, unsorted, num_records * sizeof(recinfo_t));
+
+            uint64_t start = rdtsc();
+            parallel_sort(recinfos, scratch, num_records, t);
+            uint64_t end = rdtsc();
+
+            total[t - 1] += end - start;
+        }
+
+        free(scratch);
+        free(recinfos);
+        free(unsorted);
+        free(records);
+    }
+
+    for (int t = 0; t < max_threads; t++)
+        avg_times[t] = total[t] / num_repeats;
+}
+
+
+/*!
+ * Main entry point for the program.  The optional argument is the most
+ * threads to sort with; it defaults to the number of online processors.
+ */
+int main(int argc, char **argv) {
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [threads], with 1 <= threads <= %d\n",
+                argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    srandom(RANDOM_SEED);
+
+    fprintf(stderr, "Sorting an array of record-info objects with 1 to %d "
+            "threads\n", max_threads);
+
+    printf("N");
+    for (int t = 1; t <= max_threads; t++)
+        printf("\tCPE (%d threads)", t);
+    printf("\n");
+
+    start_pool(max_threads);
+
+    uint64_t avg_times[MAX_THREADS];
+    for (int num_records = N_START; num_records <= N_END; num_records += N_STEP) {
+        sort_perf(num_records, NUM_REPEATS, max_threads, avg_times);
+        printf("%d", num_records);
+        for (int t = 0; t < max_threads; t++) {
+            float avg_cpe = (float) avg_times[t] / (float) num_records;
+            printf("\t%.2f", avg_cpe);
+        }
+        printf("\n");
+    }
+
+    stop_pool();
+
+    return 0;
+}
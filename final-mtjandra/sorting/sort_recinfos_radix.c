@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "records.h"
+#include "realtime.h"
+
+
+#define KEY_PREFIX_SIZE 8
+
+/*! Buckets with fewer records than this are insertion-sorted. */
+#define INSERTION_SORT_MAX 16
+
+
+/*!
+ * A "record info" struct, which holds a part of the record's key, as well
+ * as a pointer to the record itself.
+ */
+typedef struct recinfo_t {
+    char key_prefix[KEY_PREFIX_SIZE];    //!< The prefix of the record's key
+    record_t *record;                    //!< A pointer to the record itself
+} recinfo_t;
+
+
+/*!
+ * Returns byte number depth of a record's key.  Bytes in the key prefix
+ * are read from the record-info itself, so only the later ones cost a
+ * trip to the record.
+ */
+static inline int key_byte(const recinfo_t *rec, int depth) {
+    if (depth < KEY_PREFIX_SIZE)
+        return (unsigned char) rec->key_prefix[depth];
+    return (unsigned char) rec->record->key[depth];
+}
+
+
+/*!
+ * Compare two records whose keys are known to agree before byte number
+ * depth, returning <0, 0 or >0 if record a is less than, equal to, or
+ * greater than record b.
+ */
+int compare_from(const recinfo_t *rec_a, const recinfo_t *rec_b,
+                 int depth) {
+    // Compare what is left of the key prefixes first.  If they are the
+    // same, compare the rest of the entire key.
+    if (depth < KEY_PREFIX_SIZE) {
+        int prefix_cmp = memcmp(rec_a->key_prefix + depth,
+                                rec_b->key_prefix + depth,
+                                KEY_PREFIX_SIZE - depth);
+        if (prefix_cmp != 0)
+            return prefix_cmp;
+        depth = KEY_PREFIX_SIZE;
+    }
+    return memcmp(rec_a->record->key + depth, rec_b->record->key + depth,
+                  KEY_SIZE - depth);
+}
+
+
+/*!
+ * Insertion-sorts an array of record-infos whose keys all agree before
+ * byte number depth.
+ */
+void insertion_sort(recinfo_t *recinfos, int num_records, int depth) {
+    for (int i = 1; i < num_records; i++) {
+        recinfo_t rec = recinfos[i];
+        int j = i;
+        while (j > 0 && compare_from(recinfos + j - 1, &rec, depth) > 0) {
+            recinfos[j] = recinfos[j - 1];
+            j--;
+        }
+        recinfos[j] = rec;
+    }
+}
+
+
+/*!
+ * Sorts an array of record-infos whose keys all agree before byte number
+ * depth, with a most-significant-digit radix sort.  The records are put
+ * into buckets by byte number depth of their keys, in place, and then each
+ * bucket is sorted by the bytes after it.
+ */
+void radix_sort(recinfo_t *recinfos, int num_records, int depth) {
+    if (num_records < INSERTION_SORT_MAX) {
+        insertion_sort(recinfos, num_records, depth);
+        return;
+    }
+    if (depth == KEY_SIZE)
+        return;
+
+    int counts[256] = { 0 };
+    for (int i = 0; i < num_records; i++)
+        counts[key_byte(recinfos + i, depth)]++;
+
+    // next[b] is the first slot of bucket b that is yet to be filled, and
+    // end[b] is just past the bucket.
+    int next[256], end[256];
+    int start = 0;
+    for (int b = 0; b < 256; b++) {
+        next[b] = start;
+        start += counts[b];
+        end[b] = start;
+    }
+
+    // Move every record into its bucket.  A record picked up from the wrong
+    // bucket displaces the next unfilled one of its own bucket, which is
+    // carried on in turn, until one belonging in the first bucket is found.
+    for (int b = 0; b < 256; b++) {
+        while (next[b] < end[b]) {
+            recinfo_t rec = recinfos[next[b]];
+            int c = key_byte(&rec, depth);
+            while (c != b) {
+                recinfo_t displaced = recinfos[next[c]];
+                recinfos[next[c]++] = rec;
+                rec = displaced;
+                c = key_byte(&rec, depth);
+            }
+            recinfos[next[b]++] = rec;
+        }
+    }
+
+    start = 0;
+    for (int b = 0; b < 256; b++) {
+        if (counts[b] > 1)
+            radix_sort(recinfos + start, counts[b], depth + 1);
+        start += counts[b];
+    }
+}
+
+
+/*!
+ * Runs the performance test for a given number of records and a given
+ * number of repetitions.  Returns the average total time taken.
+ */
+uint64_t sort_perf(int num_records, int num_repeats) {
+    uint64_t total = 0;
+    for (int rep = 0; rep < num_repeats; rep++) {
+        // Generate the records themselves in a contiguous memory chunk.
+        record_t *records = generate_records(num_records);
+
+        // Make an array of record-info structs based on the records.
+        recinfo_t *recinfos = malloc(num_records * sizeof(recinfo_t));
+        if (recinfos == NULL) {
+            fprintf(stderr, "Couldn't allocate record-info array.\n");
+            exit(1);
+        }
+        for (int i = 0; i < num_records; i++) {
+            memcpy(recinfos[i].key_prefix, records[i].key, KEY_PREFIX_SIZE);
+            recinfos[i].record = records + i;
+        }
+
+        uint64_t start = rdtsc();
+        radix_sort(recinfos, num_records, 0);
+        uint64_t end = rdtsc();
+
+        free(recinfos);
+        free(records);
+
+        total += end - start;
+    }
+
+    uint64_t avg = total / num_repeats;
+    return avg;
+}
+
+
+/*! Main entry point for the program. */
+int main() {
+    srandom(RANDOM_SEED);
+
+    fprintf(stderr, "Radix-sorting an array of record-info objects\n");
+
+    printf("N\tTotal Time\tClocks per Element\n");
+
+    for (int num_records = N_START; num_records <= N_END; num_records += N_STEP) {
+        uint64_t avg_time = sort_perf(num_records, NUM_REPEATS);
+        float avg_cpe = (float) avg_time / (float) num_records;
+        printf("%d\t%" PRIu64 "\t%.2f\n", num_records, avg_time, avg_cpe);
+    }
+
+    return 0;
+}
@@ -7,6 +7,22 @@
  * memory pool into half and copies over Values that are not garbage to the to
  * pool when the program runs out of memory.
  *
+ * It can instead be configured as a generational collector.  Then a small
+ * nursery at the start of the pool receives all new Values and is collected
+ * often; its survivors are promoted into an old generation, which is itself
+ * split into two semispaces and collected by stop-and-copy only when it fills.
+ *
+ * When the live data grows to fill most of a semispace, the stop-and-copy
+ * collector gives up on semispaces and instead mark-compacts the whole pool in
+ * place, going back to copying once the live data shrinks again.
+ *
+ * Or it can be configured as an incremental collector, which uses the same two
+ * semispaces but spreads the copying over many small steps, one per
+ * allocation, so that no single pause grows with the size of the heap.
+ *
+ * The stop-and-copy collector can also be given several threads, which then
+ * share the work of each collection of a large pool between them.
+ *
  * Adapted from Andre DeHon's CS24 2004, 2006 material.
  * Copyright (C) California Institute of Technology, 2004-2010.
  * All rights reserved.
@@ -15,10 +31,14 @@
 #include "alloc.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "global.h"
 #include "eval.h"
@@ -27,6 +47,43 @@
 //// MODULE-LOCAL STATE ////
 
 
+/*! The fraction of the pool given to the nursery by the generational mode. */
+#define NURSERY_FRACTION 4
+
+/*!
+ * The incremental collector starts a cycle once the current semispace is this
+ * fraction full, and then scans at least INCR_WORK_RATIO bytes for each byte
+ * that is allocated.  Allocations pay for more than that as the semispace
+ * fills, so that a cycle finishes before it runs out of room.
+ */
+#define INCR_TRIGGER_FRACTION 2
+#define INCR_WORK_RATIO 4
+
+/*!
+ * The stop-and-copy and incremental collectors switch to mark-compact over
+ * the whole pool once the live data is more than COMPACT_ENTER_PERCENT of a
+ * semispace, and back to copying when it drops below COMPACT_LEAVE_PERCENT.
+ * The gap keeps them from flipping back and forth on every collection.
+ */
+#define COMPACT_ENTER_PERCENT 75
+#define COMPACT_LEAVE_PERCENT 25
+
+/*! Default cap on a single incremental step, in nanoseconds. */
+#define DEFAULT_PAUSE_CAP_NS 1000000L
+
+/*!
+ * After a full collection, the pool is doubled when more than
+ * HEAP_GROW_PERCENT of the space the live data has to fit in is still in use,
+ * and halved when less than HEAP_SHRINK_PERCENT is.  It never grows past the
+ * limit set by mm_set_heap_limit(), nor shrinks below its initial size.
+ */
+#define HEAP_GROW_PERCENT 50
+#define HEAP_SHRINK_PERCENT 10
+
+
+/*! Which collector the allocator was initialized with. */
+static GCMode gc_mode;
+
 /*!
  * Specifies the size of the memory pool.  This is a static local variable;
  * the value is specified in the call to init_alloc(). 
@@ -38,6 +95,16 @@ static int MEMORY_SIZE;
  */
 static int HALF_MEMORY;
 
+/*!
+ * The sizes the pool may range between.  It starts out at the soft limit,
+ * the size given to mm_init(), and may grow up to the hard limit.
+ */
+static int soft_limit;
+static int hard_limit;
+
+/*! The hard limit asked for with mm_set_heap_limit(), or 0 for none. */
+static int heap_limit;
+
 /*!
  * This is the starting address of the memory pool used in the implicit
  * allocator.  The pool is allocated within init_alloc().
@@ -68,16 +135,98 @@ static unsigned char *toptr;
  */
 static unsigned char *allocptr;
 
+/*!
+ * True while the collector is mark-compacting instead of copying.  Then the
+ * whole pool, starting at fromptr == mem, is a single space, or for the
+ * generational collector, all of the pool after the nursery is the old
+ * generation.
+ */
+static bool compacting;
+
+/*!
+ * The mark-compact collector's stack of Values that have been marked but
+ * whose children have not been yet.
+ */
+static Reference *mark_stack;
+static int num_marks;
+static int max_marks;
+
+
+/*!
+ * The generational collector's nursery.  It is the first NURSERY_SIZE bytes
+ * of the pool, and freeptr is the bump pointer into it.
+ */
+static unsigned char *nursery;
+static int NURSERY_SIZE;
+
+/*!
+ * The old generation is the rest of the pool, split into two semispaces of
+ * OLD_HALF bytes each.  Values are promoted to old_free in old_from, and a
+ * major collection copies everything live into old_to.
+ */
+static int OLD_HALF;
+static unsigned char *old_from;
+static unsigned char *old_to;
+static unsigned char *old_free;
+
+/*!
+ * While an incremental cycle is copying (gc_active), toptr is the semispace
+ * being evacuated and evac_end is the end of the Values in it.  Copies and
+ * new Values both go to freeptr in the other semispace, and scanptr is the
+ * Cheney scan pointer chasing freeptr.  Once copying is done the evacuated
+ * semispace is swept, also a step at a time, from sweepptr up to evac_end.
+ * work_debt is how many bytes of work the collector is behind by, and
+ * cycle_live how many bytes of live data the last cycle copied.
+ */
+static bool gc_active;
+static unsigned char *evac_end;
+static unsigned char *scanptr;
+static unsigned char *sweepptr;
+static long work_debt;
+static long cycle_live;
+
+/*! The longest an incremental step may run for, in nanoseconds. */
+static long pause_cap_ns = DEFAULT_PAUSE_CAP_NS;
+
+/*! How many incremental pauses have run past pause_cap_ns. */
+static long cap_overruns;
+
+/*! The longest collection pause seen so far, in nanoseconds. */
+static long longest_pause_ns;
+
+/*!
+ * The remembered set holds old Values that may refer to nursery Values.  They
+ * are treated as extra roots by a minor collection.  An old Value's seen field
+ * is set while it is in the set, so it is only recorded once.
+ */
+static Reference *remembered;
+static int num_remembered;
+static int max_remembered;
+
+
+/*!
+ * A Reference to a Value in the pool is a handle: its low REF_INDEX_BITS are
+ * an index into the ref_table, and the bits above them are the generation of
+ * that slot when the Reference was made.  A slot's generation is advanced each
+ * time it is freed, so deref() can tell a stale Reference to a reused slot
+ * from a live one.  The generation wraps, so this catches most mistakes
+ * rather than all of them.
+ */
+#define REF_INDEX_BITS 25
+#define REF_INDEX_MASK ((1 << REF_INDEX_BITS) - 1)
+#define REF_GEN_MASK ((1 << (31 - REF_INDEX_BITS)) - 1)
 
 /*!
  * This is the "reference table."  However, it is really just an array that
- * records where each Value starts in the pool.  References are just indexes
- * into this table.  An unused slot is indicated by storing NULL for the
- * Value pointer.  (Since it's an array of pointers, it's a pointer to a
- * pointer.)
+ * records where each Value starts in the pool.  References index into this
+ * table.  An unused slot is indicated by storing NULL for the Value pointer.
+ * (Since it's an array of pointers, it's a pointer to a pointer.)
  */
 static struct Value **ref_table;
 
+/*! The current generation of each slot in the ref_table. */
+static unsigned char *ref_gens;
+
 /*!
  * This is the number of references currently in the table.  Valid entries
  * are in the range 0 .. num_refs - 1.
@@ -87,16 +236,109 @@ static int num_refs;
 /*! This is the actual size of the ref_table. */
 static int max_refs;
 
+/*!
+ * A stack of the unused slots below num_refs.  The collector pushes each
+ * reference it frees, and make_reference() pops one instead of searching the
+ * table.  It never holds more than max_refs entries, so it is grown along
+ * with the ref_table.
+ */
+static Reference *free_refs;
+static int num_free_refs;
+
+/*!
+ * The number of references freed since the ref_table was last compacted.
+ * Compacting walks the whole table, so it waits until enough frees have paid
+ * for it.
+ */
+static int refs_freed;
+
+
+/*!
+ * Statistics for gcstats() and the statistics log.  The totals cover every
+ * collection so far; the last_ fields describe the most recent one, which
+ * collected last_before bytes and found last_live of them still live.
+ * last_pause_ns is the longest pause that collection took, which for the
+ * incremental collector is its longest step.
+ */
+static long num_collections;
+static long total_pause_ns;
+static long total_bytes_copied;
+static const char *last_kind;
+static long last_pause_ns;
+static int last_before;
+static int last_live;
+static long last_copied;
+static int live_objects[NUM_VALUE_TYPES];
+
+/*! The most memory that has been in use at once. */
+static int peak_memuse;
+
+/*! Where to append the statistics after each collection, or NULL. */
+static FILE *stats_log;
+
 
 //// LOCAL HELPER FUNCTIONS ////
 
 
 Reference make_reference();
 
+static Value *mm_malloc_old(ValueType type, int data_size);
+static int collect_nursery(void);
+static void remember(Value *obj);
+static void incremental_step(int requested);
+static void finish_cycle(void);
+static void shade_ref(Reference ref);
+static long now_ns(void);
+static void record_pause(long start);
+static void start_compacting(void);
+static void begin_collection(int before);
+static void end_collection(const char *kind);
+static void count_live(Value *val);
+static void reset_live_counts(void);
+static void note_memuse(void);
+static void compact_ref_table(void);
+static void adapt_pool_size(void);
+static bool grow_pool(int requested);
+static void poison(void *start, long size, int pattern);
+
 
 //// FUNCTION DEFINITIONS ////
 
 
+/*!
+ * Divides the MEMORY_SIZE bytes at mem up into the spaces the collector uses,
+ * all of them empty.
+ */
+static void lay_out_pool(void) {
+    /* 
+     * Modification to split the memory into the from and to pools. At first,
+     * the from pool is the first half of the memory and the to pool is the
+     * second. However, these pointers will swap when the from pool is
+     * full.
+     */
+    HALF_MEMORY = MEMORY_SIZE / 2;
+    fromptr = mem;
+    freeptr = fromptr;
+    toptr = mem + HALF_MEMORY;
+    allocptr = toptr;
+    compacting = false;
+
+    /*
+     * The generational collector carves the same pool up differently: a
+     * nursery first, then the two old-generation semispaces.
+     */
+    if (gc_mode == GC_GENERATIONAL) {
+        NURSERY_SIZE = MEMORY_SIZE / NURSERY_FRACTION;
+        OLD_HALF = (MEMORY_SIZE - NURSERY_SIZE) / 2;
+        nursery = mem;
+        freeptr = nursery;
+        old_from = mem + NURSERY_SIZE;
+        old_to = old_from + OLD_HALF;
+        old_free = old_from;
+    }
+}
+
+
 /*!
  * This function initializes both the allocator state, and the memory pool.  It
  * must be called before myalloc() or myfree() will work at all.
@@ -107,13 +349,16 @@ Reference make_reference();
  * allocator would request a memory region from the operating system (see the
  * C standard function sbrk(), for example).
  */
-void mm_init(int memory_size) {
+void mm_init(int memory_size, GCMode mode) {
     /*
      * Allocate the entire memory pool, from which our simple allocator will
      * serve allocation requests.
      */
     assert(memory_size > 0);
     MEMORY_SIZE = memory_size;
+    soft_limit = memory_size;
+    hard_limit = heap_limit > memory_size ? heap_limit : memory_size;
+    gc_mode = mode;
     mem = malloc(MEMORY_SIZE);
 
     if (mem == NULL) {
@@ -123,24 +368,38 @@ void mm_init(int memory_size) {
         abort();
     }
 
-    /* 
-     * Modification to split the memory into the from and to pools. At first,
-     * the from pool is the first half of the memory and the to pool is the
-     * second. However, these pointers will swap when the from pool is
-     * full.
-     */
-    HALF_MEMORY = MEMORY_SIZE / 2;
-    fromptr = mem;
-    freeptr = fromptr;
-    toptr = mem + HALF_MEMORY;
-    allocptr = toptr;
+    lay_out_pool();
+
+    mark_stack = NULL;
+    num_marks = 0;
+    max_marks = 0;
+
+    gc_active = false;
+    sweepptr = NULL;
+    work_debt = 0;
+    cycle_live = 0;
+    longest_pause_ns = 0;
+    cap_overruns = 0;
+
+    num_collections = 0;
+    total_pause_ns = 0;
+    total_bytes_copied = 0;
+    last_kind = NULL;
+    peak_memuse = 0;
+    begin_collection(0);
+
+    remembered = NULL;
+    num_remembered = 0;
+    max_remembered = 0;
 
     /* Start out with no references in our reference-table. */
     ref_table = NULL;
     num_refs = 0;
     max_refs = 0;
-
-
+    ref_gens = NULL;
+    free_refs = NULL;
+    num_free_refs = 0;
+    refs_freed = 0;
 }
 
 
@@ -151,18 +410,38 @@ bool is_pool_address(void *addr) {
 }
 
 
+/*! Returns true if a Value lives in the generational collector's nursery. */
+static bool is_young(Value *val) {
+    return ((unsigned char *) val >= nursery &&
+            (unsigned char *) val < nursery + NURSERY_SIZE);
+}
+
+
+/*! Returns the size of the space that new Values are allocated in. */
+static int space_size(void) {
+    return compacting ? MEMORY_SIZE : HALF_MEMORY;
+}
+
+
+/*! Returns the end of the space the old generation is allocated in. */
+static unsigned char *old_space_end(void) {
+    return compacting ? mem + MEMORY_SIZE : old_from + OLD_HALF;
+}
+
+
 /*! Returns true if the pool has the requested amount of space available. */
 bool has_space_available(int requested) {
+    if (gc_mode == GC_GENERATIONAL) {
+        return (freeptr + requested <= nursery + NURSERY_SIZE);
+    }
+
     /*
-     * Checks if the freeptr + requested doesn't exceed the position of the
-     * to pointer if the from pool is at lower addresses compared to the
-     * to pool. Otherwise checks if free + requested doesn't exceed the
-     * bounds of memory.
+     * Checks if the freeptr + requested doesn't exceed the end of the from
+     * pool.  Both pools are HALF_MEMORY bytes, so whatever fits in one can
+     * always be copied into the other.  A mark-compacted pool is never
+     * copied, so all of it can be used.
      */
-    if (fromptr < toptr) {
-        return (freeptr + requested <= toptr);
-    }
-    return (freeptr + requested <= mem + MEMORY_SIZE);
+    return (freeptr + requested <= fromptr + space_size());
 }
 
 
@@ -179,18 +458,55 @@ Value * mm_malloc(ValueType type, int data_size) {
         data_size = sizeof(IntegerValue) - sizeof(struct Value);
     } else if (type == VAL_FLOAT) {
         data_size = sizeof(FloatValue) - sizeof(struct Value);
-    } else if (type == VAL_LIST_NODE) {
+    } else if (type == VAL_LIST) {
         data_size = sizeof(ListValue) - sizeof(struct Value);
-    } else if (type == VAL_DICT_NODE) {
+    } else if (type == VAL_DICT) {
         data_size = sizeof(DictValue) - sizeof(struct Value);
+    } else if (type == VAL_ROPE) {
+        data_size = sizeof(RopeValue) - sizeof(struct Value);
     }
 
     int requested = sizeof(struct Value) + data_size;
     Value *new_value = NULL;
 
+    /* Values too big for the nursery are allocated straight into the old
+     * generation. */
+    if (gc_mode == GC_GENERATIONAL && requested > NURSERY_SIZE)
+        return mm_malloc_old(type, data_size);
+
+    /* The incremental collector pays for each allocation with a bounded
+     * amount of collection work. */
+    if (gc_mode == GC_INCREMENTAL)
+        incremental_step(requested);
+
     // If we don't have space, this might work.
-    if (!has_space_available(requested))
-        collect_garbage();
+    if (!has_space_available(requested)) {
+        if (gc_mode == GC_GENERATIONAL) {
+            collect_nursery();
+        } else {
+            if (gc_active) {
+                long start = now_ns();
+                finish_cycle();
+                record_pause(start);
+                end_collection("incremental");
+            }
+
+            if (!has_space_available(requested))
+                collect_garbage();
+            if (!has_space_available(requested))
+                grow_pool(requested);
+
+            /* Live data that leaves no room in a semispace may still fit in
+             * the whole pool. */
+            if (!has_space_available(requested) && !compacting) {
+                long start = now_ns();
+                begin_collection(memuse());
+                start_compacting();
+                record_pause(start);
+                end_collection("compact");
+            }
+        }
+    }
 
     if (has_space_available(requested)) {
 
@@ -201,13 +517,15 @@ Value * mm_malloc(ValueType type, int data_size) {
         make_reference(new_value);
 
         new_value->type = type;
+        new_value->seen = 0;
         new_value->data_size = data_size;
 
         /* Set the data area to a pattern so that it's easier to debug. */
-        memset(new_value + 1, 0xCC, data_size);
+        poison(new_value + 1, data_size, 0xCC);
 
         /* Update the free pointer to point past the new Value. */
         freeptr += requested;
+        note_memuse();
     } else {
         /* fromptr was previously mem */
         fprintf(stderr, "mm_malloc: cannot service request of size %d with"
@@ -219,64 +537,117 @@ Value * mm_malloc(ValueType type, int data_size) {
 }
 
 
+/*! Returns the ref_table slot a Reference to a Value in the pool uses. */
+static inline int ref_index(Reference ref) {
+    return ref & REF_INDEX_MASK;
+}
+
+/*!
+ * Resizes the ref_table, and the arrays that run alongside it, to hold size
+ * slots.  Slots that are added are unused and start at generation 0.
+ */
+static void resize_ref_table(int size) {
+    Value **new_table = realloc(ref_table, sizeof(Value *) * size);
+    unsigned char *new_gens = realloc(ref_gens, size);
+    Reference *new_free = realloc(free_refs, sizeof(Reference) * size);
+    if (new_table == NULL || new_gens == NULL || new_free == NULL) {
+        error("out of memory");
+        exit(1);
+    }
+    ref_table = new_table;
+    ref_gens = new_gens;
+    free_refs = new_free;
+
+    // Set all new reference entries to NULL, just to be safe/clean.
+    for (int i = max_refs; i < size; i++) {
+        ref_table[i] = NULL;
+        ref_gens[i] = 0;
+    }
+    max_refs = size;
+}
+
+
 /*! Allocates an available reference in the ref_table. */
 Reference make_reference(Value *value) {
-    int i;
-    Reference ref;
-    Value **new_table;
+    int index;
 
     assert(value != NULL);
 
-    /* If we don't have a reference table yet, allocate one. */
-    if (ref_table == NULL) {
-        ref_table = malloc(sizeof(Value *) * INITIAL_SIZE);
-        max_refs = INITIAL_SIZE;
-
-        // Set all new reference entries to NULL, just to be safe/clean.
-        for (i = 0; i < max_refs; i++) {
-            ref_table[i] = NULL;
+    /* Reuse a slot the collector freed, if there is one. */
+    if (num_free_refs > 0) {
+        index = free_refs[--num_free_refs];
+        assert(ref_table[index] == NULL);
+    } else {
+        /* If we got here, we don't have any available slots.  Find out if
+         * this is because we ran out of space in the reference table.
+         */
+        if (num_refs == max_refs) {
+            if (max_refs > REF_INDEX_MASK) {
+                error("too many live values");
+                exit(1);
+            }
+            /* Double the size of the reference table. */
+            resize_ref_table(max_refs == 0 ? INITIAL_SIZE : max_refs * 2);
         }
-    }
 
-    /* Scan through the reference table to see if we have any unused slots
-     * that we can use for this value.
-     */
-    for (i = 0; i < num_refs; i++) {
-        if (ref_table[i] == NULL) {
-            ref = (Reference) i;  // Probably unnecessary, but clearer.
-            ref_table[i] = value;
-            value->ref = ref;
-            return ref;
-        }
+        /* This becomes the new reference. */
+        index = num_refs++;
     }
 
-    /* If we got here, we don't have any available slots.  Find out if
-     * this is because we ran out of space in the reference table.
-     */
+    ref_table[index] = value;
+    value->ref = (ref_gens[index] << REF_INDEX_BITS) | index;
+    return value->ref;
+}
 
-    if (num_refs == max_refs) {
-        /* Double the size of the reference table. */
-        max_refs *= 2;
-        new_table = realloc(ref_table, sizeof(Value *) * max_refs);
-        if (new_table == NULL) {
-            error("out of memory");
-            exit(1);
-        }
-        ref_table = new_table;
 
-        // Set all new reference entries to NULL, just to be safe/clean.
-        for (i = num_refs; i < max_refs; i++) {
-            ref_table[i] = NULL;
-        }
-    }
+/*! Empties a slot of the ref_table, making the References to it stale. */
+static void release_slot(int index) {
+    ref_table[index] = NULL;
+    ref_gens[index] = (ref_gens[index] + 1) & REF_GEN_MASK;
+}
+
+
+/*!
+ * Marks a reference as unused, so make_reference() can hand it out again.
+ * References made before this one to the same slot become stale.
+ */
+static void free_reference(Reference ref) {
+    int index = ref & REF_INDEX_MASK;
+    release_slot(index);
+    free_refs[num_free_refs++] = index;
+    refs_freed++;
+}
+
+
+/*!
+ * Makes the ref_table follow the live Values, once enough references have
+ * been freed.  The unused slots at the end of the table are dropped, and the
+ * table is shrunk when it was mostly empty even before that, so that a table
+ * the program fills up again before the next collection is left alone.  The
+ * free stack is rebuilt so that the lowest slots are handed out first; that
+ * keeps the live references packed at the bottom, and leaves the ones at the
+ * top to be dropped when their Values die.
+ */
+static void compact_ref_table(void) {
+    if (refs_freed < num_refs / 2 && refs_freed < num_refs - num_free_refs)
+        return;
+    refs_freed = 0;
 
-    /* This becomes the new reference. */
-    ref = (Reference) num_refs;  // Probably unnecessary, but clearer.
-    num_refs++;
+    int used = num_refs;
+    while (num_refs > 0 && ref_table[num_refs - 1] == NULL)
+        num_refs--;
+
+    num_free_refs = 0;
+    for (int i = num_refs - 1; i >= 0; i--) {
+        if (ref_table[i] == NULL)
+            free_refs[num_free_refs++] = i;
+    }
 
-    ref_table[ref] = value;
-    value->ref = ref;
-    return ref;
+    int size = max_refs;
+    while (size > INITIAL_SIZE && used <= size / 4)
+        size /= 2;
+    if (size < max_refs)
+        resize_ref_table(size);
 }
 
 
@@ -284,21 +655,24 @@ Reference make_reference(Value *value) {
  * Dereferences a Reference into a Value-pointer so the value can be
  * accessed.
  *
- * A Reference of NULL_REF will cause this function to return NULL.
+ * A Reference of NULL_REF will cause this function to return NULL.  Immediate
+ * References have no Value, and must not be dereferenced.
  */
 Value * deref(Reference ref) {
     Value *pval = NULL;
+    int index = ref & REF_INDEX_MASK;
 
     if (ref == NULL_REF)
         return NULL;
 
     // Make sure the reference is actually a valid index.
-    assert(ref >= 0 && ref < num_refs);
+    assert(ref >= 0 && index < num_refs);
 
     // Make sure the reference refers to a valid entry.  Unused entries
-    // will be set to NULL.
-    pval = ref_table[ref];
+    // will be set to NULL, and reused ones have moved on a generation.
+    pval = ref_table[index];
     assert(pval != NULL);
+    assert(ref_gens[index] == ref >> REF_INDEX_BITS);
 
     // Make sure the reference's value is within the pool!
     assert(is_pool_address(pval));
@@ -307,18 +681,50 @@ Value * deref(Reference ref) {
 }
 
 
+/*!
+ * Informs the allocator that a Reference to value has just been stored inside
+ * the Value obj.  A NULL_REF obj means the store was to a global.
+ *
+ * The generational collector uses this to find old Values that refer into the
+ * nursery, since it does not trace the old generation during a minor
+ * collection.  The incremental collector copies value out of the semispace
+ * being evacuated, so that a Value it has already scanned can never be the
+ * only thing referring to one it has not copied.
+ */
+void mm_write_barrier(Reference obj, Reference value) {
+    if (gc_mode == GC_INCREMENTAL) {
+        if (gc_active)
+            shade_ref(value);
+        return;
+    }
+
+    if (gc_mode != GC_GENERATIONAL || obj == NULL_REF || !is_heap_ref(value))
+        return;
+
+    Value *container = deref(obj);
+    if (!is_young(container) && is_young(deref(value)))
+        remember(container);
+}
+
+
 /*! Get the amount of in-use memory. */
 int memuse() {
+    if (gc_mode == GC_GENERATIONAL) {
+        return (freeptr - nursery) + (old_free - old_from);
+    }
+    if (gc_active) {
+        /* The Values still being evacuated are counted as well. */
+        return (freeptr - fromptr) + (evac_end - toptr);
+    }
     /* fromptr was previously mem */
     return freeptr - fromptr;
 }
 
 
-/*! Print all allocated objects and free regions in the pool. */
-void memdump() {
-    unsigned char *curr = fromptr;
-    /*unsigned char *curr = toptr;*/
-    while (curr < freeptr) {
+/*! Print all allocated objects in the region [start, end) of the pool. */
+static void dump_region(unsigned char *start, unsigned char *end) {
+    unsigned char *curr = start;
+    while (curr < end) {
         Value *curr_value = (Value *) curr;
         int data_size = curr_value->data_size;
         int value_size = sizeof(Value) + data_size;
@@ -353,20 +759,47 @@ void memdump() {
                     ((StringValue *) curr_value)->string_value);
                 break;
 
-            case VAL_LIST_NODE: {
+            case VAL_LIST: {
                 ListValue *lv = (ListValue *) curr_value;
-                fprintf(stdout,
-                    "type = VAL_LIST_NODE; value_ref = %d; next_ref = %d\n",
-                    lv->list_node.value, lv->list_node.next);
+                fprintf(stdout, "type = VAL_LIST; length = %d; items_ref = %d\n",
+                    lv->length, lv->items);
                 break;
             }
 
-            case VAL_DICT_NODE: {
+            case VAL_DICT: {
                 DictValue *dv = (DictValue *) curr_value;
-                fprintf(stdout,
-                    "type = VAL_DICT_NODE; key_ref = %d; value_ref = %d; "
-                    "next_ref = %d\n",
-                    dv->dict_node.key, dv->dict_node.value, dv->dict_node.next);
+                fprintf(stdout, "type = VAL_DICT; length = %d; table_ref = %d\n",
+                    dv->length, dv->table);
+                break;
+            }
+
+            case VAL_ARRAY: {
+                ArrayValue *av = (ArrayValue *) curr_value;
+                int capacity = data_size / sizeof(Reference);
+                fprintf(stdout, "type = VAL_ARRAY; refs = [");
+                for (int i = 0; i < capacity; i++) {
+                    fprintf(stdout, i > 0 ? ", %d" : "%d", av->items[i]);
+                }
+                fprintf(stdout, "]\n");
+                break;
+            }
+
+            case VAL_DICT_TABLE: {
+                DictTableValue *tv = (DictTableValue *) curr_value;
+                fprintf(stdout, "type = VAL_DICT_TABLE; slots = %d; entries = [",
+                    tv->num_slots);
+                for (int i = 0; i < tv->num_entries; i++) {
+                    fprintf(stdout, i > 0 ? ", %d: %d" : "%d: %d",
+                        tv->entries[i].key, tv->entries[i].value);
+                }
+                fprintf(stdout, "]\n");
+                break;
+            }
+
+            case VAL_ROPE: {
+                RopeValue *rv = (RopeValue *) curr_value;
+                fprintf(stdout, "type = VAL_ROPE; length = %d; left = %d; "
+                    "right = %d\n", rv->length, rv->left, rv->right);
                 break;
             }
 
@@ -377,14 +810,50 @@ void memdump() {
 
         curr += value_size;
     }
+}
+
+
+/*! Print all allocated objects and free regions in the pool. */
+void memdump() {
+    if (gc_mode == GC_GENERATIONAL) {
+        fprintf(stdout, "Nursery:\n");
+        dump_region(nursery, freeptr);
+        fprintf(stdout, "Free  0x%08x; size %d\n", (int) (freeptr - mem),
+            (int) (nursery + NURSERY_SIZE - freeptr));
+
+        fprintf(stdout, "Old generation:\n");
+        dump_region(old_from, old_free);
+        fprintf(stdout, "Free  0x%08x; size %d\n", (int) (old_free - mem),
+            (int) (old_space_end() - old_free));
+        return;
+    }
+
+    dump_region(fromptr, freeptr);
     /* fromptr was previously mem */
     fprintf(stdout, "Free  0x%08x; size %lu\n", (int) (freeptr - fromptr),
-        HALF_MEMORY - (freeptr - fromptr));
+        space_size() - (freeptr - fromptr));
 }
 
 
 //// GARBAGE COLLECTOR ////
 
+/*!
+ * Fills memory that does not hold a live Value with a pattern, so that
+ * anything still reading it stands out: freed space is cleared to 0, and the
+ * data of a new Value is set to 0xCC until it is filled in.  Release builds,
+ * made with NDEBUG, skip this, so that the cost of a collection depends only
+ * on the live data and not on how large the pool is.
+ */
+static void poison(void *start, long size, int pattern) {
+#ifndef NDEBUG
+    memset(start, pattern, size);
+#else
+    (void) start;
+    (void) size;
+    (void) pattern;
+#endif
+}
+
 /*!
  * Takes in a Value and returns its size.
  */
@@ -393,214 +862,1550 @@ int get_size(Value *val) {
 }
 
 /*!
- * Copies a Value to where allocptr points to. Checks whether the Value
- * should be copied to the to pool. After copying, updates the reference
- * table and increments allocptr by the size of the value.
- *
- * Returns -1 if the Value was not copied over to the to pool and 0 if
- * copying occurred.
+ * Returns a pointer to the References held inside a Value, and stores how
+ * many there are in count.  Every Value type keeps its References next to
+ * each other, so the collector can trace any Value the same way.
+ */
+static Reference *get_children(Value *val, int *count) {
+    switch (val->type) {
+        case VAL_LIST:
+            *count = 1;
+            return &((ListValue *) val)->items;
+
+        case VAL_DICT:
+            *count = 1;
+            return &((DictValue *) val)->table;
+
+        case VAL_ARRAY:
+            *count = val->data_size / sizeof(Reference);
+            return ((ArrayValue *) val)->items;
+
+        case VAL_DICT_TABLE:
+            *count = 2 * ((DictTableValue *) val)->num_entries;
+            return &((DictTableValue *) val)->entries[0].key;
+
+        case VAL_ROPE:
+            *count = 2;
+            return &((RopeValue *) val)->left;
+
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+/*!
+ * Copies a Value to *dest, points its reference-table entry at the copy and
+ * advances *dest past it.  limit is the end of the space being copied into.
  *
  * We use memcpy and not memmove because memcpy always copies addresses
  * in the same order. On the other hand, memmove checks whether the
  * destination overlaps with the source and copies in the other
  * direction if this is is the case. Since we know our to and from
  * pools do not overlap, we use memcpy, which is more efficient
- * since it does not check for overlap. 
+ * since it does not check for overlap.
  */
-int copy_wrapper(Value *val) {
-    /* To break cycles. */
+static void forward_value(Value *val, unsigned char **dest,
+                          unsigned char *limit) {
     int value_size = get_size(val);
-    Reference ref = val->ref;
-    /* 
-     * Checks if the address of the Value is in the to pool. If it is,
-     * it is not copied in order to prevent cycles.
-     */
-    if (toptr > fromptr && (unsigned char *) ref_table[ref] > toptr) {
-        return -1;
-    }
-    if (toptr < fromptr && (unsigned char *) ref_table[ref] < fromptr) {
-        return -1;
-    }
-    /* Checks that we're not trying to copy over something 
-     * that's past the freeptr.
-     */
-    if ((unsigned char *) ref_table[ref] > freeptr) {
-        return -1;
-    }
-    memcpy(allocptr, ref_table[ref], value_size);
-    val->seen = 1;
-    ref_table[ref] = (Value *) allocptr;
-    allocptr += value_size;
-    return 0;
-}
 
-/*!
- * Copies over a Value.
- */
-void copy_val(Value *val);
+    if (*dest + value_size > limit) {
+        fprintf(stderr, "collect_garbage: not enough room to copy the"
+                " live data\n");
+        exit(1);
+    }
 
-/*!
- * Copies a list from start to end, including all of its elements
- * and its values. To copy a ListValue, we first copy the Value. 
- * We then copy the actual value contained in the ListNode and 
- * check if there is a next element.
- */
-void copy_list(Value *val) {
-    ListValue *curr_val = (ListValue *) val;
-    ListNode curr_node = curr_val->list_node;
+    count_live(val);
+    last_copied += value_size;
+    total_bytes_copied += value_size;
 
-    /* Checks if the Value was able to be copied to the to pool. */
-    if (copy_wrapper((Value *)curr_val) == -1) {
-        return;
-    }
-    Reference val_ref = curr_node.value;
-    
-    /* Checks if the value in the ListNode can be copied.*/
-    if (val_ref != NULL_REF) {
-        copy_val((Value *) deref(val_ref));
-    }
-    Reference next = curr_node.next;
-    
-    /* If there is a next ListValue, copy it as well. */
-    if (next != NULL_REF) {
-        copy_list((Value *) deref(next));
-    }
+    memcpy(*dest, val, value_size);
+    ((Value *) *dest)->seen = 0;
+    ref_table[ref_index(val->ref)] = (Value *) *dest;
+    *dest += value_size;
 }
 
-
 /*!
- * Copies a dictionary from start to end, including all of its
- * elements and its values. To copy a DictValue, we first copy the Value. 
- * We then copy the key and actual value contained in the DictNode and 
- * check if there is a next element.
+ * Walks the Values in [start, end) and clears the reference-table entry of
+ * each one that was not copied out.  A copied Value's entry points at its
+ * new location, so an entry still pointing into the region is garbage.
  */
-void copy_dict(Value *start) {
-    DictValue *curr_val = (DictValue *) start;
-    DictNode curr_node = curr_val->dict_node;
-
-    /* Checks if the Value was able to be copied to the to pool. */
-    if (copy_wrapper((Value *)curr_val) == -1) {
-        return;
-    }
-    Reference key = curr_node.key;
-
-    /* Checks if the key in the DictNode can be copied.*/
-    if (key != NULL_REF) {
-        copy_val((Value *)deref(key));
-    }
-    Reference value  = curr_node.value;
-
-    /* Checks if the value in the DictNode can be copied.*/
-    if (value != NULL_REF) {
-        copy_val((Value *)deref(value));
+static void sweep_region(unsigned char *start, unsigned char *end) {
+    unsigned char *curr = start;
+    while (curr < end) {
+        Value *val = (Value *) curr;
+        if (ref_table[ref_index(val->ref)] == val) {
+            free_reference(val->ref);
+        }
+        curr += get_size(val);
     }
-    Reference next = curr_node.next;
+}
 
-    /* If there is a next ListValue, copy it as well. */
-    if (next != NULL_REF) {
-        copy_dict((Value *) deref(next));
-    }
+/*! Returns true if a Value has already been copied into the to pool. */
+static bool in_to_pool(Value *val) {
+    return ((unsigned char *) val >= toptr &&
+            (unsigned char *) val < toptr + HALF_MEMORY);
 }
 
 /*!
- * Copies over a Value. Calls recursive functions for ListValue's
- * and DictValue's.
+ * Copies the Value behind a Reference to where allocptr points to, unless it
+ * is already in the to pool.  Its References are not followed here; that is
+ * left to the scan in stop_and_copy(), so copying never recurses.
  */
-void copy_val(Value *val) {
-    ValueType type = val->type;
-    if (type == VAL_LIST_NODE) {
-        copy_list(val);
-    }
-    else if (type == VAL_DICT_NODE) {
-        copy_dict(val); 
-    }
-    else {
-        copy_wrapper(val);
+static void copy_ref(Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    Value *val = ref_table[ref_index(ref)];
+    if (!in_to_pool(val)) {
+        forward_value(val, &allocptr, toptr + HALF_MEMORY);
     }
 }
 
 /*!
- * Takes in the name and reference of a global variable and copies 
- * the Value and any connected Values to the to pool.
+ * Takes in the name and reference of a global variable and copies
+ * the Value to the to pool.
  */
-void copy_global(const char *name, Reference ref) {
-    if (ref == NULL_REF) {
-        return;
-    }
-    Value *curr = deref(ref);
-    copy_val(curr);
-
+static void copy_global(const char *name, Reference ref) {
     /* Unused argument. */
     (void) name;
-}
 
-/*!
- * Iterates over the from pool and checks the seen field of all the Values.
- * If the seen field of the Value has not been changed by copy_global to 1, 
- * the Value will be garbage collected. We set the reference of this value to
- * NULL.
- */
-void iterate_from() {
-    unsigned char *curr = fromptr;
-    while (curr < freeptr) {
-        Value *val = (Value *) curr;
-        Reference ref = val->ref;
-        int seen = val->seen;
-        if (seen == 0) {
-            /* 
-             * Sets the address in the reference table to NULL 
-             * since the reference is not being used.
-             */
-            ref_table[ref] = NULL;
-        }
-        curr += get_size(val);
-    }
+    copy_ref(ref);
 }
 
 
 /*!
- * First iterates through the global variables and copies all global variables
- * and associated values to the to pool. Also marks values that have been copied
- * over as seen. Iterates through the from pool and sets the references of the 
- * objects that were not copied over to NULL. Sets the from pool to 0's,
- * switches the places of the fromptr and toptr, and updates freeptr and
- * allocptr accordingly.
+ * Copies every live Value to the to pool using Cheney's algorithm.  The
+ * roots are copied first; then a scan pointer walks the to pool from the
+ * start, copying whatever each Value refers to onto the end, until it
+ * catches up with allocptr.  The to pool itself is the queue of Values
+ * still to be scanned, so no recursion or extra memory is needed.
+ *
+ * Afterwards the from pool is swept for Values that were never copied, whose
+ * references are set to NULL.  The used part of the from pool is then
+ * poisoned, the places of the fromptr and toptr are switched, and freeptr and
+ * allocptr are updated accordingly.
  */
 void stop_and_copy(void) {
-    foreach_global(copy_global);
-    iterate_from();
-    size_t len = 0;
-    if (toptr > fromptr) {
-        len = toptr - fromptr;
-    }
-    else {
-        len = (mem + MEMORY_SIZE) -fromptr;
+    unsigned char *scan = toptr;
+    allocptr = toptr;
+
+    foreach_root(copy_global);
+
+    while (scan < allocptr) {
+        Value *val = (Value *) scan;
+        int count;
+        Reference *children = get_children(val, &count);
+
+        for (int i = 0; i < count; i++) {
+            copy_ref(children[i]);
+        }
+        scan += get_size(val);
     }
+
+    sweep_region(fromptr, freeptr);
+    poison(fromptr, freeptr - fromptr, 0x0);
+
     freeptr = allocptr;
-    memset(fromptr, 0x0, len);
     unsigned char *oldfrom = fromptr;
-    
+
     /* Switches the places of the from and to pools. */
     fromptr = toptr;
     toptr = oldfrom;
     allocptr = toptr;
 }
 
+
+//// MARK-COMPACT COLLECTOR ////
+
 /*!
- * Collects garbage using the stop and copy method.
+ * Marks the Value behind a Reference and pushes it on the mark stack, unless
+ * it has already been marked.  The seen field is the mark bit.
  */
-int collect_garbage(void) {
-    int reclaimed;
-    int before = freeptr - fromptr;
-    if (!quiet) {
-        fprintf(stderr, "Collecting garbage.\n");
+static void mark_ref(Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    Value *val = ref_table[ref_index(ref)];
+    if (val->seen)
+        return;
+
+    val->seen = 1;
+    if (num_marks == max_marks) {
+        max_marks = max_marks == 0 ? INITIAL_SIZE : max_marks * 2;
+        mark_stack = realloc(mark_stack, sizeof(Reference) * max_marks);
+        if (mark_stack == NULL) {
+            fprintf(stderr, "mark_ref: could not grow the mark stack\n");
+            exit(1);
+        }
+    }
+    mark_stack[num_marks++] = ref;
+}
+
+/*! Marks the Value of a global variable. */
+static void mark_global(const char *name, Reference ref) {
+    /* Unused argument. */
+    (void) name;
+
+    mark_ref(ref);
+}
+
+/*!
+ * Marks everything reachable from the roots.  The remembered set uses the
+ * same bit as the marks, so it is emptied first; nothing is left in the
+ * nursery afterwards for it to point into.
+ */
+static void mark_live(void) {
+    for (int i = 0; i < num_remembered; i++) {
+        ref_table[ref_index(remembered[i])]->seen = 0;
+    }
+    num_remembered = 0;
+
+    reset_live_counts();
+    foreach_root(mark_global);
+
+    while (num_marks > 0) {
+        Value *val = ref_table[ref_index(mark_stack[--num_marks])];
+        int count;
+        Reference *children = get_children(val, &count);
+
+        for (int i = 0; i < count; i++) {
+            mark_ref(children[i]);
+        }
     }
+}
+
+/*!
+ * Gives each marked Value in [start, end) its new address, the next free one
+ * from dest on, by writing it into the reference table, and frees the
+ * references of the unmarked ones.  Returns the end of the new addresses.
+ */
+static unsigned char *plan_region(unsigned char *start, unsigned char *end,
+                                  unsigned char *dest) {
+    for (unsigned char *curr = start; curr < end;
+            curr += get_size((Value *) curr)) {
+        Value *val = (Value *) curr;
+        if (val->seen) {
+            count_live(val);
+            ref_table[ref_index(val->ref)] = (Value *) dest;
+            dest += get_size(val);
+        } else {
+            free_reference(val->ref);
+        }
+    }
+
+    return dest;
+}
+
+/*!
+ * Moves the marked Values in [start, end) to the addresses plan_region() gave
+ * them, in address order, and clears their marks.
+ */
+static void slide_region(unsigned char *start, unsigned char *end) {
+    unsigned char *curr = start;
+
+    while (curr < end) {
+        Value *val = (Value *) curr;
+        int value_size = get_size(val);
+
+        if (val->seen) {
+            Value *moved = ref_table[ref_index(val->ref)];
+            if (moved != val) {
+                memmove(moved, val, value_size);
+                last_copied += value_size;
+                total_bytes_copied += value_size;
+            }
+            moved->seen = 0;
+        }
+        curr += value_size;
+    }
+}
+
+/*!
+ * Collects the whole pool in place with the Lisp-2 mark-compact algorithm.
+ * Everything reachable from the roots is marked first.  A pass over the
+ * pool then plans where each marked Value goes, and a second pass slides
+ * them there.  Values only ever move towards the start of the pool, and are
+ * moved in address order, so a move never overwrites a Value that has not
+ * been moved yet.
+ *
+ * The generational collector compacts the old generation to the start of the
+ * space after the nursery, and then moves what is left in the nursery in
+ * after it, which empties the nursery.  Those Values move up, but only over
+ * old ones that have been moved already.
+ */
+static void mark_compact(void) {
+    mark_live();
+
+    if (gc_mode == GC_GENERATIONAL) {
+        unsigned char *old_start = nursery + NURSERY_SIZE;
+        unsigned char *young_start = plan_region(old_from, old_free,
+                                                 old_start);
+        unsigned char *dest = plan_region(nursery, freeptr, young_start);
+
+        if (dest > mem + MEMORY_SIZE) {
+            fprintf(stderr, "collect_garbage: not enough room to compact"
+                    " the live data\n");
+            exit(1);
+        }
+
+        slide_region(old_from, old_free);
+        slide_region(nursery, freeptr);
+
+        if (old_free > dest)
+            poison(dest, old_free - dest, 0x0);
+        poison(nursery, freeptr - nursery, 0x0);
+        old_from = old_start;
+        old_free = dest;
+        freeptr = nursery;
+        return;
+    }
+
+    unsigned char *dest = plan_region(fromptr, freeptr, mem);
+    slide_region(fromptr, freeptr);
+
+    poison(dest, freeptr - dest, 0x0);
+    fromptr = mem;
+    freeptr = dest;
+}
+
+/*!
+ * Switches the collector over to mark-compact.  The live data is slid down
+ * to the start of the pool, or of the old generation, so that the rest of it
+ * is free.
+ */
+static void start_compacting(void) {
+    if (!quiet) {
+        fprintf(stderr, "Switching to mark-compact collection.\n");
+    }
+
+    compacting = true;
+    mark_compact();
+}
+
+/*!
+ * Switches back to copying collection.  The live data is already at the
+ * start of the pool, or of the old generation, and by the time this is
+ * called, fits in the first semispace.
+ */
+static void stop_compacting(void) {
+    static const char *names[] = {
+        [GC_COPY] = "stop-and-copy",
+        [GC_GENERATIONAL] = "generational",
+        [GC_INCREMENTAL] = "incremental"
+    };
+
+    if (!quiet) {
+        fprintf(stderr, "Switching back to %s collection.\n",
+                names[gc_mode]);
+    }
+
+    if (gc_mode == GC_GENERATIONAL) {
+        assert(old_free <= old_from + OLD_HALF);
+        compacting = false;
+        old_to = old_from + OLD_HALF;
+        return;
+    }
+
+    assert(freeptr <= mem + HALF_MEMORY);
+    compacting = false;
+    fromptr = mem;
+    toptr = mem + HALF_MEMORY;
+    allocptr = toptr;
+    cycle_live = freeptr - fromptr;
+}
+
+//// END MARK-COMPACT COLLECTOR ////
+
+
+//// PARALLEL COPYING COLLECTOR ////
+
+/*
+ * With more than one GC thread, a large pool is stop-and-copied by
+ * parallel_copy() instead of stop_and_copy().  The threads work through three
+ * phases together, waiting for each other between them:
+ *
+ *  1. Marking.  The roots are dealt out among the threads, and each one
+ *     traces everything reachable from its share.  A Value belongs to the
+ *     thread that claims it first, by atomically setting its byte in a table
+ *     of claims indexed like the ref_table.  The claims are kept apart from
+ *     the Values because Values are not aligned in the pool.  Each thread
+ *     keeps the Values it has yet to scan on a private stack, and when some
+ *     other thread has run out of work, it moves half of them to a shared
+ *     stack for that thread to steal.
+ *  2. Copying.  Each thread copies the Values it claimed into its own part
+ *     of the to pool.  The parts are laid end to end in thread order, each
+ *     exactly as large as what its thread claimed, so none of the to pool is
+ *     wasted between them.
+ *  3. Sweeping.  The ref_table is split into equal ranges, and each thread
+ *     frees the references in its range that still point into the from pool.
+ */
+
+/*! Pools with less than this in use are always copied by a single thread. */
+#define PARALLEL_MIN_BYTES (1 << 20)
+
+/*! One of the threads of a parallel collection, and what it has done. */
+typedef struct GCWorker {
+    int id;
+    pthread_t thread;
+
+    /*! Every Value this thread claimed, all of which it copies. */
+    Value **claimed;
+    long num_claimed;
+    long max_claimed;
+    long claimed_bytes;
+
+    /*! The Values this thread claimed but has not scanned yet. */
+    Value **stack;
+    long num_stack;
+    long max_stack;
+
+    /*! Values to scan that other threads may take, guarded by lock. */
+    pthread_mutex_t lock;
+    Value **shared;
+    atomic_long num_shared;
+    long max_shared;
+
+    /*! The references this thread freed while sweeping. */
+    Reference *freed;
+    long num_freed;
+
+    /*! How many of each type of Value this thread copied. */
+    int live_objects[NUM_VALUE_TYPES];
+} GCWorker;
+
+/*! How many threads a stop-and-copy collection may use. */
+static int gc_threads = 1;
+
+/*! The threads' state, kept from one collection to the next. */
+static GCWorker *workers;
+
+/*! The roots of the current parallel collection. */
+static Reference *par_roots;
+static int num_par_roots;
+static int max_par_roots;
+
+/*! Which slots of the ref_table have been claimed in this collection. */
+static atomic_uchar *claims;
+
+/*! The number of threads that are looking for work to steal. */
+static atomic_int idle_workers;
+
+/*! Keeps the threads together from one phase to the next. */
+static pthread_barrier_t phase_barrier;
+
+/*! Appends a Value to a growable array of them. */
+static void push_value(Value ***array, long *num, long *max, Value *val) {
+    if (*num == *max) {
+        *max = *max == 0 ? INITIAL_SIZE : *max * 2;
+        *array = realloc(*array, sizeof(Value *) * *max);
+        if (*array == NULL) {
+            fprintf(stderr, "parallel_copy: out of memory\n");
+            exit(1);
+        }
+    }
+    (*array)[(*num)++] = val;
+}
+
+/*! foreach_root() callback that records a root of the collection. */
+static void gather_root(const char *name, Reference ref) {
+    (void) name;
+
+    if (num_par_roots == max_par_roots) {
+        max_par_roots = max_par_roots == 0 ? INITIAL_SIZE : max_par_roots * 2;
+        par_roots = realloc(par_roots, sizeof(Reference) * max_par_roots);
+        if (par_roots == NULL) {
+            fprintf(stderr, "parallel_copy: out of memory\n");
+            exit(1);
+        }
+    }
+    par_roots[num_par_roots++] = ref;
+}
+
+/*!
+ * Claims the Value behind a Reference for a thread, unless another thread
+ * already has, and puts it on the thread's stack to be scanned.
+ */
+static void claim_ref(GCWorker *w, Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    int index = ref_index(ref);
+    if (atomic_load_explicit(&claims[index], memory_order_relaxed) ||
+            atomic_exchange_explicit(&claims[index], 1, memory_order_relaxed))
+        return;
+
+    Value *val = ref_table[index];
+    push_value(&w->claimed, &w->num_claimed, &w->max_claimed, val);
+    push_value(&w->stack, &w->num_stack, &w->max_stack, val);
+    w->claimed_bytes += get_size(val);
+}
+
+/*!
+ * Moves the older half of a thread's private stack to its shared one, where
+ * idle threads can take it.  The shared stack must be empty.
+ */
+static void share_work(GCWorker *w) {
+    long half = w->num_stack / 2;
+
+    pthread_mutex_lock(&w->lock);
+    if (half > w->max_shared) {
+        w->max_shared = w->num_stack;
+        w->shared = realloc(w->shared, sizeof(Value *) * w->max_shared);
+        if (w->shared == NULL) {
+            fprintf(stderr, "parallel_copy: out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(w->shared, w->stack, sizeof(Value *) * half);
+    atomic_store(&w->num_shared, half);
+    pthread_mutex_unlock(&w->lock);
+
+    memmove(w->stack, w->stack + half, sizeof(Value *) * (w->num_stack - half));
+    w->num_stack -= half;
+}
+
+/*!
+ * Moves Values from the shared stack of from onto the private stack of to:
+ * all of them if they are the same thread, and half of them otherwise.
+ * Returns false if there were none.
+ */
+static bool take_work(GCWorker *to, GCWorker *from) {
+    pthread_mutex_lock(&from->lock);
+    long num = atomic_load(&from->num_shared);
+    long taken = to == from ? num : (num + 1) / 2;
+
+    for (long i = num - taken; i < num; i++) {
+        push_value(&to->stack, &to->num_stack, &to->max_stack,
+                   from->shared[i]);
+    }
+    atomic_store(&from->num_shared, num - taken);
+    pthread_mutex_unlock(&from->lock);
+
+    return taken > 0;
+}
 
-    // TODO:  Implement garbage collection.
-    stop_and_copy();
-    // END TODO
-    int after = freeptr - fromptr;
+/*!
+ * Waits for another thread to share some work, and steals it.  Returns false
+ * once every thread is waiting, which means the marking is done: only a
+ * thread with work of its own ever shares any.
+ */
+static bool steal_work(GCWorker *w) {
+    atomic_fetch_add(&idle_workers, 1);
+
+    for (;;) {
+        for (int i = 1; i < gc_threads; i++) {
+            GCWorker *victim = &workers[(w->id + i) % gc_threads];
+            if (atomic_load(&victim->num_shared) == 0)
+                continue;
+
+            /* A thread holding stolen work must not be counted as idle. */
+            atomic_fetch_sub(&idle_workers, 1);
+            if (take_work(w, victim))
+                return true;
+            atomic_fetch_add(&idle_workers, 1);
+        }
+
+        if (atomic_load(&idle_workers) == gc_threads)
+            return false;
+        sched_yield();
+    }
+}
+
+/*! Phase 1: marks everything reachable from a thread's share of the roots. */
+static void mark_parallel(GCWorker *w) {
+    for (int i = w->id; i < num_par_roots; i += gc_threads) {
+        claim_ref(w, par_roots[i]);
+    }
+
+    do {
+        while (w->num_stack > 0 || take_work(w, w)) {
+            Value *val = w->stack[--w->num_stack];
+            int count;
+            Reference *children = get_children(val, &count);
+
+            for (int i = 0; i < count; i++) {
+                claim_ref(w, children[i]);
+            }
+
+            if (w->num_stack > 1 && atomic_load(&idle_workers) > 0 &&
+                    atomic_load(&w->num_shared) == 0) {
+                share_work(w);
+            }
+        }
+    } while (steal_work(w));
+}
+
+/*! Phase 2: copies the Values a thread claimed into its part of the to pool. */
+static void copy_claimed(GCWorker *w) {
+    unsigned char *dest = toptr;
+    for (int i = 0; i < w->id; i++) {
+        dest += workers[i].claimed_bytes;
+    }
+
+    for (long i = 0; i < w->num_claimed; i++) {
+        Value *val = w->claimed[i];
+        int value_size = get_size(val);
+
+        memcpy(dest, val, value_size);
+        ((Value *) dest)->seen = 0;
+        ref_table[ref_index(val->ref)] = (Value *) dest;
+        w->live_objects[val->type]++;
+        dest += value_size;
+    }
+}
+
+/*! Phase 3: frees the references in a thread's range of the ref_table. */
+static void sweep_parallel(GCWorker *w) {
+    int start = (long) num_refs * w->id / gc_threads;
+    int end = (long) num_refs * (w->id + 1) / gc_threads;
+
+    w->freed = malloc(sizeof(Reference) * (end - start + 1));
+    if (w->freed == NULL) {
+        fprintf(stderr, "parallel_copy: out of memory\n");
+        exit(1);
+    }
+
+    for (int i = start; i < end; i++) {
+        unsigned char *val = (unsigned char *) ref_table[i];
+        if (val >= fromptr && val < fromptr + HALF_MEMORY) {
+            release_slot(i);
+            w->freed[w->num_freed++] = i;
+        }
+    }
+}
+
+/*! The body of each thread of a parallel collection. */
+static void *run_worker(void *arg) {
+    GCWorker *w = arg;
+
+    mark_parallel(w);
+    pthread_barrier_wait(&phase_barrier);
+    copy_claimed(w);
+    pthread_barrier_wait(&phase_barrier);
+    sweep_parallel(w);
+
+    return NULL;
+}
+
+/*!
+ * Does what stop_and_copy() does, but with gc_threads threads.  The calling
+ * thread is the first of them.
+ */
+static void parallel_copy(void) {
+    if (workers == NULL) {
+        workers = calloc(gc_threads, sizeof(GCWorker));
+        if (workers == NULL) {
+            fprintf(stderr, "parallel_copy: out of memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < gc_threads; i++) {
+            workers[i].id = i;
+            pthread_mutex_init(&workers[i].lock, NULL);
+        }
+    }
+
+    claims = calloc(num_refs, sizeof(atomic_uchar));
+    if (claims == NULL) {
+        fprintf(stderr, "parallel_copy: out of memory\n");
+        exit(1);
+    }
+
+    num_par_roots = 0;
+    foreach_root(gather_root);
+
+    for (int i = 0; i < gc_threads; i++) {
+        GCWorker *w = &workers[i];
+        w->num_claimed = 0;
+        w->claimed_bytes = 0;
+        w->num_stack = 0;
+        atomic_store(&w->num_shared, 0);
+        w->num_freed = 0;
+        memset(w->live_objects, 0, sizeof(w->live_objects));
+    }
+    atomic_store(&idle_workers, 0);
+    pthread_barrier_init(&phase_barrier, NULL, gc_threads);
+
+    for (int i = 1; i < gc_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker,
+                           &workers[i]) != 0) {
+            fprintf(stderr, "parallel_copy: could not start a thread\n");
+            exit(1);
+        }
+    }
+    run_worker(&workers[0]);
+    for (int i = 1; i < gc_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&phase_barrier);
+
+    /* Gather up what the threads did. */
+    unsigned char *dest = toptr;
+    for (int i = 0; i < gc_threads; i++) {
+        GCWorker *w = &workers[i];
+
+        memcpy(free_refs + num_free_refs, w->freed,
+               sizeof(Reference) * w->num_freed);
+        num_free_refs += w->num_freed;
+        refs_freed += w->num_freed;
+        free(w->freed);
+        w->freed = NULL;
+
+        for (int t = 0; t < NUM_VALUE_TYPES; t++) {
+            live_objects[t] += w->live_objects[t];
+        }
+        last_live += w->claimed_bytes;
+        last_copied += w->claimed_bytes;
+        total_bytes_copied += w->claimed_bytes;
+        dest += w->claimed_bytes;
+    }
+
+    free(claims);
+    claims = NULL;
+
+    poison(fromptr, freeptr - fromptr, 0x0);
+    freeptr = dest;
+
+    /* Switches the places of the from and to pools. */
+    unsigned char *oldfrom = fromptr;
+    fromptr = toptr;
+    toptr = oldfrom;
+    allocptr = toptr;
+}
+
+/*! Frees the threads' state. */
+static void free_workers(void) {
+    if (workers != NULL) {
+        for (int i = 0; i < gc_threads; i++) {
+            free(workers[i].claimed);
+            free(workers[i].stack);
+            free(workers[i].shared);
+            pthread_mutex_destroy(&workers[i].lock);
+        }
+        free(workers);
+        workers = NULL;
+    }
+
+    free(par_roots);
+    par_roots = NULL;
+    max_par_roots = 0;
+}
+
+/*!
+ * Sets how many threads the stop-and-copy collector may use.  This must be
+ * called before mm_init().
+ */
+void mm_set_gc_threads(int threads) {
+    gc_threads = threads;
+}
+
+//// END PARALLEL COPYING COLLECTOR ////
+
+
+//// GENERATIONAL COLLECTOR ////
+
+/*!
+ * Adds an old Value to the remembered set, unless it is already there.  The
+ * set grows by doubling, just like the reference table.
+ */
+static void remember(Value *obj) {
+    Reference *new_set;
+
+    if (obj->seen)
+        return;
+
+    if (num_remembered == max_remembered) {
+        max_remembered = max_remembered ? max_remembered * 2 : INITIAL_SIZE;
+        new_set = realloc(remembered, sizeof(Reference) * max_remembered);
+        if (new_set == NULL) {
+            fprintf(stderr, "remember: out of memory\n");
+            exit(1);
+        }
+        remembered = new_set;
+    }
+
+    obj->seen = 1;
+    remembered[num_remembered++] = obj->ref;
+}
+
+/*!
+ * Remembers an old Value whose References were not set through the write
+ * barrier, such as one allocated directly into the old generation.
+ */
+static void remember_if_container(Value *obj) {
+    /* Its fields have not been filled in yet, so it has to be judged by its
+     * type rather than by get_children(). */
+    switch (obj->type) {
+        case VAL_LIST:
+        case VAL_DICT:
+        case VAL_ARRAY:
+        case VAL_DICT_TABLE:
+        case VAL_ROPE:
+            remember(obj);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*! Promotes a Value to the old generation if it still lives in the nursery. */
+static void promote_ref(Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    Value *val = ref_table[ref_index(ref)];
+    if (is_young(val)) {
+        forward_value(val, &old_free, old_space_end());
+    }
+}
+
+/*! Promotes the Values referenced by each child of a Value. */
+static void promote_children(Value *val) {
+    int count;
+    Reference *children = get_children(val, &count);
+
+    for (int i = 0; i < count; i++) {
+        promote_ref(children[i]);
+    }
+}
+
+/*! foreach_root() callback for a minor collection. */
+static void promote_global(const char *name, Reference ref) {
+    (void) name;
+    promote_ref(ref);
+}
+
+/*!
+ * Collects the nursery.  The roots are the usual ones plus the remembered set;
+ * everything they reach in the nursery is promoted into the old generation,
+ * and the promoted Values are then scanned in order, Cheney-style, so that
+ * whatever they reach is promoted as well.  The nursery is empty afterwards.
+ */
+static void minor_collection(void) {
+    unsigned char *scan = old_free;
+
+    foreach_root(promote_global);
+
+    for (int i = 0; i < num_remembered; i++) {
+        Value *obj = ref_table[ref_index(remembered[i])];
+        obj->seen = 0;
+        promote_children(obj);
+    }
+    num_remembered = 0;
+
+    while (scan < old_free) {
+        Value *val = (Value *) scan;
+        promote_children(val);
+        scan += get_size(val);
+    }
+
+    sweep_region(nursery, freeptr);
+    poison(nursery, freeptr - nursery, 0x0);
+    freeptr = nursery;
+}
+
+/*! Copies a Value into old_to during a major collection, if not yet there. */
+static void evacuate_ref(Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    Value *val = ref_table[ref_index(ref)];
+    if ((unsigned char *) val < old_to ||
+            (unsigned char *) val >= old_to + OLD_HALF) {
+        forward_value(val, &allocptr, old_to + OLD_HALF);
+    }
+}
+
+/*! foreach_root() callback for a major collection. */
+static void evacuate_global(const char *name, Reference ref) {
+    (void) name;
+    evacuate_ref(ref);
+}
+
+/*!
+ * Collects the whole heap.  Live Values from both the nursery and the old
+ * generation are copied into the other old semispace, which then becomes the
+ * old generation.  Nothing is left in the nursery, so the remembered set is
+ * emptied as well.
+ */
+static void major_collection(void) {
+    unsigned char *scan = old_to;
+    allocptr = old_to;
+
+    foreach_root(evacuate_global);
+
+    while (scan < allocptr) {
+        Value *val = (Value *) scan;
+        int count;
+        Reference *children = get_children(val, &count);
+
+        for (int i = 0; i < count; i++) {
+            evacuate_ref(children[i]);
+        }
+        scan += get_size(val);
+    }
+
+    sweep_region(old_from, old_free);
+    sweep_region(nursery, freeptr);
+    poison(old_from, old_free - old_from, 0x0);
+    poison(nursery, freeptr - nursery, 0x0);
+
+    unsigned char *oldfrom = old_from;
+    old_from = old_to;
+    old_to = oldfrom;
+    old_free = allocptr;
+    freeptr = nursery;
+    num_remembered = 0;
+}
+
+/*!
+ * Allocates a Value directly in the old generation.  This is used for Values
+ * that are too big to ever fit in the nursery.
+ */
+static Value *mm_malloc_old(ValueType type, int data_size) {
+    int requested = sizeof(struct Value) + data_size;
+
+    if (old_free + requested > old_space_end())
+        collect_garbage();
+    if (old_free + requested > old_space_end())
+        grow_pool(requested);
+
+    /* The old generation's live data may still fit once the two semispaces
+     * are used as one. */
+    if (old_free + requested > old_space_end() && !compacting) {
+        long start = now_ns();
+        begin_collection(memuse());
+        start_compacting();
+        record_pause(start);
+        end_collection("compact");
+    }
+
+    if (old_free + requested > old_space_end()) {
+        fprintf(stderr, "mm_malloc: cannot service request of size %d with"
+                " %d bytes allocated\n", requested, memuse());
+        exit(1);
+    }
+
+    Value *new_value = (Value *) old_free;
+    make_reference(new_value);
+
+    new_value->type = type;
+    new_value->seen = 0;
+    new_value->data_size = data_size;
+    poison(new_value + 1, data_size, 0xCC);
+    old_free += requested;
+    note_memuse();
+
+    /* Its References are about to be filled in without going through the
+     * barrier, and may well point into the nursery. */
+    remember_if_container(new_value);
+
+    return new_value;
+}
+
+/*!
+ * Runs a minor collection to empty the nursery.  If the old generation might
+ * not have room for everything in the nursery, a major collection is run
+ * instead.  Returns the number of bytes reclaimed.
+ */
+static int collect_nursery(void) {
+    int before = memuse();
+
+    if (old_free + (freeptr - nursery) > old_space_end())
+        return collect_garbage();
+
+    if (!quiet) {
+        fprintf(stderr, "Collecting young garbage.\n");
+    }
+
+    long start = now_ns();
+    begin_collection(freeptr - nursery);
+    minor_collection();
+    record_pause(start);
+    end_collection("minor");
+
+    int reclaimed = before - memuse();
+    if (!quiet) {
+        fprintf(stderr, "Reclaimed %d bytes of garbage.\n", reclaimed);
+    }
+
+    return reclaimed;
+}
+
+//// END GENERATIONAL COLLECTOR ////
+
+
+//// INCREMENTAL COLLECTOR ////
+
+/*! Returns the current time of the monotonic clock in nanoseconds. */
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*!
+ * Records a collection pause that started at the time start.  Incremental
+ * pauses that run past the pause cap are counted, and reported unless quiet.
+ */
+static void record_pause(long start) {
+    long pause = now_ns() - start;
+    if (pause > longest_pause_ns)
+        longest_pause_ns = pause;
+    if (pause > last_pause_ns)
+        last_pause_ns = pause;
+    total_pause_ns += pause;
+
+    if (gc_mode == GC_INCREMENTAL && !compacting && pause > pause_cap_ns) {
+        cap_overruns++;
+        if (!quiet) {
+            fprintf(stderr, "Collection pause of %.3f ms overran the "
+                    "%.3f ms cap.\n", pause / 1e6, pause_cap_ns / 1e6);
+        }
+    }
+}
+
+/*! Returns true if a Value is still in the semispace being evacuated. */
+static bool in_evacuated_pool(Value *val) {
+    return ((unsigned char *) val >= toptr &&
+            (unsigned char *) val < toptr + HALF_MEMORY);
+}
+
+/*! Copies a Value out of the evacuated semispace, if it is still there. */
+static void shade_ref(Reference ref) {
+    if (!is_heap_ref(ref))
+        return;
+
+    Value *val = ref_table[ref_index(ref)];
+    if (in_evacuated_pool(val)) {
+        forward_value(val, &freeptr, fromptr + HALF_MEMORY);
+    }
+}
+
+/*! foreach_root() callback for the incremental collector. */
+static void shade_global(const char *name, Reference ref) {
+    (void) name;
+    shade_ref(ref);
+}
+
+/*!
+ * Scans Values at scanptr, copying whatever they refer to, until at least
+ * budget bytes have been scanned or the scan catches up with freeptr.  If
+ * deadline is not 0, scanning also stops once that time has passed.  Returns
+ * the number of bytes scanned.
+ */
+static long scan_some(long budget, long deadline) {
+    long scanned = 0;
+    int values = 0;
+
+    while (scanptr < freeptr && scanned < budget) {
+        Value *val = (Value *) scanptr;
+        int count;
+        Reference *children = get_children(val, &count);
+
+        for (int i = 0; i < count; i++) {
+            shade_ref(children[i]);
+        }
+
+        scanned += get_size(val);
+        scanptr += get_size(val);
+
+        /* Reading the clock is not free, so only do it now and then. */
+        if (deadline && ++values % 64 == 0 && now_ns() > deadline)
+            break;
+    }
+
+    return scanned;
+}
+
+/*!
+ * Sweeps the evacuated semispace from sweepptr, like scan_some() does for
+ * scanning, and clears the part that was swept.  When the whole semispace
+ * has been swept, sweepptr is set back to NULL.
+ */
+static long sweep_some(long budget, long deadline) {
+    unsigned char *start = sweepptr;
+    int values = 0;
+
+    while (sweepptr < evac_end && sweepptr - start < budget) {
+        Value *val = (Value *) sweepptr;
+        sweepptr += get_size(val);
+
+        if (ref_table[ref_index(val->ref)] == val) {
+            free_reference(val->ref);
+        }
+
+        if (deadline && ++values % 64 == 0 && now_ns() > deadline)
+            break;
+    }
+
+    long swept = sweepptr - start;
+    poison(start, swept, 0x0);
+
+    if (sweepptr == evac_end) {
+        sweepptr = NULL;
+        compact_ref_table();
+    }
+
+    return swept;
+}
+
+/*!
+ * Starts an incremental cycle by flipping the semispaces and copying the
+ * Values the globals refer to.  Everything else is copied later, a little at
+ * a time, by incremental_step().
+ */
+static void start_cycle(void) {
+    /* The last cycle's sweep has to be done before its semispace is reused. */
+    assert(sweepptr == NULL && !gc_active);
+
+    begin_collection(memuse());
+    unsigned char *oldfrom = fromptr;
+
+    evac_end = freeptr;
+    fromptr = toptr;
+    toptr = oldfrom;
+    freeptr = fromptr;
+    scanptr = fromptr;
+    work_debt = 0;
+    gc_active = true;
+
+    foreach_root(shade_global);
+}
+
+/*!
+ * Tries to end the copying part of a cycle, once the scan has caught up with
+ * freeptr.  The globals are scanned again, since stores to them are not
+ * covered by the write barrier, and whatever that copies is scanned as well.
+ * If the deadline (0 for none) passes before the scan catches up again,
+ * copying goes on, and this is tried again the next time it does.  Otherwise
+ * the evacuated semispace holds only garbage, and is left to be swept.
+ * Returns true if copying ended.
+ */
+static bool end_copying(long deadline) {
+    foreach_root(shade_global);
+    scan_some(MEMORY_SIZE, deadline);
+    if (scanptr < freeptr)
+        return false;
+
+    gc_active = false;
+    sweepptr = toptr;
+    work_debt = 0;
+    cycle_live = last_copied;
+    return true;
+}
+
+/*! Completes the current incremental cycle in one go. */
+static void finish_cycle(void) {
+    if (gc_active)
+        end_copying(0);
+    if (sweepptr != NULL)
+        sweep_some(MEMORY_SIZE, 0);
+}
+
+/*!
+ * Returns how many bytes of work the collector owes after an allocation of
+ * requested bytes, when work bytes of it are left to do before room more
+ * bytes have been allocated.  Each allocation pays for its share of the work
+ * left, which grows as the room shrinks, but for at least INCR_WORK_RATIO
+ * bytes per byte.  What is owed includes the work_debt carried over, and is
+ * never more than the work left.
+ */
+static long work_owed(long work, long room, int requested) {
+    long owed = room > requested ? work * requested / room + 1 : work;
+    if (owed < (long) requested * INCR_WORK_RATIO)
+        owed = (long) requested * INCR_WORK_RATIO;
+
+    owed += work_debt;
+    return owed < work ? owed : work;
+}
+
+/*!
+ * Does the collection work owed for an allocation of requested bytes.  A new
+ * cycle is started when the semispace passes the trigger; otherwise the
+ * running cycle is advanced by the work_owed(), for no longer than the pause
+ * cap.  Work that does not fit within the cap is carried over to the next
+ * allocation.  The copying is paced to be done while there is still room in
+ * the semispace for every evacuated Value not copied yet, and the sweep to be
+ * done by the time the semispace reaches the trigger again.  Only if copying
+ * falls behind that anyway is the rest of it done at once, past the cap.
+ */
+static void incremental_step(int requested) {
+    if (compacting)
+        return;
+
+    long start = now_ns();
+    long deadline = start + pause_cap_ns;
+    bool finished = false;
+
+    if (sweepptr != NULL) {
+        long room = fromptr + HALF_MEMORY / INCR_TRIGGER_FRACTION - freeptr;
+        work_debt = work_owed(evac_end - sweepptr, room, requested);
+        work_debt -= sweep_some(work_debt, deadline);
+        if (sweepptr == NULL) {
+            work_debt = 0;
+            adapt_pool_size();
+        }
+    } else if (!gc_active) {
+        if (freeptr + requested <= fromptr + HALF_MEMORY / INCR_TRIGGER_FRACTION)
+            return;
+
+        /* With this much live, a cycle leaves so little room to allocate in
+         * that its steps cannot be kept under the cap; collect_garbage()
+         * mark-compacts the pool instead. */
+        if (cycle_live > (long) HALF_MEMORY * COMPACT_ENTER_PERCENT / 100) {
+            collect_garbage();
+            return;
+        }
+
+        start_cycle();
+    }
+
+    if (gc_active) {
+        int before = memuse();
+        long to_copy = (evac_end - toptr) - last_copied;
+        long room = (fromptr + HALF_MEMORY - freeptr) - to_copy;
+
+        if (room <= requested) {
+            finished = end_copying(0);
+        } else {
+            work_debt = work_owed(to_copy + (freeptr - scanptr), room,
+                                  requested);
+            work_debt -= scan_some(work_debt, deadline);
+            if (scanptr == freeptr && now_ns() < deadline)
+                finished = end_copying(deadline);
+        }
+
+        if (finished && !quiet) {
+            fprintf(stderr, "Reclaimed %d bytes of garbage "
+                    "incrementally.\n", before - memuse());
+        }
+    }
+
+    record_pause(start);
+    if (finished)
+        end_collection("incremental");
+}
+
+/*! Sets the cap on how long one incremental step may run. */
+void mm_set_pause_cap(long usec) {
+    pause_cap_ns = usec * 1000;
+}
+
+/*! Returns the longest collection pause seen so far, in nanoseconds. */
+long mm_longest_pause(void) {
+    return longest_pause_ns;
+}
+
+//// END INCREMENTAL COLLECTOR ////
+
+
+//// POOL RESIZING ////
+
+/*!
+ * Returns how much live data a pool of the given size can hold: a semispace,
+ * or an old-generation semispace for the generational collector.
+ */
+static int space_for_size(int size) {
+    if (gc_mode == GC_GENERATIONAL)
+        return (size - size / NURSERY_FRACTION) / 2;
+    return size / 2;
+}
+
+/*!
+ * Copies the Values in [start, end) to dest, and points their
+ * reference-table entries at the copies.  Returns the end of the copies.
+ */
+static unsigned char *move_region(unsigned char *start, unsigned char *end,
+                                  unsigned char *dest) {
+    unsigned char *curr;
+
+    memcpy(dest, start, end - start);
+    for (curr = dest; curr < dest + (end - start);
+            curr += get_size((Value *) curr)) {
+        Value *val = (Value *) curr;
+        ref_table[ref_index(val->ref)] = val;
+    }
+    return curr;
+}
+
+/*!
+ * Replaces the pool with a new one of the given size, and moves the Values
+ * into it.  This must only be done between collections, when all of the
+ * Values are packed at the start of the spaces they are allocated in.
+ * Returns false, leaving the pool as it was, if the memory cannot be had.
+ */
+static bool resize_pool(int size) {
+    unsigned char *new_mem = malloc(size);
+    if (new_mem == NULL)
+        return false;
+
+    assert(!compacting && !gc_active && sweepptr == NULL);
+    if (!quiet) {
+        fprintf(stderr, "Resizing the memory pool from %d to %d bytes.\n",
+                MEMORY_SIZE, size);
+    }
+
+    unsigned char *old_mem = mem;
+    unsigned char *young_start = gc_mode == GC_GENERATIONAL ? nursery : fromptr;
+    unsigned char *young_end = freeptr;
+    unsigned char *old_start = old_from;
+    unsigned char *old_end = old_free;
+
+    mem = new_mem;
+    MEMORY_SIZE = size;
+    lay_out_pool();
+
+    if (gc_mode == GC_GENERATIONAL) {
+        freeptr = move_region(young_start, young_end, nursery);
+        old_free = move_region(old_start, old_end, old_from);
+    } else {
+        freeptr = move_region(young_start, young_end, fromptr);
+    }
+
+    free(old_mem);
+    return true;
+}
+
+/*!
+ * Grows or shrinks the pool after a full collection, depending on how much
+ * of it the collection found live.  Nothing is done while the pool is being
+ * mark-compacted, since its live data then no longer fits in a semispace.
+ */
+static void adapt_pool_size(void) {
+    if (compacting || hard_limit == soft_limit)
+        return;
+
+    long live = last_live;
+    long space = space_for_size(MEMORY_SIZE);
+
+    /* The incremental collector only lets a semispace fill this far before
+     * it starts the next cycle. */
+    if (gc_mode == GC_INCREMENTAL)
+        space /= INCR_TRIGGER_FRACTION;
+
+    if (live > space * HEAP_GROW_PERCENT / 100 && MEMORY_SIZE < hard_limit) {
+        resize_pool(MEMORY_SIZE > hard_limit / 2 ? hard_limit
+                                                 : MEMORY_SIZE * 2);
+    } else if (live < space * HEAP_SHRINK_PERCENT / 100 &&
+               MEMORY_SIZE > soft_limit) {
+        int size = MEMORY_SIZE / 2 < soft_limit ? soft_limit
+                                                : MEMORY_SIZE / 2;
+
+        /* What was allocated since the collection moves along as well, and
+         * must leave the smaller pool at most half full. */
+        if (memuse() < space_for_size(size) / 2)
+            resize_pool(size);
+    }
+}
+
+/*!
+ * Grows the pool until the Values in it and requested more bytes fit in the
+ * space live data is kept in, or as far towards that as the hard limit
+ * allows.  Returns true if they fit.
+ */
+static bool grow_pool(int requested) {
+    long needed = (long) memuse() + requested;
+    int size = MEMORY_SIZE;
+
+    if (compacting)
+        return false;
+
+    while (space_for_size(size) < needed && size < hard_limit)
+        size = size > hard_limit / 2 ? hard_limit : size * 2;
+
+    if (size > MEMORY_SIZE && !resize_pool(size))
+        return false;
+    return space_for_size(MEMORY_SIZE) >= needed;
+}
+
+/*!
+ * Sets the largest the pool may grow to.  By default it stays at the size it
+ * was initialized with.
+ */
+void mm_set_heap_limit(int max_size) {
+    heap_limit = max_size;
+}
+
+//// END POOL RESIZING ////
+
+
+//// STATISTICS ////
+
+/*! The names of the ValueTypes, spelled as Python spells its own types. */
+static const char *type_names[NUM_VALUE_TYPES] = {
+    "NoneType", "bool", "int", "float", "str", "list", "dict", "array",
+    "dict_table", "rope"
+};
+
+/*! Records the memory in use, if it is the most there has been. */
+static void note_memuse(void) {
+    int used = memuse();
+    if (used > peak_memuse)
+        peak_memuse = used;
+}
+
+/*! Returns the most memory that has been in use at once, in bytes. */
+int mm_peak_memuse(void) {
+    return peak_memuse;
+}
+
+/*! Returns the total time spent collecting garbage so far, in nanoseconds. */
+long mm_total_pause(void) {
+    return total_pause_ns;
+}
+
+/*! Returns the number of collections finished so far. */
+long mm_num_collections(void) {
+    return num_collections;
+}
+
+/*! Forgets the live Values counted so far by the current collection. */
+static void reset_live_counts(void) {
+    last_live = 0;
+    memset(live_objects, 0, sizeof(live_objects));
+}
+
+/*! Counts a Value that the current collection found to be live. */
+static void count_live(Value *val) {
+    last_live += get_size(val);
+    live_objects[val->type]++;
+}
+
+/*!
+ * Resets the statistics of the most recent collection, as a new one starts
+ * on before bytes of Values.
+ */
+static void begin_collection(int before) {
+    last_before = before;
+    last_pause_ns = 0;
+    last_copied = 0;
+    reset_live_counts();
+}
+
+/*! Records that a collection of the given kind has finished. */
+static void end_collection(const char *kind) {
+    compact_ref_table();
+    num_collections++;
+    last_kind = kind;
+
+    if (stats_log != NULL) {
+        mm_print_stats(stats_log);
+        fflush(stats_log);
+    }
+}
+
+/*!
+ * Prints the statistics as a single line of JSON.  The survival rate is the
+ * fraction of the bytes collected by the last collection that were live.
+ */
+void mm_print_stats(FILE *os) {
+    fprintf(os, "{\"collections\": %ld, ", num_collections);
+    if (last_kind != NULL) {
+        fprintf(os, "\"kind\": \"%s\", ", last_kind);
+    } else {
+        fprintf(os, "\"kind\": null, ");
+    }
+    fprintf(os, "\"pause_ns\": %ld, \"total_pause_ns\": %ld, "
+            "\"longest_pause_ns\": %ld, \"cap_overruns\": %ld, ",
+            last_pause_ns, total_pause_ns, longest_pause_ns, cap_overruns);
+    fprintf(os, "\"bytes_before\": %d, \"bytes_live\": %d, "
+            "\"bytes_copied\": %ld, \"total_bytes_copied\": %ld, ",
+            last_before, last_live, last_copied, total_bytes_copied);
+    fprintf(os, "\"survival_rate\": %.4f, ",
+            last_before > 0 ? (double) last_live / last_before : 0.0);
+
+    fprintf(os, "\"live_objects\": {");
+    for (int i = 0; i < NUM_VALUE_TYPES; i++) {
+        fprintf(os, "%s\"%s\": %d", i > 0 ? ", " : "", type_names[i],
+                live_objects[i]);
+    }
+    fprintf(os, "}, ");
+
+    fprintf(os, "\"refs_used\": %d, \"refs_max\": %d, \"heap_used\": %d, "
+            "\"heap_size\": %d}\n",
+            num_refs - num_free_refs, max_refs, memuse(), MEMORY_SIZE);
+}
+
+/*! Sets the file the statistics are appended to after each collection. */
+void mm_set_stats_log(FILE *log) {
+    stats_log = log;
+}
+
+//// END STATISTICS ////
+
+
+/*!
+ * Collects garbage using the stop and copy method, or mark-compact once the
+ * live data has outgrown a semispace.  With the generational
+ * collector this is a major collection of the whole heap.  With the
+ * incremental collector, any running cycle is finished and then a whole
+ * cycle is run at once.
+ */
+int collect_garbage(void) {
+    int reclaimed;
+    int before = memuse();
+    long start = now_ns();
+    if (!quiet) {
+        fprintf(stderr, "Collecting garbage.\n");
+    }
+
+    begin_collection(before);
+
+    if (compacting) {
+        mark_compact();
+        if (memuse() < (long) space_for_size(MEMORY_SIZE) *
+                COMPACT_LEAVE_PERCENT / 100)
+            stop_compacting();
+    } else if (gc_mode == GC_GENERATIONAL) {
+        /* Everything in the nursery and the old generation might survive,
+         * and all of it has to fit in the old generation, so make room for
+         * it first if the pool can grow, and otherwise compact it in place. */
+        if (memuse() > OLD_HALF)
+            grow_pool(0);
+        if (memuse() > OLD_HALF)
+            start_compacting();
+        else
+            major_collection();
+    } else if (gc_mode == GC_INCREMENTAL) {
+        finish_cycle();
+
+        /* A cycle may have to copy everything in use, so if that might not
+         * fit in a semispace, or the last cycle found too much of it live,
+         * the whole pool is mark-compacted instead. */
+        if (memuse() > HALF_MEMORY)
+            grow_pool(0);
+        if (memuse() > HALF_MEMORY ||
+                cycle_live > (long) HALF_MEMORY * COMPACT_ENTER_PERCENT / 100) {
+            start_compacting();
+        } else {
+            start_cycle();
+            finish_cycle();
+        }
+    } else if (gc_threads > 1 && freeptr - fromptr >= PARALLEL_MIN_BYTES) {
+        parallel_copy();
+    } else {
+        stop_and_copy();
+    }
+    adapt_pool_size();
+    if (gc_mode != GC_INCREMENTAL && !compacting &&
+            memuse() > (long) space_for_size(MEMORY_SIZE) *
+                       COMPACT_ENTER_PERCENT / 100)
+        start_compacting();
+    int after = memuse();
     reclaimed =  before - after;
+    record_pause(start);
+
+    if (compacting) {
+        end_collection("compact");
+    } else if (gc_mode == GC_GENERATIONAL) {
+        end_collection("major");
+    } else if (gc_mode == GC_INCREMENTAL) {
+        end_collection("incremental");
+    } else {
+        end_collection("copy");
+    }
 
     if (!quiet) {
         // Ths will report how many bytes we were able to free in this garbage
@@ -624,5 +2429,20 @@ int collect_garbage(void) {
 void mm_cleanup(void) {
     free(mem);
     mem = NULL;
+
+    free(remembered);
+    remembered = NULL;
+
+    free(mark_stack);
+    mark_stack = NULL;
+
+    free_workers();
+
+    free(ref_table);
+    free(ref_gens);
+    free(free_refs);
+    ref_table = NULL;
+    ref_gens = NULL;
+    free_refs = NULL;
 }
 
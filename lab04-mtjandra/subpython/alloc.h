@@ -12,14 +12,26 @@
 #define IMPALLOC_H
 
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "types.h"
 
+
+/*! The garbage-collection strategies the allocator can be configured with. */
+typedef enum GCMode {
+    GC_COPY,            /*!< Stop-and-copy over two semispaces. */
+    GC_GENERATIONAL,    /*!< A nursery promoting into a stop-and-copy old space. */
+    GC_INCREMENTAL      /*!< Stop-and-copy done a little on every allocation. */
+} GCMode;
+
 /* Returns true if an address is within the pool; false otherwise. */
 bool is_pool_address(void *addr);
 
 /* Initializes allocator state, and memory pool state too. */
-void mm_init(int memory_size);
+void mm_init(int memory_size, GCMode mode);
+
+/* Lets the memory pool grow up to max_size bytes; call before mm_init(). */
+void mm_set_heap_limit(int max_size);
 
 /* Attempt to allocate a value from the implicit allocator. */
 Value *mm_malloc(ValueType type, int data_size);
@@ -27,6 +39,9 @@ Value *mm_malloc(ValueType type, int data_size);
 /* Dereference a Reference into its corresponding Value. */
 Value *deref(Reference ref);
 
+/* Must be called after a Reference is stored inside another Value. */
+void mm_write_barrier(Reference obj, Reference value);
+
 
 /* Return the amount of used memory. */
 int memuse(void);
@@ -37,6 +52,30 @@ void memdump(void);
 /* Runs the garbage collector to reclaim unused space. */
 int collect_garbage(void);
 
+/* Sets how many threads the stop-and-copy collector may use. */
+void mm_set_gc_threads(int threads);
+
+/* Caps how long one incremental collection step may run, in microseconds. */
+void mm_set_pause_cap(long usec);
+
+/* Return the longest garbage-collection pause so far, in nanoseconds. */
+long mm_longest_pause(void);
+
+/* Return the total time spent collecting garbage so far, in nanoseconds. */
+long mm_total_pause(void);
+
+/* Return the number of garbage collections so far. */
+long mm_num_collections(void);
+
+/* Return the most memory that has been in use at once, in bytes. */
+int mm_peak_memuse(void);
+
+/* Print the garbage collector's statistics as a line of JSON. */
+void mm_print_stats(FILE *os);
+
+/* Append the statistics to a log after every collection, if log is not NULL. */
+void mm_set_stats_log(FILE *log);
+
 /* Clean up the allocator and memory pool state. */
 void mm_cleanup(void);
 
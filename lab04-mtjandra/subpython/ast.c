@@ -6,62 +6,199 @@
 
 #define AST_POOL_PGSIZE 4096
 
+/*! Allocations are rounded up to this, so that every node is aligned. */
+#define AST_POOL_ALIGN _Alignof(max_align_t)
+
+/*! The most spare pages kept around for pools to reuse. */
+#define AST_POOL_MAX_SPARE 16
+
+/*! The number of parse trees the cache can hold. */
+#define AST_CACHE_SIZE 32
+
 typedef struct AstPoolPage AstPoolPage;
 struct AstPoolPage {
     AstPoolPage *prev;
+    size_t size;            /* The size of data; AST_POOL_PGSIZE unless the
+                             * page holds one large allocation. */
     size_t offset;
-    char data[];
+    max_align_t data[];
 };
 
 typedef struct AstPool {
     AstPoolPage *page;
 } AstPool;
 
+/*
+ * Pages of the usual size that pools have finished with.  A statement's
+ * tree is usually thrown away just before the next one is parsed, so
+ * reusing its pages saves going back to malloc(), and they are still warm
+ * in the cache.
+ */
+static AstPoolPage *spare_pages = NULL;
+static int num_spare_pages = 0;
+
 void *ast_create_pool() {
     return calloc(1, sizeof(AstPool));
 }
-void ast_free_pool(void *ptr) {
+
+/*!
+ * Empties a pool, so that everything allocated from it is gone, but keeps
+ * its pages to be reused by this and other pools.
+ */
+void ast_reset_pool(void *ptr) {
     AstPool *pool = ptr;
+    AstPoolPage *page = pool->page;
 
-    if (pool) {
-        AstPoolPage *page = pool->page;
-        while (page) {
-            void *temp = page->prev;
+    while (page) {
+        AstPoolPage *prev = page->prev;
+
+        if (page->size == AST_POOL_PGSIZE &&
+                num_spare_pages < AST_POOL_MAX_SPARE) {
+            page->prev = spare_pages;
+            spare_pages = page;
+            num_spare_pages++;
+        } else {
             free(page);
-            page = temp;
         }
+
+        page = prev;
+    }
+
+    pool->page = NULL;
+}
+
+void ast_free_pool(void *ptr) {
+    AstPool *pool = ptr;
+
+    if (pool) {
+        ast_reset_pool(pool);
         free(pool);
     }
 }
+
+/*! Returns an empty page with room for size bytes, reusing a spare one. */
+static AstPoolPage *ast_pool_new_page(size_t size) {
+    AstPoolPage *page;
+
+    if (size == AST_POOL_PGSIZE && spare_pages) {
+        page = spare_pages;
+        spare_pages = page->prev;
+        num_spare_pages--;
+    } else {
+        page = malloc(sizeof(AstPoolPage) + size);
+        if (!page) {
+            return NULL;
+        }
+        page->size = size;
+    }
+
+    page->prev = NULL;
+    page->offset = 0;
+    return page;
+}
+
 void *ast_pool_alloc(void *ptr, size_t sz) {
     assert(ptr != NULL);
 
     AstPool *pool = ptr;
     AstPoolPage *page = pool->page;
 
-    if (!page || AST_POOL_PGSIZE - page->offset < sz) {
-        size_t req = sizeof(AstPoolPage) + sz;
-        size_t min = sizeof(AstPoolPage) + AST_POOL_PGSIZE;
-
-        AstPoolPage *new = calloc(1, req < min ? min : req);
-        if (new) {
-            new->offset = sz;
-            if (req > min && page) {
-                new->prev = page->prev;
-                page->prev = new;
-            } else {
-                new->prev = page;
-                pool->page = page = new;
-            }
-
-            return new->data;
-        } else {
+    sz = (sz + AST_POOL_ALIGN - 1) & ~(AST_POOL_ALIGN - 1);
+
+    if (!page || page->size - page->offset < sz) {
+        bool large = sz > AST_POOL_PGSIZE;
+        AstPoolPage *new = ast_pool_new_page(large ? sz : AST_POOL_PGSIZE);
+        if (!new) {
             return NULL;
         }
-    } else {
-        void *alloc = page->data + page->offset;
-        page->offset += sz;
-        return alloc;
+
+        /* A large allocation gets a page to itself, which goes behind the
+         * current page so that the space left in that can still be used. */
+        if (large && page) {
+            new->prev = page->prev;
+            page->prev = new;
+        } else {
+            new->prev = page;
+            pool->page = new;
+        }
+        page = new;
+    }
+
+    void *alloc = (char *) page->data + page->offset;
+    page->offset += sz;
+    memset(alloc, 0, sz);
+    return alloc;
+}
+
+
+/*
+ * The parse-tree cache.  Each entry owns the pool its tree was allocated
+ * from, and a copy of the text it was parsed from.  It is direct-mapped on
+ * the hash of the text, so a new tree replaces whatever was in its entry.
+ */
+static struct AstCacheEntry {
+    char *text;
+    size_t length;
+    unsigned int hash;
+    void *pool;
+    Node *tree;
+} ast_cache[AST_CACHE_SIZE];
+
+static unsigned int ast_cache_hash(const char *text, size_t length) {
+    /* FNV-1a */
+    unsigned int hash = 2166136261U;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) text[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*! Returns the tree cached for some source text, or NULL if there is none. */
+Node *ast_cache_lookup(const char *text, size_t length) {
+    unsigned int hash = ast_cache_hash(text, length);
+    struct AstCacheEntry *entry = &ast_cache[hash % AST_CACHE_SIZE];
+
+    if (entry->tree && entry->hash == hash && entry->length == length &&
+            memcmp(entry->text, text, length) == 0) {
+        return entry->tree;
+    }
+    return NULL;
+}
+
+/*!
+ * Caches the tree parsed from some source text.  The cache takes over the
+ * pool the tree was allocated from, and frees it when the tree is replaced,
+ * so the tree stays valid until then.
+ */
+void ast_cache_insert(const char *text, size_t length, void *pool,
+                      Node *tree) {
+    char *copy = malloc(length);
+    if (!copy) {
+        ast_free_pool(pool);
+        return;
+    }
+    memcpy(copy, text, length);
+
+    unsigned int hash = ast_cache_hash(text, length);
+    struct AstCacheEntry *entry = &ast_cache[hash % AST_CACHE_SIZE];
+
+    free(entry->text);
+    ast_free_pool(entry->pool);
+
+    entry->text = copy;
+    entry->length = length;
+    entry->hash = hash;
+    entry->pool = pool;
+    entry->tree = tree;
+}
+
+/*! Frees every cached tree. */
+void ast_cache_clear(void) {
+    for (int i = 0; i < AST_CACHE_SIZE; i++) {
+        free(ast_cache[i].text);
+        ast_free_pool(ast_cache[i].pool);
+        memset(&ast_cache[i], 0, sizeof(ast_cache[i]));
     }
 }
 
@@ -104,17 +241,13 @@ void ast_nodelist_append(void *pool, NodeList *list, Node *node) {
     } else {
         list->head = list->tail = entry;
     }
+    list->length++;
 }
 
 size_t ast_nodelist_length(NodeList *list) {
     assert(list != NULL);
 
-    size_t length = 0;
-    for (NodeListEntry *entry = list->head;
-            entry;
-            entry = entry->next, length++);
-
-    return length;
+    return list->length;
 }
 
 #define AST_NODE_DECL(TYPENAME, TYPE) \
@@ -173,6 +306,7 @@ Node *ast_alloc_literal_string(void *pool, const char *value) {
     AST_NODE_DECL(NodeExprLiteralString, EXPR_LITERAL_STRING);
     if (node) {
         node->value = ast_pool_strcpy(pool, value);
+        node->ref = NULL_REF;
     }
     return (Node *) node;
 }
@@ -180,6 +314,7 @@ Node *ast_alloc_literal_integer(void *pool, long int value) {
     AST_NODE_DECL(NodeExprLiteralInteger, EXPR_LITERAL_INTEGER);
     if (node) {
         node->value = value;
+        node->ref = NULL_REF;
     }
     return (Node *) node;
 }
@@ -187,6 +322,7 @@ Node *ast_alloc_literal_float(void *pool, double value) {
     AST_NODE_DECL(NodeExprLiteralFloat, EXPR_LITERAL_FLOAT);
     if (node) {
         node->value = value;
+        node->ref = NULL_REF;
     }
     return (Node *) node;
 }
@@ -224,6 +360,7 @@ Node *ast_alloc_identifier(void *pool, const char *name) {
     AST_NODE_DECL(NodeExprIdentifier, EXPR_IDENTIFIER);
     if (node) {
         node->name = ast_pool_strcpy(pool, name);
+        node->slot = -1;
     }
     return (Node *) node;
 }
@@ -233,6 +370,7 @@ Node *ast_alloc_builtin(void *pool, NodeExprBuiltinType type, Node *left, Node *
         node->builtin_type = type;
         node->left = left;
         node->right = right;
+        node->value = NULL_REF;
     }
     return (Node *) node;
 }
@@ -242,6 +380,7 @@ Node *ast_alloc_call(void *pool, Node *func, NodeList *args) {
     if (node) {
         node->func = func;
         node->args = args;
+        node->builtin = -1;
     }
     return (Node *) node;
 }
@@ -43,13 +43,12 @@ typedef struct NodeListEntry NodeListEntry;
 struct NodeListEntry {
     NodeListEntry *next;
     Node *node;
-    Reference reference; /* For temporarily storing evalulation results. */
-    size_t idx;          /* For temporarily storing global indexes. */
 };
 
 typedef struct NodeList {
     NodeListEntry *head;
     NodeListEntry *tail;
+    size_t length;
 } NodeList;
 
 typedef struct NodeStmtSequence {
@@ -84,16 +83,22 @@ typedef struct NodeStmtWhile {
 typedef struct NodeExprLiteralString {
     NodeType type;
     const char *value;
+    Reference ref;      /*!< The value, made once by the evaluator and
+                         *   shared by every evaluation, or NULL_REF. */
 } NodeExprLiteralString;
 
 typedef struct NodeExprLiteralInteger {
     NodeType type;
     long int value;
+    Reference ref;      /*!< The value, made once by the evaluator and
+                         *   shared by every evaluation, or NULL_REF. */
 } NodeExprLiteralInteger;
 
 typedef struct NodeExprLiteralFloat {
     NodeType type;
     double value;
+    Reference ref;      /*!< The value, made once by the evaluator and
+                         *   shared by every evaluation, or NULL_REF. */
 } NodeExprLiteralFloat;
 
 typedef struct NodeExprLiteralList {
@@ -127,6 +132,8 @@ typedef struct NodeExprLiteralSingleton {
 typedef struct NodeExprIdentifier {
     NodeType type;
     const char *name;
+    int slot;           /*!< The name's index in the global table, or -1
+                         *   until the evaluator has resolved it. */
 } NodeExprIdentifier;
 
 typedef enum NodeExprBuiltinType {
@@ -161,12 +168,17 @@ typedef struct NodeExprBuiltin {
     NodeExprBuiltinType builtin_type;
     Node *left;
     Node *right;
+    Reference value;    /*!< The result, if the evaluator has folded the
+                         *   expression to a constant, or NULL_REF. */
 } NodeExprBuiltin;
 
 typedef struct NodeExprCall {
     NodeType type;
     Node *func;
     NodeList *args;
+    int builtin;        /*!< The index of the function in the evaluator's
+                         *   table of builtins, or -1 if the evaluator has
+                         *   not resolved it or it is not a builtin. */
 } NodeExprCall;
 
 typedef struct NodeExprSubscript {
@@ -176,9 +188,15 @@ typedef struct NodeExprSubscript {
 } NodeExprSubscript;
 
 void *ast_create_pool();
+void  ast_reset_pool(void *pool);
 void  ast_free_pool(void *pool);
 void *ast_pool_alloc(void *pool, size_t sz);
 
+Node *ast_cache_lookup(const char *text, size_t length);
+void  ast_cache_insert(const char *text, size_t length, void *pool,
+                       Node *tree);
+void  ast_cache_clear(void);
+
 NodeList *ast_alloc_nodelist(void *pool);
 
 void ast_nodelist_append(void *pool, NodeList *list, Node *node);
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Garbage-collector benchmark: builds a list with a million elements and then
+# collects it repeatedly.  For each subpython binary given (./subpython by
+# default) it reports:
+#
+#   - the average pause of one gc() call, from timing the script with and
+#     without the extra collections, and
+#   - the peak stack use, as the smallest stack limit the run survives.
+#
+# usage: bench/gc_list.sh [-n elements] [-c collections] [subpython...]
+
+N=1000000
+GCS=10
+MEMORY=400000000
+
+while getopts "n:c:" opt; do
+    case $opt in
+        n) N=$OPTARG ;;
+        c) GCS=$OPTARG ;;
+        *) echo "usage: $0 [-n elements] [-c collections] [subpython...]"
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    set -- ./subpython
+fi
+
+TMP=${TMPDIR:-/tmp}/gc_list.$$
+trap 'rm -f $TMP.*' EXIT
+
+# The script is generated so that the list is one big literal.
+gen_script() {
+    awk -v n="$N" -v gcs="$1" 'BEGIN {
+        printf "l = ["
+        for (i = 0; i < n; i++) printf (i ? ", %d" : "%d"), i
+        print "]"
+        for (i = 0; i < gcs; i++) print "gc()"
+        print "print(len(l))"
+    }'
+}
+
+gen_script 0 > $TMP.base.py
+gen_script "$GCS" > $TMP.gc.py
+
+# Prints the wall-clock time of a run in nanoseconds.
+run_ns() {
+    start=$(date +%s%N)
+    "$1" -q -m $MEMORY -f "$2" > /dev/null || return 1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+# Runs with a stack limit of $1 KB; a crash is not reported on the terminal.
+runs_with_stack() {
+    sh -c 'ulimit -s $0 && "$1" -q -m $2 -f "$3" > /dev/null' \
+        "$1" "$2" $MEMORY "$3" 2> /dev/null
+}
+
+# Finds the smallest stack limit (in KB) that the run survives.
+min_stack_kb() {
+    lo=16
+    hi=1048576
+    if ! runs_with_stack $hi "$1" "$2"; then
+        echo "> $hi"
+        return
+    fi
+    while [ $((hi - lo)) -gt 16 ]; do
+        mid=$(((lo + hi) / 2))
+        if runs_with_stack $mid "$1" "$2"; then
+            hi=$mid
+        else
+            lo=$mid
+        fi
+    done
+    echo $hi
+}
+
+for bin in "$@"; do
+    base=$(run_ns "$bin" $TMP.base.py) || { echo "$bin: run failed"; continue; }
+    with=$(run_ns "$bin" $TMP.gc.py) || { echo "$bin: run failed"; continue; }
+    pause=$(((with - base) / GCS))
+
+    echo "$bin: $N elements"
+    echo "  average gc() pause: $((pause / 1000)) us"
+    echo "  peak stack:         $(min_stack_kb "$bin" $TMP.gc.py) KB"
+done
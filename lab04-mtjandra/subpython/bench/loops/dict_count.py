@@ -0,0 +1,14 @@
+counts = {}
+k = 0
+while k < 1000:
+    counts[k] = 0
+    k = k + 1
+
+x = 1
+i = 0
+while i < 200000:
+    x = (x * 75 + 74) % 65537
+    k = x % 1000
+    counts[k] = counts[k] + 1
+    i = i + 1
+print(len(counts), counts[0], counts[999])
@@ -0,0 +1,9 @@
+n = 500000
+h = 1.0 / n
+total = 0.0
+i = 0
+while i < n:
+    x = (i + 0.5) * h
+    total = total + x * x * h
+    i = i + 1
+print(total)
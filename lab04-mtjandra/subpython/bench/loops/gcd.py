@@ -0,0 +1,15 @@
+total = 0
+a = 1
+while a < 300:
+    b = 1
+    while b < 300:
+        x = a
+        y = b
+        while y > 0:
+            t = x % y
+            x = y
+            y = t
+        total = total + x
+        b = b + 1
+    a = a + 1
+print(total)
@@ -0,0 +1,9 @@
+acc = 0
+i = 0
+while i < 600:
+    j = 0
+    while j < 600:
+        acc = (acc + i * j) % 1000003
+        j = j + 1
+    i = i + 1
+print(acc)
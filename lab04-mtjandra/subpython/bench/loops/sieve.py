@@ -0,0 +1,19 @@
+n = 200000
+sieve = []
+i = 0
+while i < n:
+    append(sieve, True)
+    i = i + 1
+
+count = 0
+i = 2
+while i < n:
+    if sieve[i]:
+        count = count + 1
+        if i < 448:
+            j = i * i
+            while j < n:
+                sieve[j] = False
+                j = j + i
+    i = i + 1
+print(count)
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Printing benchmark: runs each output-heavy script in bench/print with each
+# subpython given, and reports the wall-clock time and the amount of output.
+# Every binary must print the same output as the first.  The scripts are:
+#
+#   int_list.py    - prints a list of 50000 ints, 20 times
+#   nested.py      - shows a list of 10000 small nested lists, 10 times
+#   dict.py        - prints a dict of 20000 entries, 20 times
+#   many_lines.py  - prints 100000 short lines
+#
+# usage: bench/print.sh [-r runs] [subpython...]
+
+RUNS=3
+MEMORY=10000000
+DIR=$(dirname "$0")/print
+
+while getopts "r:" opt; do
+    case $opt in
+        r) RUNS=$OPTARG ;;
+        *) echo "usage: $0 [-r runs] [subpython...]"
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    set -- ./subpython
+fi
+
+TMP=${TMPDIR:-/tmp}/print.$$
+trap 'rm -f $TMP.*' EXIT
+
+# Prints the best wall-clock time of $RUNS runs in microseconds, leaving the
+# output of the last run in $TMP.out.
+best_us() {
+    best=
+    i=0
+    while [ $i -lt $RUNS ]; do
+        start=$(date +%s%N)
+        "$1" -q -m $MEMORY -f "$2" > $TMP.out 2>&1 || return 1
+        end=$(date +%s%N)
+        t=$(((end - start) / 1000))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    echo $best
+}
+
+echo "best of $RUNS runs"
+for script in "$DIR"/*.py; do
+    name=$(basename "$script")
+    first=
+    for bin in "$@"; do
+        t=$(best_us "$bin" "$script") || { echo "  $name: $bin failed"; continue; }
+        bytes=$(wc -c < $TMP.out)
+        if [ -z "$first" ]; then
+            cp $TMP.out $TMP.first
+            first=$t
+            ratio=100
+        elif ! cmp -s $TMP.first $TMP.out; then
+            echo "  $name: $bin prints different output"
+            continue
+        else
+            ratio=$((first * 100 / t))
+        fi
+        printf "  %-16s %-24s %10d us %10d bytes %4d.%02dx\n" "$name" "$bin" \
+            $t $bytes $((ratio / 100)) $((ratio % 100))
+    done
+done
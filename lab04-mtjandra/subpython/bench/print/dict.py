@@ -0,0 +1,10 @@
+d = {}
+i = 0
+while i < 20000:
+    d[i] = "value"
+    d["k" + "ey"] = i
+    i = i + 1
+i = 0
+while i < 20:
+    print(d, len(d))
+    i = i + 1
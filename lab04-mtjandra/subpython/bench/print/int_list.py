@@ -0,0 +1,9 @@
+l = []
+i = 0
+while i < 50000:
+    append(l, i * 7 - 100000)
+    i = i + 1
+i = 0
+while i < 20:
+    print(l)
+    i = i + 1
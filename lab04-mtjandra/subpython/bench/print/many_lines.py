@@ -0,0 +1,4 @@
+i = 0
+while i < 100000:
+    print(i, "x", 2.5, [i])
+    i = i + 1
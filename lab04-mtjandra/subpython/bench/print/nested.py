@@ -0,0 +1,9 @@
+l = []
+i = 0
+while i < 10000:
+    append(l, [i, "row", [i * 0.5, None, True]])
+    i = i + 1
+i = 0
+while i < 10:
+    l
+    i = i + 1
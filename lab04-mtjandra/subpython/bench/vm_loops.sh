@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Evaluator benchmark: runs each loop-heavy script in bench/loops with the
+# tree-walker (-e tree) and with the bytecode VM (-e vm), and reports the
+# wall-clock time of each and the speedup.  The two must print the same
+# output.  The scripts are:
+#
+#   sum.py         - adds up the integers below a million
+#   nested.py      - two nested loops of multiplication and modulo
+#   gcd.py         - Euclid's algorithm over a grid of pairs
+#   floats.py      - the midpoint rule over float arithmetic
+#   sieve.py       - the sieve of Eratosthenes over a list
+#   dict_count.py  - counts pseudo-random residues in a dict
+#
+# usage: bench/vm_loops.sh [-r runs] [subpython...]
+
+RUNS=3
+MEMORY=10000000
+DIR=$(dirname "$0")/loops
+
+while getopts "r:" opt; do
+    case $opt in
+        r) RUNS=$OPTARG ;;
+        *) echo "usage: $0 [-r runs] [subpython...]"
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    set -- ./subpython
+fi
+
+TMP=${TMPDIR:-/tmp}/vm_loops.$$
+trap 'rm -f $TMP.*' EXIT
+
+# Prints the best wall-clock time of $RUNS runs in microseconds, leaving the
+# output of the last run in $TMP.$2.
+best_us() {
+    best=
+    i=0
+    while [ $i -lt $RUNS ]; do
+        start=$(date +%s%N)
+        "$1" -q -e "$2" -m $MEMORY -f "$3" > $TMP.$2 2>&1 || return 1
+        end=$(date +%s%N)
+        t=$(((end - start) / 1000))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    echo $best
+}
+
+for bin in "$@"; do
+    echo "$bin: best of $RUNS runs"
+    printf "  %-16s %10s %10s %8s\n" script tree vm speedup
+    for script in "$DIR"/*.py; do
+        name=$(basename "$script")
+        tree=$(best_us "$bin" tree "$script") || { echo "  $name: run failed"; continue; }
+        vm=$(best_us "$bin" vm "$script") || { echo "  $name: run failed"; continue; }
+        if ! cmp -s $TMP.tree $TMP.vm; then
+            echo "  $name: outputs differ"
+            continue
+        fi
+        speedup=$((tree * 100 / vm))
+        printf "  %-16s %8d us %8d us %4d.%02dx\n" "$name" $tree $vm \
+            $((speedup / 100)) $((speedup % 100))
+    done
+done
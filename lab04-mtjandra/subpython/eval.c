@@ -1,7 +1,9 @@
 #include "eval.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "alloc.h"
@@ -12,14 +14,69 @@
 
 #define MAX_DEPTH 4
 
+/*!
+ * Concatenations shorter than this are copied into a new string; longer ones
+ * make a rope that points at the two halves, so that building a long string
+ * one piece at a time does not copy it over and over.
+ */
+#define ROPE_MIN_LENGTH 64
+
+/*!
+ * Each name that has ever been used as a global has one of these, made the
+ * first time the name is seen and kept from then on, so its index never
+ * changes and its name string is the one interned copy.  The ones currently
+ * defined are linked together, by index, in the order they were defined.
+ */
 struct GlobalVariable {
     char *name;
+    unsigned int hash;
     Reference ref;
+    bool defined;
+    int prev;
+    int next;
 } *global_vars = NULL;
 
+/* The number of globals defined, and of names interned. */
 int num_vars = 0;
+int num_names = 0;
 int max_vars = 0;
 
+/*!
+ * A hash index over global_vars.  It has twice as many slots as global_vars
+ * has room for, and each slot is the index of a name, or -1 if it is empty.
+ * Names are never removed, so there is no need for deleted markers.
+ */
+static int *global_index = NULL;
+static int num_global_slots = 0;
+
+/* The first and last defined globals, or -1 if there are none. */
+static int first_var = -1;
+static int last_var = -1;
+
+/*!
+ * The root stack holds the temporary roots: Values the evaluator is in the
+ * middle of using, which no global refers to yet.  A root's index stays
+ * valid until it is removed, since the stack only shrinks past roots that
+ * have been removed.
+ */
+struct TemporaryRoot {
+    Reference ref;
+    bool live;
+} *root_stack = NULL;
+
+static int num_roots = 0;
+static int max_roots = 0;
+
+/*!
+ * The values of the literals and folded constants in the tree being
+ * evaluated.  Each is made once, before evaluation starts, and is then
+ * shared by every evaluation of its node, so they are kept as roots until
+ * `clear_temporary_globals` is called at the end of the tree.
+ */
+static Reference *literals = NULL;
+static int num_literals = 0;
+static int max_literals = 0;
+
 //////////// EVALUATION ENGINE ////////////
 
 typedef enum EvaluationStatus {
@@ -36,13 +93,14 @@ typedef struct EvaluationResult {
 
 //// PRIVATE VARIABLE DECLARATIONS ////
 
-/* These are references held by the evaluation engine to the singletons
- * None, True, and False. These references should never be collected
- * since they are always considered globals and should never changes because
- * reference numbers should never change! */
-static Reference NONE_REF = NULL_REF;
-static Reference TRUE_REF = NULL_REF;
-static Reference FALSE_REF = NULL_REF;
+/* These are the references to the singletons None, True, and False.  They
+ * are immediates, so they are never allocated and never collected. */
+static const Reference NONE_REF = NONE_IMMEDIATE;
+static const Reference TRUE_REF = TRUE_IMMEDIATE;
+static const Reference FALSE_REF = FALSE_IMMEDIATE;
+
+/* Which evaluator `eval_root` uses. */
+static EvalMode eval_mode = EVAL_BYTECODE;
 
 
 bool ref_is_none(Reference r) {
@@ -62,29 +120,38 @@ Reference get_bool_ref(bool value) {
 //// LOCAL FUNCTION DECLARATIONS ////
 
 Reference *add_global_variable(const char *name, Reference value);
-Reference *get_global_variable(const char *name, bool create);
-void delete_global_variable(const char *name);
+
+static void resolve_names(Node *node);
+static void fold_constants(Node **node);
+static Reference constant_value(Node *node);
+static Reference *get_global_slot(int i, bool create);
+static void delete_global_slot(int i);
+
+static void ref_delete_subscript(Reference objref, Reference keyref);
+
+static void compile_program(Node *root);
+static void vm_run(void);
 
 int add_temporary_global(Reference value);
 void remove_temporary_global(size_t glob);
+static void remove_temporary_globals_from(size_t first);
 
 EvaluationResult eval_main(Node *node);
 EvaluationResult eval_del(NodeStmtDel *node);
 
 Reference eval_expr(Node *node);
-Reference *eval_expr_lval(Node *node, bool create);
+Reference *eval_expr_lval(Node *node, bool create, Reference *owner);
 
 static bool eval_generic_comp(NodeExprBuiltinType type,
                               Reference l, Reference r);
 
-Reference make_reference_none();
-Reference make_reference_bool();
 Reference make_reference_int(long int v);
 Reference make_reference_float(double f);
 Reference make_reference_string(const char *value);
 Reference make_reference_string_concat(Reference v1, Reference v2);
-Reference make_reference_list_node(Reference value);
-Reference make_reference_dict_node(Reference key, Reference value);
+static int string_data_size(size_t len);
+Reference make_reference_list(long int capacity);
+Reference make_reference_dict(long int capacity);
 
 
 //// HELPER FUNCTIONS ////
@@ -95,27 +162,52 @@ typedef enum Promotion {
     TO_INTEGER,
 } Promotion;
 
+/*! Returns the type of the value a Reference refers to, immediate or not. */
+static inline ValueType ref_type(Reference r) {
+    if (is_heap_ref(r)) {
+        ValueType type = deref(r)->type;
+        return type == VAL_ROPE ? VAL_STRING : type;
+    }
+
+    switch (r) {
+        case NONE_IMMEDIATE:    return VAL_NONE;
+        case TRUE_IMMEDIATE:
+        case FALSE_IMMEDIATE:   return VAL_BOOL;
+        default:
+            assert(is_small_int_ref(r));
+            return VAL_INTEGER;
+    }
+}
+
+/*! Returns the value of an int, immediate or not. */
+static inline int int_value(Reference r) {
+    if (is_small_int_ref(r)) {
+        return small_int_value(r);
+    }
+    return ((IntegerValue *) deref(r))->integer_value;
+}
+
 static bool is_numeric(Reference r) {
-    ValueType type = deref(r)->type;
+    ValueType type = ref_type(r);
     return type == VAL_INTEGER || type == VAL_FLOAT;
 }
 static bool is_int(Reference r) {
-    return deref(r)->type == VAL_INTEGER;
+    return ref_type(r) == VAL_INTEGER;
 }
 static bool is_float(Reference r) {
-    return deref(r)->type == VAL_FLOAT;
+    return ref_type(r) == VAL_FLOAT;
 }
 
 
 static const char *get_typestr(Reference r) {
-    switch (deref(r)->type) {
+    switch (ref_type(r)) {
         case VAL_NONE:      return "NoneType";
         case VAL_BOOL:      return "bool";
         case VAL_INTEGER:   return "int";
         case VAL_FLOAT:     return "float";
         case VAL_STRING:    return "str";
-        case VAL_LIST_NODE: return "list";
-        case VAL_DICT_NODE: return "dict";
+        case VAL_LIST:      return "list";
+        case VAL_DICT:      return "dict";
         default:            return "<unknown>";
     }
 }
@@ -137,7 +229,7 @@ Promotion get_promotion(Reference l, Reference r) {
 }
 
 ListValue *to_list_value(Value *v) {
-    assert(v == NULL || v->type == VAL_LIST_NODE);
+    assert(v == NULL || v->type == VAL_LIST);
     return (ListValue *) v;
 }
 
@@ -147,7 +239,7 @@ ListValue *deref_to_list_value(Reference ref) {
 
 
 DictValue *to_dict_value(Value *v) {
-    assert(v == NULL || v->type == VAL_DICT_NODE);
+    assert(v == NULL || v->type == VAL_DICT);
     return (DictValue *) v;
 }
 
@@ -157,248 +249,585 @@ DictValue *deref_to_dict_value(Reference ref) {
 }
 
 
+/*! Returns the length of a string or rope. */
+static int string_length(Reference ref) {
+    Value *v = deref(ref);
+
+    if (v->type == VAL_ROPE) {
+        return ((RopeValue *) v)->length;
+    }
+    return v->data_size - string_data_size(0);
+}
+
 /*!
- * Returns the length of the list, not including the dummy start value.
+ * Returns the StringValue holding the text of a string, or of a rope that
+ * has been flattened with `string_flatten`.
  */
-long int list_get_length(Reference ref) {
-    ListValue *elem = deref_to_list_value(ref);
+static StringValue *deref_to_string_value(Reference ref) {
+    Value *v = deref(ref);
+
+    if (v->type == VAL_ROPE) {
+        RopeValue *rv = (RopeValue *) v;
+        assert(rv->right == NULL_REF);
+        v = deref(rv->left);
+    }
 
-    /* Skip over the dummy value. */
-    elem = deref_to_list_value(elem->list_node.next);
+    assert(v->type == VAL_STRING);
+    return (StringValue *) v;
+}
 
-    long int length = 0;
-    while (elem) {
-        elem = deref_to_list_value(elem->list_node.next);
-        length++;
+/*
+ * A stack of the ropes still to be visited when walking a rope's pieces.  It
+ * is kept between walks, and only grows.
+ */
+static Reference *rope_stack = NULL;
+static int max_rope_stack = 0;
+
+static void rope_push(int *num, Reference ref) {
+    if (*num == max_rope_stack) {
+        max_rope_stack = max_rope_stack ? max_rope_stack * 2 : INITIAL_SIZE;
+        rope_stack = realloc(rope_stack, sizeof(Reference) * max_rope_stack);
+        if (rope_stack == NULL) {
+            error("%s", "Allocation failed!");
+        }
     }
+    rope_stack[(*num)++] = ref;
+}
+
+/*!
+ * Calls f with each piece of a string's text, in order.  This does not
+ * allocate, so it is safe to do while holding pointers into the pool.
+ */
+static void string_foreach_piece(Reference ref,
+                                 void (*f)(const char *text, int len,
+                                           void *arg),
+                                 void *arg) {
+    int num = 0;
+    rope_push(&num, ref);
+
+    while (num > 0) {
+        Value *v = deref(rope_stack[--num]);
+
+        /* Go down the left sides, leaving the right sides for later. */
+        while (v->type == VAL_ROPE) {
+            RopeValue *rv = (RopeValue *) v;
+            if (rv->right != NULL_REF) {
+                rope_push(&num, rv->right);
+            }
+            v = deref(rv->left);
+        }
 
-    return length;
+        StringValue *sv = (StringValue *) v;
+        f(sv->string_value, v->data_size - string_data_size(0), arg);
+    }
 }
 
 /*!
- * Returns the element of the list at index idx, or reports an error if the
- * list doesn't have an element at that index.
+ * Copies the text of a string or rope into dest, which must have room for
+ * all of it.  The rope is walked from the right, so that a rope built by
+ * appending to the end, the usual case, is walked without going deeper.
  */
-ListValue *list_get_elem(Reference ref, long int idx) {
-    /* If the index is negative, then figure out the length of the list
-     * and compute the true index. */
-    if (idx < 0) {
-        idx += list_get_length(ref);
+static void string_copy(Reference ref, char *dest) {
+    char *end = dest + string_length(ref);
+    int num = 0;
+    rope_push(&num, ref);
+
+    while (num > 0) {
+        Value *v = deref(rope_stack[--num]);
+
+        while (v->type == VAL_ROPE) {
+            RopeValue *rv = (RopeValue *) v;
+            if (rv->right != NULL_REF) {
+                rope_push(&num, rv->left);
+                v = deref(rv->right);
+            } else {
+                v = deref(rv->left);
+            }
+        }
+
+        int len = v->data_size - string_data_size(0);
+        end -= len;
+        memcpy(end, ((StringValue *) v)->string_value, len);
     }
 
-    /* If the index is still negative, then we are out of bounds. */
-    if (idx < 0) {
-        error("list index out of range");
+    assert(end == dest);
+}
+
+/*!
+ * Flattens a rope, if ref is one that has not been flattened yet, so that
+ * `deref_to_string_value` can be used on it.  This allocates, so it can
+ * collect garbage; ref itself is kept alive.
+ */
+static void string_flatten(Reference ref) {
+    RopeValue *rv = (RopeValue *) deref(ref);
+    if (rv->type != VAL_ROPE || rv->right == NULL_REF) {
+        return;
     }
 
-    /* The first node in a list is always a dummy value, so we can ignore it.
-     * (Also, verify that it actually doesn't hold anything.) */
-    ListValue *elem = deref_to_list_value(ref);
-    assert(elem->list_node.value == NULL_REF);
+    size_t tglob_idx = add_temporary_global(ref);
+
+    int length = rv->length;
+    StringValue *sv = (StringValue *) mm_malloc(VAL_STRING,
+                            string_data_size(length));
+    sv->hash = 0;
+    string_copy(ref, sv->string_value);
+    sv->string_value[length] = '\0';
+
+    /* The pieces are no longer needed once the text has been copied. */
+    rv = (RopeValue *) deref(ref);
+    rv->left = sv->ref;
+    rv->right = NULL_REF;
+    mm_write_barrier(ref, rv->left);
+
+    remove_temporary_global(tglob_idx);
+}
+
+
+/*! Returns the array holding a list's elements, or NULL if it has none. */
+static ArrayValue *list_get_items(ListValue *lv) {
+    return (ArrayValue *) deref(lv->items);
+}
+
+/*! Returns how many elements a list has room for without growing. */
+static long int list_get_capacity(ListValue *lv) {
+    ArrayValue *items = list_get_items(lv);
+    return items ? items->data_size / (long int) sizeof(Reference) : 0;
+}
+
+/*!
+ * Returns the length of the list.
+ */
+long int list_get_length(Reference ref) {
+    return deref_to_list_value(ref)->length;
+}
+
+/*!
+ * Turns a possibly negative index into the list into the true index, or
+ * reports an error if the list doesn't have an element at that index.
+ */
+static long int list_get_index(Reference ref, long int idx) {
+    long int length = list_get_length(ref);
 
-    /* Now traverse (from -1 to skip the dummy element) to the element we
-     * want. */
-    for (int i = -1; elem && i < idx; i++) {
-        ref = elem->list_node.next;
-        elem = deref_to_list_value(ref);
+    /* If the index is negative, then count from the end of the list. */
+    if (idx < 0) {
+        idx += length;
     }
 
-    if (elem == NULL) {
+    if (idx < 0 || idx >= length) {
         error("list index out of range");
     }
 
-    return elem;
+    return idx;
 }
 
-void list_delete_elem(Reference ref, long int idx) {
-    /* If the index is negative, then figure out the length of the list
-     * and compute the true index. */
-    if (idx < 0) {
-        idx += list_get_length(ref);
+/*!
+ * Returns the slot holding the element of the list at index idx, or reports
+ * an error if the list doesn't have an element at that index.  If owner is
+ * not NULL, it is set to the Value that holds the slot, for the write
+ * barrier.
+ */
+Reference *list_get_elem(Reference ref, long int idx, Reference *owner) {
+    idx = list_get_index(ref, idx);
+
+    ArrayValue *items = list_get_items(deref_to_list_value(ref));
+    if (owner != NULL) {
+        *owner = items->ref;
     }
 
-    /* If the index is still negative, then we are out of bounds. */
-    if (idx < 0) {
-        error("list index out of range");
+    return &items->items[idx];
+}
+
+/*!
+ * Makes sure the list has room for at least capacity elements, by moving
+ * them into a larger array if it does not.  The list must be reachable from
+ * the globals, since the new array is allocated.
+ */
+static void list_reserve(Reference ref, long int capacity) {
+    if (list_get_capacity(deref_to_list_value(ref)) >= capacity) {
+        return;
     }
 
-    /* The first node in a list is always a dummy value, so we can ignore it.
-     * (Also, verify that it actually doesn't hold anything.) */
-    ListValue *elem = deref_to_list_value(ref);
-    assert(elem->list_node.value == NULL_REF);
+    ArrayValue *grown = (ArrayValue *) mm_malloc(VAL_ARRAY,
+                            capacity * sizeof(Reference));
+
+    /* The allocation may have moved the list and its old array. */
+    ListValue *lv = deref_to_list_value(ref);
+    ArrayValue *items = list_get_items(lv);
 
-    /* Now traverse (from -1 to skip the dummy element) to the element right
-     * before then one we want. */
-    for (int i = -1; elem && i < idx - 1; i++) {
-        ref = elem->list_node.next;
-        elem = deref_to_list_value(ref);
+    long int i;
+    for (i = 0; i < lv->length; i++) {
+        grown->items[i] = items->items[i];
+    }
+    for (; i < capacity; i++) {
+        grown->items[i] = NULL_REF;
     }
 
-    if (elem == NULL) {
-        error("list index out of range");
+    lv->items = grown->ref;
+    mm_write_barrier(ref, grown->ref);
+}
+
+/*!
+ * Adds an element to the end of the list.  When the list is full its
+ * capacity is doubled, so a run of appends takes amortized constant time.
+ */
+void list_append(Reference ref, Reference value) {
+    ListValue *lv = deref_to_list_value(ref);
+    long int capacity = list_get_capacity(lv);
+
+    if (lv->length == capacity) {
+        /* Keep the value alive while the list grows. */
+        size_t tglob_idx = add_temporary_global(value);
+        list_reserve(ref, capacity > 0 ? capacity * 2 : INITIAL_SIZE);
+        remove_temporary_global(tglob_idx);
+
+        lv = deref_to_list_value(ref);
     }
 
-    /* Now get the actual element we are trying to delete. */
-    ListValue *next = deref_to_list_value(elem->list_node.next);
+    ArrayValue *items = list_get_items(lv);
+    items->items[lv->length++] = value;
+    mm_write_barrier(items->ref, value);
+}
 
-    if (next == NULL) {
-        error("list index out of range");
+void list_delete_elem(Reference ref, long int idx) {
+    idx = list_get_index(ref, idx);
+
+    /* Shift the later elements down over the deleted one.  They stay in the
+     * same array, so the write barrier does not need to hear about it. */
+    ListValue *lv = deref_to_list_value(ref);
+    ArrayValue *items = list_get_items(lv);
+
+    lv->length--;
+    for (long int i = idx; i < lv->length; i++) {
+        items->items[i] = items->items[i + 1];
+    }
+    items->items[lv->length] = NULL_REF;
+}
+
+
+/*! Index slots that do not refer to an entry. */
+#define DICT_EMPTY -1
+#define DICT_DELETED -2
+
+/*!
+ * Returns how many entries a dictionary table with num_slots slots may hold.
+ * Keeping the load factor under 2/3 keeps probe sequences short.
+ */
+static int dict_max_entries(int num_slots) {
+    return num_slots * 2 / 3;
+}
+
+/*! Returns the data_size of a dictionary table with num_slots slots. */
+static int dict_table_size(int num_slots) {
+    return offsetof(DictTableValue, entries) - sizeof(Value) +
+           dict_max_entries(num_slots) * sizeof(DictEntry) +
+           num_slots * sizeof(int);
+}
+
+/*! Returns the smallest number of slots with room for length entries. */
+static int dict_slots_for(long int length) {
+    int num_slots = INITIAL_SIZE;
+    while (dict_max_entries(num_slots) < length) {
+        num_slots *= 2;
     }
+    return num_slots;
+}
+
+/*! Returns the hash index of a dictionary table. */
+static int *dict_get_index(DictTableValue *table) {
+    return (int *) (table->entries + dict_max_entries(table->num_slots));
+}
+
+/*! Returns the table of a dictionary, or NULL if it has none. */
+static DictTableValue *dict_get_table(DictValue *dv) {
+    return (DictTableValue *) deref(dv->table);
+}
 
-    /* Remove this element from the list. */
-    elem->list_node.next = next->list_node.next;
+/*! Scrambles the bits of an integer, so that nearby integers hash apart. */
+static unsigned int hash_int(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
 }
 
+/*! Returns the FNV-1a hash of a NUL-terminated string. */
+static unsigned int hash_chars(const char *str) {
+    unsigned int hash = 2166136261U;
+    for (const char *c = str; *c; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
 
 /*!
- * Returns the length of the dict, not including the dummy start value.
+ * Returns the hash of a string, computing it the first time and caching it
+ * in the StringValue after that.  0 means "not computed", so a string whose
+ * hash really is 0 is given 1 instead.
  */
-long int dict_get_length(Reference ref) {
-    DictValue *elem = deref_to_dict_value(ref);
+static unsigned int hash_string(StringValue *sv) {
+    if (sv->hash == 0) {
+        unsigned int hash = hash_chars(sv->string_value);
+        sv->hash = hash != 0 ? hash : 1;
+    }
+    return sv->hash;
+}
 
-    /* Skip over the dummy value. */
-    elem = deref_to_dict_value(elem->dict_node.next);
+/*!
+ * Returns the hash of a dictionary key, or reports an error if the key is
+ * not hashable.  Keys that compare equal hash equal, so a float holding a
+ * whole number hashes like the int it equals.  None, True and False are the
+ * only Values of their types, so they hash by Reference.
+ */
+static unsigned int hash_ref(Reference key) {
+    switch (ref_type(key)) {
+        case VAL_NONE:
+        case VAL_BOOL:
+            return hash_int(key);
+
+        case VAL_INTEGER:
+            return hash_int(int_value(key));
+
+        case VAL_FLOAT: {
+            double f = ((FloatValue *) deref(key))->float_value;
+            if (f >= INT_MIN && f <= INT_MAX && f == floor(f)) {
+                return hash_int((int) f);
+            }
+
+            unsigned long long bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return hash_int(bits ^ (bits >> 32));
+        }
+
+        case VAL_STRING:
+            string_flatten(key);
+            return hash_string(deref_to_string_value(key));
+
+        default:
+            error("unhashable type: '%s'", get_typestr(key));
+    }
+}
 
-    long int length = 0;
-    while (elem) {
-        elem = deref_to_dict_value(elem->dict_node.next);
-        length++;
+/*! Returns true if two dictionary keys are equal. */
+static bool dict_keys_equal(Reference a, Reference b) {
+    if (a == b) {
+        return true;
     }
 
-    return length;
+    if (is_numeric(a) && is_numeric(b)) {
+        return eval_generic_comp(COMP_EQUALS, a, b);
+    }
+
+    if (ref_type(a) != VAL_STRING || ref_type(b) != VAL_STRING) {
+        return false;
+    }
+
+    /* Both have been hashed, so neither is an unflattened rope. */
+    StringValue *as = deref_to_string_value(a);
+    StringValue *bs = deref_to_string_value(b);
+    if (hash_string(as) != hash_string(bs)) {
+        return false;
+    }
+    return strcmp(as->string_value, bs->string_value) == 0;
 }
 
+/*!
+ * Finds the slot of the hash index that refers to the entry for key, and
+ * sets *found to true.  If there is no such entry, sets *found to false and
+ * returns the slot a new entry for key should go in.
+ */
+static int dict_find_slot(DictTableValue *table, Reference key,
+                          unsigned int hash, bool *found) {
+    int *index = dict_get_index(table);
+    unsigned int mask = table->num_slots - 1;
+    int insert = -1;
+
+    /* The table is never full, so there is always an empty slot to stop at. */
+    for (unsigned int slot = hash & mask; ; slot = (slot + 1) & mask) {
+        int entry = index[slot];
+
+        if (entry == DICT_EMPTY) {
+            *found = false;
+            return insert >= 0 ? insert : (int) slot;
+        } else if (entry == DICT_DELETED) {
+            if (insert < 0) {
+                insert = slot;
+            }
+        } else if (dict_keys_equal(table->entries[entry].key, key)) {
+            *found = true;
+            return slot;
+        }
+    }
+}
 
-DictValue *dict_get_entry(Reference ref, Reference key, bool create) {
+/*!
+ * Moves the entries of the dictionary into a new table with num_slots slots,
+ * leaving out the deleted ones.  The dictionary must be reachable from the
+ * globals, since the new table is allocated.
+ */
+static void dict_resize(Reference ref, int num_slots) {
+    DictTableValue *resized = (DictTableValue *) mm_malloc(VAL_DICT_TABLE,
+                                dict_table_size(num_slots));
+    resized->num_slots = num_slots;
+    resized->num_entries = 0;
 
-    /* The first node in a dictionary is always a dummy value, so we can
-     * ignore it.  (Also, verify that it actually doesn't hold anything.)
-     */
-    DictValue *start = deref_to_dict_value(ref);
-    DictValue *entry = start;
-    DictValue *prev;
-    assert(start->dict_node.key == NULL_REF);
-    assert(start->dict_node.value == NULL_REF);
+    int *index = dict_get_index(resized);
+    for (int i = 0; i < num_slots; i++) {
+        index[i] = DICT_EMPTY;
+    }
 
-    /* Move past the first entry. */
-    entry = deref_to_dict_value(entry->dict_node.next);
-    prev = start;
+    /* The allocation may have moved the dictionary and its old table. */
+    DictValue *dv = deref_to_dict_value(ref);
+    DictTableValue *table = dict_get_table(dv);
+    unsigned int mask = num_slots - 1;
 
-    /* Iterate until we find our key, or until we reach the end of the
-     * dictionary's entries. */
-    while (entry != NULL) {
-        if (eval_generic_comp(COMP_EQUALS, entry->dict_node.key, key)) {
-            break;
+    for (int i = 0; table && i < table->num_entries; i++) {
+        DictEntry *entry = &table->entries[i];
+        if (entry->key == NULL_REF) {
+            continue;
         }
 
-        prev = entry;
-        entry = deref_to_dict_value(entry->dict_node.next);
+        /* The keys are all different, so just find an empty slot. */
+        unsigned int slot = hash_ref(entry->key) & mask;
+        while (index[slot] != DICT_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+
+        index[slot] = resized->num_entries;
+        resized->entries[resized->num_entries++] = *entry;
+    }
+
+    dv->table = resized->ref;
+    mm_write_barrier(ref, resized->ref);
+}
+
+/*!
+ * Returns the length of the dict.
+ */
+long int dict_get_length(Reference ref) {
+    return deref_to_dict_value(ref)->length;
+}
+
+/*!
+ * Returns the slot holding the value for key in the dictionary.  If the key
+ * is missing, either reports an error, or if create is true adds an entry
+ * for it whose value is None.  If owner is not NULL, it is set to the Value
+ * that holds the slot, for the write barrier.  Hashing a key that is a rope
+ * flattens it, which allocates, so the dictionary must be rooted, and is only
+ * dereferenced after that.
+ */
+Reference *dict_get_entry(Reference ref, Reference key, bool create,
+                          Reference *owner) {
+    unsigned int hash = hash_ref(key);
+    DictValue *dv = deref_to_dict_value(ref);
+    DictTableValue *table = dict_get_table(dv);
+    bool found = false;
+    int slot = 0;
+
+    if (table != NULL) {
+        slot = dict_find_slot(table, key, hash, &found);
     }
 
-    /* If we got NULL, then that means our key is missing. */
-    if (entry == NULL) {
+    if (!found) {
         if (!create) {
             /* The caller wants us to report an error. */
             error("key not found");
         }
-        else {
-            /* The caller wants us to create a new entry.  Tack it onto the
-             * end of the dictionary.  Set the key, but we don't know what
-             * value it should have yet.
-             */
 
-            Reference entry_ref = make_reference_dict_node(key, NULL_REF);
-            entry = (DictValue *) deref(entry_ref);
+        /* Grow the table when it has no room for another entry.  It is sized
+         * so that it will be at most half full afterwards. */
+        if (table == NULL ||
+                table->num_entries == dict_max_entries(table->num_slots)) {
+            size_t tglob_idx = add_temporary_global(key);
+            dict_resize(ref, dict_slots_for(2 * (dv->length + 1)));
+            remove_temporary_global(tglob_idx);
 
-            assert(prev != NULL);
-            assert(prev->dict_node.next == NULL_REF);
-            prev->dict_node.next = entry_ref;
+            dv = deref_to_dict_value(ref);
+            table = dict_get_table(dv);
+            slot = dict_find_slot(table, key, hash, &found);
         }
+
+        int entry = table->num_entries++;
+        table->entries[entry].key = key;
+        table->entries[entry].value = NONE_REF;
+        dict_get_index(table)[slot] = entry;
+        dv->length++;
+        mm_write_barrier(table->ref, key);
+    }
+
+    if (owner != NULL) {
+        *owner = table->ref;
     }
 
-    return entry;
+    return &table->entries[dict_get_index(table)[slot]].value;
 }
 
 void dict_delete_entry(Reference ref, Reference key) {
-    (void) ref;
-    (void) key;
-
-    /* The first node in a dictionary is always a dummy value, so we can
-     * ignore it.  (Also, verify that it actually doesn't hold anything.) */
-    DictValue *prev;
-    DictValue *entry = deref_to_dict_value(ref);
-    assert(entry->dict_node.key == NULL_REF);
-    assert(entry->dict_node.value == NULL_REF);
-
-    /* Move past the first entry. */
-    prev = entry;
-    entry = deref_to_dict_value(entry->dict_node.next);
-
-    /* Iterate until we find our key, or until we reach the end of the
-     * dictionary's entries. */
-    while (entry != NULL) {
-        if (eval_generic_comp(COMP_EQUALS, entry->dict_node.key, key)) {
-            break;
-        }
+    unsigned int hash = hash_ref(key);
+    DictValue *dv = deref_to_dict_value(ref);
+    DictTableValue *table = dict_get_table(dv);
+    bool found = false;
+    int slot = 0;
 
-        prev = entry;
-        entry = deref_to_dict_value(entry->dict_node.next);
+    if (table != NULL) {
+        slot = dict_find_slot(table, key, hash, &found);
     }
 
-    /* If we got NULL, then that means our key is missing. */
-    if (entry == NULL) {
+    /* If it wasn't found, then that means our key is missing. */
+    if (!found) {
         error("key not found");
     }
 
-    /* Otherwise, remove the entry. */
-    prev->dict_node.next = entry->dict_node.next;
+    /* Otherwise, remove the entry.  Its slot is marked deleted rather than
+     * empty, so that probes for the keys after it still find them. */
+    int *index = dict_get_index(table);
+    table->entries[index[slot]].key = NULL_REF;
+    table->entries[index[slot]].value = NULL_REF;
+    index[slot] = DICT_DELETED;
+    dv->length--;
 }
 
 
 //// REFERENCE COERCION ////
 
 static inline bool coerce_ref_to_bool(Reference l) {
-    Value *v = deref(l);
-
-    switch (v->type) {
+    switch (ref_type(l)) {
         case VAL_NONE:
             return false;
         case VAL_BOOL:
             return l == TRUE_REF;
         case VAL_INTEGER:
-            return ((IntegerValue *) v)->integer_value;
+            return int_value(l);
         case VAL_FLOAT:
-            return ((FloatValue *) v)->float_value;
+            return ((FloatValue *) deref(l))->float_value;
         case VAL_STRING:
-            return strlen(((StringValue *) v)->string_value) > 0;
-        case VAL_LIST_NODE:
-            return ((ListValue *) v)->list_node.next != NULL_REF;
-        case VAL_DICT_NODE:
-            return ((DictValue *) v)->dict_node.next != NULL_REF;
+            return string_length(l) > 0;
+        case VAL_LIST:
+            return deref_to_list_value(l)->length > 0;
+        case VAL_DICT:
+            return deref_to_dict_value(l)->length > 0;
         default:
             error("cannot coerce '%s' to bool", get_typestr(l));
     }
 }
 static inline double coerce_ref_to_float(Reference l) {
-    Value *v = deref(l);
-
-    switch (v->type) {
+    switch (ref_type(l)) {
         case VAL_INTEGER:
-            return (double) ((IntegerValue *) v)->integer_value;
+            return (double) int_value(l);
         case VAL_FLOAT:
-            return ((FloatValue *) v)->float_value;
+            return ((FloatValue *) deref(l))->float_value;
         default:
             error("cannot coerce '%s' to float", get_typestr(l));
     }
 }
 static inline long int coerce_ref_to_int(Reference l) {
-    Value *v = deref(l);
-
-    switch (v->type) {
+    switch (ref_type(l)) {
         case VAL_INTEGER:
-            return ((IntegerValue *) v)->integer_value;
+            return int_value(l);
         case VAL_FLOAT:
-            return (long int) ((FloatValue *) v)->float_value;
+            return (long int) ((FloatValue *) deref(l))->float_value;
         default:
             error("cannot coerce '%s' to int", get_typestr(l));
     }
@@ -407,137 +836,280 @@ static inline long int coerce_ref_to_int(Reference l) {
 
 //// PRINTING CODE ////
 
-void ref_print_ext(FILE *os, Reference ref, bool newline, int depth);
-
-void list_print(FILE *os, Reference ref, int depth) {
-    bool first = true;
+/*
+ * Values are formatted into out_buffer, which is written out in one go
+ * once the whole line is in it; and if a line grows past PRINT_FLUSH_SIZE
+ * it is written out a piece at a time, so that the buffer stays small.
+ * Nothing here allocates in the pool, so it is safe to hold pointers into
+ * it while printing.
+ */
+#define PRINT_FLUSH_SIZE 65536
 
-    /* The first element is a dummy element.  Skip it. */
-    ListValue *lv = deref_to_list_value(ref);
-    assert(lv->list_node.value == NULL_REF);
-    lv = deref_to_list_value(lv->list_node.next);
+static struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} out_buffer;
 
-    while (lv != NULL) {
-        if (first) {
-            first = false;
-        } else {
-            fprintf(os, ", ");
-        }
+/*! Makes room for n more bytes in out_buffer. */
+static void out_reserve(size_t n) {
+    if (out_buffer.length + n <= out_buffer.capacity) {
+        return;
+    }
 
-        if (depth != 0) {
-            ref_print_ext(os, lv->list_node.value, false, depth - 1);
-        } else {
-            fprintf(os, "...");
-        }
+    size_t capacity = out_buffer.capacity ? out_buffer.capacity : 256;
+    while (capacity < out_buffer.length + n) {
+        capacity *= 2;
+    }
 
-        lv = deref_to_list_value(lv->list_node.next);
+    out_buffer.data = realloc(out_buffer.data, capacity);
+    if (out_buffer.data == NULL) {
+        error("%s", "Allocation failed!");
     }
+    out_buffer.capacity = capacity;
 }
 
-void dict_print(FILE *os, Reference ref, int depth) {
-    bool first = true;
+static void out_append(const char *text, size_t len) {
+    out_reserve(len);
+    memcpy(out_buffer.data + out_buffer.length, text, len);
+    out_buffer.length += len;
+}
 
-    /* The first entry is a dummy entry.  Skip it. */
-    DictValue *dv = deref_to_dict_value(ref);
-    assert(dv->dict_node.key == NULL_REF);
-    assert(dv->dict_node.value == NULL_REF);
-    dv = deref_to_dict_value(dv->dict_node.next);
+static void out_append_str(const char *text) {
+    out_append(text, strlen(text));
+}
 
-    while (dv != NULL) {
-        if (first) {
-            first = false;
-        } else {
-            fprintf(os, ", ");
-        }
+/*! Appends an int in decimal; this is what "%d" would print. */
+static void out_append_int(int value) {
+    char digits[12];
+    char *p = digits + sizeof(digits);
+    unsigned int magnitude = value < 0 ? -(unsigned int) value
+                                       : (unsigned int) value;
 
-        /* depth irrelevant for keys */
-        ref_print_ext(os, dv->dict_node.key, false, 0);
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
 
-        fprintf(os, ": ");
+    out_append(p, digits + sizeof(digits) - p);
+}
 
-        if (depth != 0) {
-            ref_print_ext(os, dv->dict_node.value, false, depth - 1);
-        } else {
-            fprintf(os, "...");
-        }
+/*! Writes out what has been formatted so far. */
+static void out_flush(FILE *os) {
+    fwrite(out_buffer.data, 1, out_buffer.length, os);
+    out_buffer.length = 0;
+}
 
-        dv = deref_to_dict_value(dv->dict_node.next);
-    }
+/*! Appends a piece of a string; a callback for `string_foreach_piece`. */
+static void out_append_piece(const char *text, int len, void *arg) {
+    (void) arg;
+    out_append(text, len);
 }
 
-void ref_print_ext(FILE *os, Reference ref, bool newline, int depth) {
-    Value *v = deref(ref);
-    switch (v->type) {
+/*!
+ * Appends a value that is not a list or dict.  Returns false, having
+ * appended nothing, if it is one.
+ */
+static bool format_scalar(Reference ref) {
+    switch (ref_type(ref)) {
         case VAL_NONE:
-            fprintf(os, "None");
-            break;
+            out_append_str("None");
+            return true;
 
         case VAL_BOOL:
-            fprintf(os, ref == TRUE_REF ? "True" : "False");
-            break;
+            out_append_str(ref == TRUE_REF ? "True" : "False");
+            return true;
 
         case VAL_INTEGER:
-            fprintf(os, "%d", ((IntegerValue *) v)->integer_value);
-            break;
-
-        case VAL_FLOAT:
-            fprintf(os, "%f", ((FloatValue *) v)->float_value);
-            break;
+            out_append_int(int_value(ref));
+            return true;
+
+        case VAL_FLOAT: {
+            /* "%f" of the largest double is 316 characters long. */
+            out_reserve(320);
+            out_buffer.length += snprintf(
+                    out_buffer.data + out_buffer.length, 320, "%f",
+                    ((FloatValue *) deref(ref))->float_value);
+            return true;
+        }
 
         case VAL_STRING:
-            fprintf(os, "\"%s\"", ((StringValue *) v)->string_value);
-            break;
-
-        case VAL_LIST_NODE:
-            fprintf(os, "[");
-            list_print(os, ref, depth);
-            fprintf(os, "]");
-            break;
+            out_append("\"", 1);
+            string_foreach_piece(ref, out_append_piece, NULL);
+            out_append("\"", 1);
+            return true;
 
-        case VAL_DICT_NODE:
-            fprintf(os, "{");
-            dict_print(os, ref, depth);
-            fprintf(os, "}");
-            break;
+        case VAL_LIST:
+        case VAL_DICT:
+            return false;
 
         default:
-            fprintf(os, "Unrecognized value type\n");
-            break;
-    }
-
-    if (newline) {
-        fprintf(os, "\n");
+            out_append_str("Unrecognized value type\n");
+            return true;
     }
 }
 
-void ref_print(FILE *os, Reference ref) {
-    ref_print_ext(os, ref, false, MAX_DEPTH);
-}
-void ref_println(FILE *os, Reference ref) {
-    ref_print_ext(os, ref, true, MAX_DEPTH);
-}
+/*!
+ * A list or dict being formatted: its items or entries, how many there are,
+ * the index of the next one to do, whether one has been done yet, and how
+ * many levels further down containers are shown.  Printing does not
+ * allocate, so nothing moves and the pointers stay good throughout.
+ */
+struct PrintFrame {
+    const Reference *items;         /* For a list. */
+    const DictEntry *entries;       /* For a dict. */
+    long int length;
+    long int index;
+    int depth;
+    bool is_dict;
+    bool first;
+};
 
-//// COMPARISON SYSTEM ////
-static const char *eval_generic_str(NodeExprBuiltinType type) {
-    switch (type) {
-        case COMP_EQUALS:   return "==";
-        case COMP_LT:       return "<";
-        case COMP_GT:       return ">";
-        case COMP_LE:       return "<=";
-        case COMP_GE:       return ">=";
-        case OP_ADD:        return "+";
-        case OP_SUBTRACT:   return "-";
-        case OP_MULTIPLY:   return "*";
-        case OP_DIVIDE:     return "/";
-        case OP_MODULO:     return "%";
-        default:            return "?";
+static struct PrintFrame *print_stack = NULL;
+static int max_print_stack = 0;
+
+/*! Appends the opening of a list or dict, and returns its frame. */
+static struct PrintFrame *open_container(int num_frames, Reference ref,
+                                         int depth) {
+    if (num_frames == max_print_stack) {
+        max_print_stack = max_print_stack ? max_print_stack * 2
+                                          : INITIAL_SIZE;
+        print_stack = realloc(print_stack,
+                              sizeof(struct PrintFrame) * max_print_stack);
+        if (print_stack == NULL) {
+            error("%s", "Allocation failed!");
+        }
     }
-}
-noreturn static Reference eval_generic_error(NodeExprBuiltinType type,
-                                             Reference l, Reference r) {
-    error("unsupported operand type(s) for %s: '%s' and '%s'",
-            eval_generic_str(type), get_typestr(l), get_typestr(r));
-}
+
+    struct PrintFrame *frame = &print_stack[num_frames];
+    frame->items = NULL;
+    frame->entries = NULL;
+    frame->length = 0;
+    frame->index = 0;
+    frame->depth = depth;
+    frame->is_dict = ref_type(ref) == VAL_DICT;
+    frame->first = true;
+
+    if (frame->is_dict) {
+        DictTableValue *table = dict_get_table(deref_to_dict_value(ref));
+        if (table != NULL) {
+            frame->entries = table->entries;
+            frame->length = table->num_entries;
+        }
+        out_append("{", 1);
+    } else {
+        ListValue *lv = deref_to_list_value(ref);
+        if (lv->length > 0) {
+            frame->items = list_get_items(lv)->items;
+            frame->length = lv->length;
+        }
+        out_append("[", 1);
+    }
+
+    return frame;
+}
+
+/*!
+ * Appends a value.  Containers more than depth levels down are shown as
+ * "...".  Lists and dicts are walked with an explicit stack, rather than
+ * recursively, one item at a time.
+ */
+static void format_value(FILE *os, Reference ref, int depth) {
+    if (format_scalar(ref)) {
+        return;
+    }
+
+    open_container(0, ref, depth);
+    int num_frames = 1;
+
+    while (num_frames > 0) {
+        struct PrintFrame *frame = &print_stack[num_frames - 1];
+        Reference item = NULL_REF;
+
+        if (frame->is_dict) {
+            /* Skip the deleted entries. */
+            while (frame->index < frame->length &&
+                    frame->entries[frame->index].key == NULL_REF) {
+                frame->index++;
+            }
+
+            if (frame->index < frame->length) {
+                const DictEntry *entry = &frame->entries[frame->index++];
+                if (!frame->first) {
+                    out_append(", ", 2);
+                }
+
+                /* Keys are hashable, so never lists or dicts. */
+                format_scalar(entry->key);
+                out_append(": ", 2);
+                item = entry->value;
+            }
+        } else if (frame->index < frame->length) {
+            if (!frame->first) {
+                out_append(", ", 2);
+            }
+            item = frame->items[frame->index++];
+        }
+
+        if (item == NULL_REF) {
+            /* That was the last of this container. */
+            out_append(frame->is_dict ? "}" : "]", 1);
+            num_frames--;
+            continue;
+        }
+
+        frame->first = false;
+        if (frame->depth == 0) {
+            out_append("...", 3);
+        } else if (!format_scalar(item)) {
+            open_container(num_frames++, item, frame->depth - 1);
+        }
+
+        if (out_buffer.length >= PRINT_FLUSH_SIZE) {
+            out_flush(os);
+        }
+    }
+}
+
+void ref_print_ext(FILE *os, Reference ref, bool newline, int depth) {
+    format_value(os, ref, depth);
+    if (newline) {
+        out_append("\n", 1);
+    }
+    out_flush(os);
+}
+
+void ref_print(FILE *os, Reference ref) {
+    ref_print_ext(os, ref, false, MAX_DEPTH);
+}
+void ref_println(FILE *os, Reference ref) {
+    ref_print_ext(os, ref, true, MAX_DEPTH);
+}
+
+//// COMPARISON SYSTEM ////
+static const char *eval_generic_str(NodeExprBuiltinType type) {
+    switch (type) {
+        case COMP_EQUALS:   return "==";
+        case COMP_LT:       return "<";
+        case COMP_GT:       return ">";
+        case COMP_LE:       return "<=";
+        case COMP_GE:       return ">=";
+        case OP_ADD:        return "+";
+        case OP_SUBTRACT:   return "-";
+        case OP_MULTIPLY:   return "*";
+        case OP_DIVIDE:     return "/";
+        case OP_MODULO:     return "%";
+        default:            return "?";
+    }
+}
+noreturn static Reference eval_generic_error(NodeExprBuiltinType type,
+                                             Reference l, Reference r) {
+    error("unsupported operand type(s) for %s: '%s' and '%s'",
+            eval_generic_str(type), get_typestr(l), get_typestr(r));
+}
 
 static bool eval_generic_comp_float(NodeExprBuiltinType type,
                                     Reference l, Reference r) {
@@ -576,8 +1148,14 @@ static bool eval_generic_comp_int(NodeExprBuiltinType type,
 static bool eval_generic_comp_string(NodeExprBuiltinType type,
                                      Reference l, Reference r) {
 
-    const char *lval = ((StringValue *) deref(l))->string_value;
-    const char *rval = ((StringValue *) deref(r))->string_value;
+    /* Flattening can collect garbage, so keep r alive while l is done. */
+    size_t tglob_idx = add_temporary_global(r);
+    string_flatten(l);
+    string_flatten(r);
+    remove_temporary_global(tglob_idx);
+
+    const char *lval = deref_to_string_value(l)->string_value;
+    const char *rval = deref_to_string_value(r)->string_value;
     int res = strcmp(lval, rval);
 
     switch (type) {
@@ -593,56 +1171,53 @@ static bool eval_generic_comp_string(NodeExprBuiltinType type,
 
 static bool eval_generic_comp_list(NodeExprBuiltinType type,
                                    Reference l, Reference r) {
-    if (l == NULL_REF) {
-        switch (type) {
-            case COMP_EQUALS:   return r == NULL_REF;
-            case COMP_LT:       return r != NULL_REF;
-            case COMP_GT:       return false;
-            case COMP_LE:       return true;
-            case COMP_GE:       return r == NULL_REF;
-            default:
-                eval_generic_error(type, l, r);
+    long int llen = list_get_length(l);
+    long int rlen = list_get_length(r);
+
+    for (long int i = 0; ; i++) {
+        if (i == llen) {
+            switch (type) {
+                case COMP_EQUALS:   return i == rlen;
+                case COMP_LT:       return i != rlen;
+                case COMP_GT:       return false;
+                case COMP_LE:       return true;
+                case COMP_GE:       return i == rlen;
+                default:
+                    eval_generic_error(type, l, r);
+            }
+        } else if (i == rlen) {
+            switch (type) {
+                case COMP_EQUALS:   return false;
+                case COMP_LT:       return false;
+                case COMP_GT:       return true;
+                case COMP_LE:       return false;
+                case COMP_GE:       return true;
+                default:
+                    eval_generic_error(type, l, r);
+            }
         }
-    } else if (r == NULL_REF) {
+
+        Reference lval = *list_get_elem(l, i, NULL);
+        Reference rval = *list_get_elem(r, i, NULL);
+
+        /* Compare the current element and potentially check the next in
+         * accordance to lexicographical sorting. */
         switch (type) {
-            case COMP_EQUALS:   return false;
-            case COMP_LT:       return false;
-            case COMP_GT:       return true;
-            case COMP_LE:       return false;
-            case COMP_GE:       return true;
+            case COMP_EQUALS:
+                if (!eval_generic_comp(type, lval, rval))
+                    return false;
+                break;
+            case COMP_LT:
+            case COMP_GT:
+            case COMP_LE:
+            case COMP_GE:
+                if (eval_generic_comp(type, lval, rval))
+                    return true;
+                break;
             default:
                 eval_generic_error(type, l, r);
         }
     }
-
-    ListValue *llist = deref_to_list_value(l);
-    ListValue *rlist = deref_to_list_value(r);
-
-    Reference lval = llist->list_node.value;
-    Reference rval = rlist->list_node.value;
-    Reference lnext = llist->list_node.next;
-    Reference rnext = rlist->list_node.next;
-
-    /* Advance past the dummy element at the start of all lists. */
-    if (lval == NULL_REF || rval == NULL_REF) {
-        return eval_generic_comp_list(type, lnext, rnext);
-    }
-
-    /* Otherwise compare the current element and potentially check the
-     * next in accordance to lexicographical sorting. */
-    switch (type) {
-        case COMP_EQUALS:
-            return eval_generic_comp(type, lval, rval) &&
-                        eval_generic_comp_list(type, lnext, rnext);
-        case COMP_LT:
-        case COMP_GT:
-        case COMP_LE:
-        case COMP_GE:
-            return eval_generic_comp(type, lval, rval) ||
-                        eval_generic_comp_list(type, lnext, rnext);
-        default:
-            eval_generic_error(type, l, r);
-    }
 }
 
 static bool eval_generic_comp(NodeExprBuiltinType type,
@@ -658,15 +1233,14 @@ static bool eval_generic_comp(NodeExprBuiltinType type,
             return eval_generic_comp_int(type, l, r);
 
         default: {
-            Value *lv = deref(l);
-            Value *rv = deref(r);
+            ValueType ltype = ref_type(l);
 
-            if (lv->type == rv->type) {
-                switch (lv->type) {
+            if (ltype == ref_type(r)) {
+                switch (ltype) {
                     case VAL_STRING:
                         return eval_generic_comp_string(type, l, r);
 
-                    case VAL_LIST_NODE:
+                    case VAL_LIST:
                         return eval_generic_comp_list(type, l, r);
 
                     default:
@@ -692,11 +1266,16 @@ static Reference eval_generic_comp_nodes(NodeExprBuiltinType type,
      * by the right side evauation. */
     size_t tglob_idx = add_temporary_global(lref);
 
+    /* The right side has to be kept alive as well, since comparing strings
+     * flattens ropes, which allocates. */
+    Reference rref = eval_expr(r);
+    add_temporary_global(rref);
+
     /* Now attempt to comparison. */
-    Reference result = eval_generic_comp_ref(type, lref, eval_expr(r));
+    Reference result = eval_generic_comp_ref(type, lref, rref);
 
-    /* Clean up the left hand size. */
-    remove_temporary_global(tglob_idx);
+    /* Clean up both sides. */
+    remove_temporary_globals_from(tglob_idx);
 
     return result;
 }
@@ -710,16 +1289,45 @@ static Reference eval_generic_comp_nodes(NodeExprBuiltinType type,
  *
  *  This function initializes the standard Python global singletons
  *  None, True and False, which are tied to to respective names and cannot
- *  be deleted. */
-void eval_init() {
-    add_global_variable("None",  NONE_REF = make_reference_none());
-    add_global_variable("True",  TRUE_REF = make_reference_bool(true));
-    add_global_variable("False", FALSE_REF = make_reference_bool(false));
+ *  be deleted.  Trees are run by the given evaluator. */
+void eval_init(EvalMode mode) {
+    eval_mode = mode;
+
+    add_global_variable("None",  NONE_REF);
+    add_global_variable("True",  TRUE_REF);
+    add_global_variable("False", FALSE_REF);
+}
+
+/*! Forgets every global and temporary root, leaving only None, True and
+ *  False, as `eval_init` did.  This must be done before the memory pool is
+ *  thrown away and made again, since the globals refer into it. */
+void eval_reset(void) {
+    while (first_var >= 0) {
+        delete_global_slot(first_var);
+    }
+    clear_temporary_globals();
+
+    add_global_variable("None",  NONE_REF);
+    add_global_variable("True",  TRUE_REF);
+    add_global_variable("False", FALSE_REF);
 }
 
-/*! Entry point to the evaluation system. */
+/*!
+ * Entry point to the evaluation system.  The tree-walker returns the value
+ * of an expression tree; the bytecode VM runs the tree for its effects, and
+ * always returns NULL_REF.
+ */
 Reference eval_root(Node *root) {
-    return eval_main(root).result;
+    resolve_names(root);
+    fold_constants(&root);
+
+    if (eval_mode == EVAL_TREE) {
+        return eval_main(root).result;
+    }
+
+    compile_program(root);
+    vm_run();
+    return NULL_REF;
 }
 
 EvaluationResult eval_main(Node *node) {
@@ -742,13 +1350,22 @@ EvaluationResult eval_main(Node *node) {
                 NodeStmtAssign *assign = (NodeStmtAssign *) node;
 
                 Reference rref = eval_expr(assign->right);
-                Reference *lref = eval_expr_lval(assign->left, true);
+
+                /* Evaluating a subscripted target can allocate, so keep
+                 * the right hand side alive until it has been stored. */
+                size_t tglob_idx = add_temporary_global(rref);
+
+                Reference owner;
+                Reference *lref = eval_expr_lval(assign->left, true, &owner);
 
                 /* Checking for invalid assignments should have been
                  * done in `eval_expr_lval` which will refuse to evalate
                  * non-lval eligible expressions so we should be fine
                  * just updating here. */
                 *lref = rref;
+                mm_write_barrier(owner, rref);
+
+                remove_temporary_global(tglob_idx);
                 break;
             }
 
@@ -815,7 +1432,7 @@ EvaluationResult eval_del(NodeStmtDel *node) {
             error("unexpected pair");
 
         case EXPR_IDENTIFIER:
-            delete_global_variable(((NodeExprIdentifier *) node->arg)->name);
+            delete_global_slot(((NodeExprIdentifier *) node->arg)->slot);
             break;
 
         case EXPR_BUILTIN:
@@ -827,22 +1444,12 @@ EvaluationResult eval_del(NodeStmtDel *node) {
         case EXPR_SUBSCRIPT: {
             NodeExprSubscript *subscript = (NodeExprSubscript *) node->arg;
             Reference keyref = eval_expr(subscript->index);
-            Reference objref = *eval_expr_lval(subscript->obj, false);
-            Value *objv = deref(objref);
-
-            switch (objv->type) {
-                case VAL_LIST_NODE:
-                    list_delete_elem(objref, coerce_ref_to_int(keyref));
-                    break;
+            size_t tglob_idx = add_temporary_global(keyref);
 
-                case VAL_DICT_NODE:
-                    dict_delete_entry(objref, keyref);
-                    break;
+            Reference objref = *eval_expr_lval(subscript->obj, false, NULL);
+            ref_delete_subscript(objref, keyref);
 
-                default:
-                    error("'%s' does not support item deletion",
-                            get_typestr(objref));
-            }
+            remove_temporary_global(tglob_idx);
             break;
         }
 
@@ -855,21 +1462,13 @@ EvaluationResult eval_del(NodeStmtDel *node) {
     };
 }
 
-/* Here are many definitions for builtin functions that implement
- * basic operations like `not` or `+`. Unfortunately, because these operations
- * are all slightly different, there is alot of duplicated code here. :( */
-
-static Reference eval_builtin_negate(Node *l, Node *r) {
-    (void) r;
-
-    Reference lref = eval_expr(l);
-    Value *lv = deref(lref);
-
-    switch (lv->type) {
+static Reference ref_negate(Reference lref) {
+    switch (ref_type(lref)) {
         case VAL_FLOAT:
-            return make_reference_float(-((FloatValue *) lv)->float_value);
+            return make_reference_float(
+                    -((FloatValue *) deref(lref))->float_value);
         case VAL_INTEGER:
-            return make_reference_int(-((IntegerValue *) lv)->integer_value);
+            return make_reference_int(-(long int) int_value(lref));
 
         default:
             error("unsupported operand type(s) for unary -: '%s'",
@@ -877,13 +1476,8 @@ static Reference eval_builtin_negate(Node *l, Node *r) {
     }
 }
 
-static Reference eval_builtin_identity(Node *l, Node *r) {
-    (void) r;
-
-    Reference lref = eval_expr(l);
-    Value *lv = deref(lref);
-
-    switch (lv->type) {
+static Reference ref_identity(Reference lref) {
+    switch (ref_type(lref)) {
         case VAL_FLOAT:
         case VAL_INTEGER:
             return lref;
@@ -894,44 +1488,11 @@ static Reference eval_builtin_identity(Node *l, Node *r) {
     }
 }
 
-static Reference eval_builtin_not(Node *l, Node *r) {
-    (void) r;
-
-    return get_bool_ref(!coerce_ref_to_bool(eval_expr(l)));
-}
-
-static Reference eval_builtin_eq(Node *l, Node *r) {
-    return eval_generic_comp_nodes(COMP_EQUALS, l, r);
-}
-static Reference eval_builtin_lt(Node *l, Node *r) {
-    return eval_generic_comp_nodes(COMP_LT, l, r);
-}
-static Reference eval_builtin_gt(Node *l, Node *r) {
-    return eval_generic_comp_nodes(COMP_GT, l, r);
-}
-static Reference eval_builtin_le(Node *l, Node *r) {
-    return eval_generic_comp_nodes(COMP_LE, l, r);
-}
-static Reference eval_builtin_ge(Node *l, Node *r) {
-    return eval_generic_comp_nodes(COMP_GE, l, r);
-}
-
-
-static Reference eval_builtin_or(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    return coerce_ref_to_bool(lref) ? lref : eval_expr(r);
-}
-
-static Reference eval_builtin_and(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    return coerce_ref_to_bool(lref) ? eval_expr(r) : lref;
-}
-
-static Reference eval_builtin_add(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    size_t tglob_idx = add_temporary_global(lref);
+/* The binary operators below expect the left operand to be rooted, so that
+ * it survives any allocation; they are shared by the tree-walker and the
+ * bytecode VM. */
 
-    Reference rref = eval_expr(r);
+static Reference ref_add(Reference lref, Reference rref) {
     Promotion promo = get_promotion(lref, rref);
     Reference result;
 
@@ -947,21 +1508,20 @@ static Reference eval_builtin_add(Node *l, Node *r) {
             break;
 
         default: {
-            Value *lv = deref(lref);
-            Value *rv = deref(rref);
+            ValueType ltype = ref_type(lref);
 
-            if (lv->type == rv->type) {
-                switch (lv->type) {
+            if (ltype == ref_type(rref)) {
+                switch (ltype) {
                     case VAL_STRING: {
-                        size_t tglob_idx2 = add_temporary_global(rref);
+                        size_t tglob_idx = add_temporary_global(rref);
                         result = make_reference_string_concat(lref, rref);
-                        remove_temporary_global(tglob_idx2);
+                        remove_temporary_global(tglob_idx);
 
                         break;
                      }
 
-                    /* case VAL_LIST_NODE: */
-                    /* case VAL_DICT_NODE: */
+                    /* case VAL_LIST: */
+                    /* case VAL_DICT: */
 
                     default:
                         eval_generic_error(OP_ADD, lref, rref);
@@ -972,143 +1532,177 @@ static Reference eval_builtin_add(Node *l, Node *r) {
         }
     }
 
-    remove_temporary_global(tglob_idx);
     return result;
 }
 
-static Reference eval_builtin_subtract(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    size_t tglob_idx = add_temporary_global(lref);
-
-    Reference rref = eval_expr(r);
-    Promotion promo = get_promotion(lref, rref);
-    Reference result;
-
-    switch (promo) {
+static Reference ref_subtract(Reference lref, Reference rref) {
+    switch (get_promotion(lref, rref)) {
         case TO_FLOAT:
-            result = make_reference_float(coerce_ref_to_float(lref) -
-                                          coerce_ref_to_float(rref));
-            break;
+            return make_reference_float(coerce_ref_to_float(lref) -
+                                        coerce_ref_to_float(rref));
 
         case TO_INTEGER:
-            result = make_reference_int(coerce_ref_to_int(lref) -
-                                        coerce_ref_to_int(rref));
-            break;
+            return make_reference_int(coerce_ref_to_int(lref) -
+                                      coerce_ref_to_int(rref));
 
         default:
             eval_generic_error(OP_SUBTRACT, lref, rref);
     }
-
-    remove_temporary_global(tglob_idx);
-    return result;
 }
 
-static Reference eval_builtin_multiply(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    size_t tglob_idx = add_temporary_global(lref);
-
-    Reference rref = eval_expr(r);
-    Promotion promo = get_promotion(lref, rref);
-    Reference result;
-
-    switch (promo) {
+static Reference ref_multiply(Reference lref, Reference rref) {
+    switch (get_promotion(lref, rref)) {
         case TO_FLOAT:
-            result = make_reference_float(coerce_ref_to_float(lref) *
-                                          coerce_ref_to_float(rref));
-            break;
+            return make_reference_float(coerce_ref_to_float(lref) *
+                                        coerce_ref_to_float(rref));
 
         case TO_INTEGER:
-            result = make_reference_int(coerce_ref_to_int(lref) *
-                                        coerce_ref_to_int(rref));
-            break;
+            return make_reference_int(coerce_ref_to_int(lref) *
+                                      coerce_ref_to_int(rref));
 
         default:
             eval_generic_error(OP_MULTIPLY, lref, rref);
     }
-
-    remove_temporary_global(tglob_idx);
-    return result;
 }
 
-static Reference eval_builtin_divide(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    size_t tglob_idx = add_temporary_global(lref);
-
-    Reference rref = eval_expr(r);
-    Promotion promo = get_promotion(lref, rref);
-    Reference result;
-
-    switch (promo) {
+static Reference ref_divide(Reference lref, Reference rref) {
+    switch (get_promotion(lref, rref)) {
         case TO_FLOAT:
         case TO_INTEGER:
-            result = make_reference_float(coerce_ref_to_float(lref) /
-                                          coerce_ref_to_float(rref));
-            break;
+            return make_reference_float(coerce_ref_to_float(lref) /
+                                        coerce_ref_to_float(rref));
 
         default:
             eval_generic_error(OP_DIVIDE, lref, rref);
     }
-
-    remove_temporary_global(tglob_idx);
-    return result;
 }
 
-static Reference eval_builtin_modulo(Node *l, Node *r) {
-    Reference lref = eval_expr(l);
-    size_t tglob_idx = add_temporary_global(lref);
-
-    Reference rref = eval_expr(r);
-    Promotion promo = get_promotion(lref, rref);
-    Reference result;
-
-    switch (promo) {
+static Reference ref_modulo(Reference lref, Reference rref) {
+    switch (get_promotion(lref, rref)) {
         case TO_FLOAT:
-            result = make_reference_float(
+            return make_reference_float(
                     fmod(coerce_ref_to_float(lref),
                          coerce_ref_to_float(rref)));
-            break;
 
         case TO_INTEGER:
-            result = make_reference_int(coerce_ref_to_int(lref) %
-                                        coerce_ref_to_int(rref));
-            break;
+            return make_reference_int(coerce_ref_to_int(lref) %
+                                      coerce_ref_to_int(rref));
 
         default:
             eval_generic_error(OP_MODULO, lref, rref);
     }
+}
+
+/*!
+ * Evaluates both sides of a binary operator and applies it, keeping the
+ * left hand side alive while the right hand side is evaluated.
+ */
+static Reference eval_binary_nodes(Reference (*op)(Reference, Reference),
+                                   Node *l, Node *r) {
+    Reference lref = eval_expr(l);
+    size_t tglob_idx = add_temporary_global(lref);
+
+    Reference result = op(lref, eval_expr(r));
 
     remove_temporary_global(tglob_idx);
     return result;
 }
 
-typedef Reference (*builtin_op)(Node *, Node *);
-static const builtin_op builtins[N_BUILTINS] = {
-    eval_builtin_negate,   /* UOP_NEGATE */
-    eval_builtin_identity, /* UOP_IDENTITY */
-    eval_builtin_not,      /* UOP_NOT */
+/* Here are many definitions for builtin functions that implement
+ * basic operations like `not` or `+`, in terms of the operators above. */
 
-    eval_builtin_eq,       /* COMP_EQUALS */
-    eval_builtin_lt,       /* COMP_LT */
-    eval_builtin_gt,       /* COMP_GT */
-    eval_builtin_le,       /* COMP_LE */
-    eval_builtin_ge,       /* COMP_GE */
+static Reference eval_builtin_negate(Node *l, Node *r) {
+    (void) r;
 
-    eval_builtin_or,       /* OP_OR */
-    eval_builtin_and,      /* OP_AND */
+    return ref_negate(eval_expr(l));
+}
 
-    eval_builtin_add,      /* OP_ADD */
-    eval_builtin_subtract, /* OP_SUBTRACT */
-    eval_builtin_multiply, /* OP_MULTIPLY */
-    eval_builtin_divide,   /* OP_DIVIDE */
-    eval_builtin_modulo    /* OP_MODULO */
-};
+static Reference eval_builtin_identity(Node *l, Node *r) {
+    (void) r;
 
-Reference eval_expr_builtin(NodeExprBuiltin *node) {
-    return builtins[node->builtin_type](node->left, node->right);
+    return ref_identity(eval_expr(l));
 }
 
+static Reference eval_builtin_not(Node *l, Node *r) {
+    (void) r;
+
+    return get_bool_ref(!coerce_ref_to_bool(eval_expr(l)));
+}
+
+static Reference eval_builtin_eq(Node *l, Node *r) {
+    return eval_generic_comp_nodes(COMP_EQUALS, l, r);
+}
+static Reference eval_builtin_lt(Node *l, Node *r) {
+    return eval_generic_comp_nodes(COMP_LT, l, r);
+}
+static Reference eval_builtin_gt(Node *l, Node *r) {
+    return eval_generic_comp_nodes(COMP_GT, l, r);
+}
+static Reference eval_builtin_le(Node *l, Node *r) {
+    return eval_generic_comp_nodes(COMP_LE, l, r);
+}
+static Reference eval_builtin_ge(Node *l, Node *r) {
+    return eval_generic_comp_nodes(COMP_GE, l, r);
+}
+
+
+static Reference eval_builtin_or(Node *l, Node *r) {
+    Reference lref = eval_expr(l);
+    return coerce_ref_to_bool(lref) ? lref : eval_expr(r);
+}
+
+static Reference eval_builtin_and(Node *l, Node *r) {
+    Reference lref = eval_expr(l);
+    return coerce_ref_to_bool(lref) ? eval_expr(r) : lref;
+}
+
+static Reference eval_builtin_add(Node *l, Node *r) {
+    return eval_binary_nodes(ref_add, l, r);
+}
+static Reference eval_builtin_subtract(Node *l, Node *r) {
+    return eval_binary_nodes(ref_subtract, l, r);
+}
+static Reference eval_builtin_multiply(Node *l, Node *r) {
+    return eval_binary_nodes(ref_multiply, l, r);
+}
+static Reference eval_builtin_divide(Node *l, Node *r) {
+    return eval_binary_nodes(ref_divide, l, r);
+}
+static Reference eval_builtin_modulo(Node *l, Node *r) {
+    return eval_binary_nodes(ref_modulo, l, r);
+}
+
+typedef Reference (*builtin_op)(Node *, Node *);
+static const builtin_op builtins[N_BUILTINS] = {
+    eval_builtin_negate,   /* UOP_NEGATE */
+    eval_builtin_identity, /* UOP_IDENTITY */
+    eval_builtin_not,      /* UOP_NOT */
+
+    eval_builtin_eq,       /* COMP_EQUALS */
+    eval_builtin_lt,       /* COMP_LT */
+    eval_builtin_gt,       /* COMP_GT */
+    eval_builtin_le,       /* COMP_LE */
+    eval_builtin_ge,       /* COMP_GE */
+
+    eval_builtin_or,       /* OP_OR */
+    eval_builtin_and,      /* OP_AND */
+
+    eval_builtin_add,      /* OP_ADD */
+    eval_builtin_subtract, /* OP_SUBTRACT */
+    eval_builtin_multiply, /* OP_MULTIPLY */
+    eval_builtin_divide,   /* OP_DIVIDE */
+    eval_builtin_modulo    /* OP_MODULO */
+};
+
+Reference eval_expr_builtin(NodeExprBuiltin *node) {
+    if (node->value != NULL_REF) {
+        return node->value;
+    }
+    return builtins[node->builtin_type](node->left, node->right);
+}
 
-static Reference eval_builtin_exit(size_t arity, NodeList *args) {
+
+static Reference eval_builtin_exit(size_t arity, const Reference *args) {
     if (arity > 1) {
         error("exit() takes from 0 to 1 positional arguments "
                     "but %d were given", arity);
@@ -1116,11 +1710,10 @@ static Reference eval_builtin_exit(size_t arity, NodeList *args) {
 
     int code = 0;
     if (arity == 1) {
-        Reference coderef = args->head->reference;
-        Value *codeval = deref(coderef);
+        Reference coderef = args[0];
 
-        if (codeval->type == VAL_INTEGER) {
-            code = ((IntegerValue *) codeval)->integer_value;
+        if (ref_type(coderef) == VAL_INTEGER) {
+            code = int_value(coderef);
         } else {
             ref_println(stdout, coderef);
         }
@@ -1129,7 +1722,7 @@ static Reference eval_builtin_exit(size_t arity, NodeList *args) {
     exit(code);
 }
 
-static Reference eval_builtin_mem(size_t arity, NodeList *args) {
+static Reference eval_builtin_mem(size_t arity, const Reference *args) {
     (void) args;
 
     if (arity > 0) {
@@ -1141,7 +1734,7 @@ static Reference eval_builtin_mem(size_t arity, NodeList *args) {
     return NONE_REF;
 }
 
-static Reference eval_builtin_gc(size_t arity, NodeList *args) {
+static Reference eval_builtin_gc(size_t arity, const Reference *args) {
     (void) args;
 
     if (arity > 0) {
@@ -1153,36 +1746,64 @@ static Reference eval_builtin_gc(size_t arity, NodeList *args) {
     return NONE_REF;
 }
 
-static Reference eval_builtin_print(size_t arity, NodeList *args) {
+static Reference eval_builtin_gcstats(size_t arity, const Reference *args) {
+    (void) args;
+
     if (arity > 0) {
-        ref_print(stdout, args->head->reference);
-        for (NodeListEntry *entry = args->head->next;
-                entry; entry = entry->next) {
-            fprintf(stdout, " ");
-            ref_print(stdout, entry->reference);
+        error("gcstats() takes 0 positional arguments but %d were given",
+                arity);
+    }
+
+    mm_print_stats(stdout);
+
+    return NONE_REF;
+}
+
+static Reference eval_builtin_append(size_t arity, const Reference *args) {
+    if (arity != 2) {
+        error("append() takes 2 positional arguments but %d were given",
+                arity);
+    }
+
+    Reference list = args[0];
+    if (ref_type(list) != VAL_LIST) {
+        error("cannot append to '%s'", get_typestr(list));
+    }
+
+    list_append(list, args[1]);
+
+    return NONE_REF;
+}
+
+static Reference eval_builtin_print(size_t arity, const Reference *args) {
+    /* The whole line is formatted, and then written in one go. */
+    for (size_t i = 0; i < arity; i++) {
+        if (i > 0) {
+            out_append(" ", 1);
         }
+        format_value(stdout, args[i], MAX_DEPTH);
     }
 
-    fprintf(stdout, "\n");
+    out_append("\n", 1);
+    out_flush(stdout);
 
     return NONE_REF;
 }
 
-static Reference eval_builtin_len(size_t arity, NodeList *args) {
+static Reference eval_builtin_len(size_t arity, const Reference *args) {
     if (arity != 1) {
         error("len() takes 1 positional argument but %d were given", arity);
     }
 
-    Reference r = args->head->reference;
-    Value *v = deref(args->head->reference);
-    switch (v->type) {
+    Reference r = args[0];
+    switch (ref_type(r)) {
         case VAL_STRING:
-            return make_reference_int(v->data_size);
+            return make_reference_int(string_length(r));
 
-        case VAL_LIST_NODE:
+        case VAL_LIST:
             return make_reference_int(list_get_length(r));
 
-        case VAL_DICT_NODE:
+        case VAL_DICT:
             return make_reference_int(dict_get_length(r));
 
         default:
@@ -1190,66 +1811,74 @@ static Reference eval_builtin_len(size_t arity, NodeList *args) {
     }
 }
 
-Reference eval_expr_call(NodeExprCall *node) {
-    // TODO: If a gc() is called during a function evaluation, then the
-    // references to the function arguments will not be considered globals!
-    // This means that the function arguments stored in the NodeList
-    // will end up dangling, which is not desirable.
-
-    /* Compute function arity and arguments. */
-    size_t arity = 0;
-    if (node->args) {
-        for (NodeListEntry *entry = node->args->head;
-                entry; entry = entry->next, arity++) {
-            entry->reference = eval_expr(entry->node);
-            entry->idx = add_temporary_global(entry->reference);
-        }
-    }
+typedef Reference (*builtin_func)(size_t arity, const Reference *args);
 
-    if (node->func->type != EXPR_IDENTIFIER) {
-        error("calling non-identifiers not yet supported");
-    }
+/*! The builtin functions that can be called, by name. */
+static const struct BuiltinFunction {
+    const char *name;
+    builtin_func func;
+} builtin_functions[] = {
+    { "exit",    eval_builtin_exit },
+    { "quit",    eval_builtin_exit },
+    { "mem",     eval_builtin_mem },
+    { "gc",      eval_builtin_gc },
+    { "gcstats", eval_builtin_gcstats },
+    { "print",   eval_builtin_print },
+    { "len",     eval_builtin_len },
+    { "append",  eval_builtin_append }
+};
 
-    const char *name = ((NodeExprIdentifier *) node->func)->name;
-    Reference result;
+#define NUM_BUILTIN_FUNCTIONS \
+    ((int) (sizeof(builtin_functions) / sizeof(builtin_functions[0])))
 
-    if (strcmp(name, "exit") == 0 || strcmp(name, "quit") == 0) {
-        result = eval_builtin_exit(arity, node->args);
-    } else if (strcmp(name, "mem") == 0) {
-        result = eval_builtin_mem(arity, node->args);
-    } else if (strcmp(name, "gc") == 0) {
-        result = eval_builtin_gc(arity, node->args);
-    } else if (strcmp(name, "print") == 0) {
-        result = eval_builtin_print(arity, node->args);
-    } else if (strcmp(name, "len") == 0) {
-        result = eval_builtin_len(arity, node->args);
-    } else {
-        error("calling user-defined functions not yet supported");
+/*! Returns the index of a builtin function in builtin_functions, or -1. */
+static int find_builtin_function(const char *name) {
+    for (int i = 0; i < NUM_BUILTIN_FUNCTIONS; i++) {
+        if (strcmp(name, builtin_functions[i].name) == 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    /* Cleanup */
+Reference eval_expr_call(NodeExprCall *node) {
+    /* Compute function arity and arguments.  Each argument is kept alive
+     * on the root stack until the call returns; they are pushed one after
+     * another, so they are popped off it together afterwards. */
+    size_t arity = node->args ? ast_nodelist_length(node->args) : 0;
+    Reference args[arity ? arity : 1];
+    size_t first_root = num_roots;
+
+    size_t i = 0;
     if (node->args) {
         for (NodeListEntry *entry = node->args->head;
-                entry; entry = entry->next, arity++) {
-            remove_temporary_global(entry->idx);
+                entry; entry = entry->next, i++) {
+            args[i] = eval_expr(entry->node);
+            add_temporary_global(args[i]);
         }
     }
 
-    return result;
-}
-
-Reference eval_expr_subscript(NodeExprSubscript *node) {
-    Reference idxref = eval_expr(node->index);
+    /* The function was looked up by `resolve_names`; -1 means it is not a
+     * builtin, so this works out which error to report. */
+    if (node->builtin < 0) {
+        if (node->func->type != EXPR_IDENTIFIER) {
+            error("calling non-identifiers not yet supported");
+        }
+        error("calling user-defined functions not yet supported");
+    }
 
-    size_t tglob_idx = add_temporary_global(idxref);
+    Reference result = builtin_functions[node->builtin].func(arity, args);
 
-    Reference objref = eval_expr(node->obj);
-    Reference result;
+    remove_temporary_globals_from(first_root);
+    return result;
+}
 
-    Value *objv = deref(objref);
-    switch (objv->type) {
+/*! Returns objref[idxref].  Both are expected to be rooted. */
+static Reference ref_subscript(Reference objref, Reference idxref) {
+    switch (ref_type(objref)) {
         case VAL_STRING: {
-            const char *str = ((StringValue *) objv)->string_value;
+            string_flatten(objref);
+            const char *str = deref_to_string_value(objref)->string_value;
 
             long int len = strlen(str);
             long int idx = coerce_ref_to_int(idxref);
@@ -1263,68 +1892,108 @@ Reference eval_expr_subscript(NodeExprSubscript *node) {
             }
 
             char buf[2] = { str[actual], 0 };
-            result = make_reference_string(buf);
-            break;
+            return make_reference_string(buf);
         }
 
-        case VAL_LIST_NODE:
-            result = list_get_elem(objref,
-                            coerce_ref_to_int(idxref))->list_node.value;
+        case VAL_LIST:
+            return *list_get_elem(objref, coerce_ref_to_int(idxref), NULL);
+
+        case VAL_DICT:
+            return *dict_get_entry(objref, idxref, false, NULL);
+
+        default:
+            error("'%s' object is not subscriptable", get_typestr(objref));
+    }
+}
+
+/*!
+ * Returns a pointer to the Reference objref[keyref] for assigning to, and
+ * sets owner to objref's container Value.  Dict entries are created if
+ * `create` is true.  Both objref and keyref are expected to be rooted.
+ */
+static Reference *ref_subscript_lval(Reference objref, Reference keyref,
+                                     bool create, Reference *owner) {
+    switch (ref_type(objref)) {
+        case VAL_LIST:
+            return list_get_elem(objref, coerce_ref_to_int(keyref), owner);
+
+        case VAL_DICT:
+            /* Find entry with key or, if applicable, create it. */
+            return dict_get_entry(objref, keyref, create, owner);
+
+        default:
+            error("'%s' does not support item assignment",
+                    get_typestr(objref));
+    }
+}
+
+/*! Deletes objref[keyref].  Both are expected to be rooted. */
+static void ref_delete_subscript(Reference objref, Reference keyref) {
+    switch (ref_type(objref)) {
+        case VAL_LIST:
+            list_delete_elem(objref, coerce_ref_to_int(keyref));
             break;
 
-        case VAL_DICT_NODE:
-            result = dict_get_entry(objref, idxref, false)->dict_node.value;
+        case VAL_DICT:
+            dict_delete_entry(objref, keyref);
             break;
 
         default:
-            error("'%s' object is not subscriptable", get_typestr(objref));
+            error("'%s' does not support item deletion",
+                    get_typestr(objref));
     }
+}
 
-    remove_temporary_global(tglob_idx);
+Reference eval_expr_subscript(NodeExprSubscript *node) {
+    Reference idxref = eval_expr(node->index);
+
+    size_t tglob_idx = add_temporary_global(idxref);
+
+    /* Hashing or indexing a rope flattens it, which allocates, so the object
+     * has to be kept alive too. */
+    Reference objref = eval_expr(node->obj);
+    add_temporary_global(objref);
+
+    Reference result = ref_subscript(objref, idxref);
+
+    remove_temporary_globals_from(tglob_idx);
     return result;
 }
 
 static bool is_hashable(ValueType type) {
-    return type != VAL_LIST_NODE && type != VAL_DICT_NODE;
+    return type != VAL_LIST && type != VAL_DICT;
 }
 
 Reference eval_expr(Node *node) {
     switch (node->type) {
         case EXPR_LITERAL_STRING:
-            return make_reference_string(
-                        ((NodeExprLiteralString *) node)->value);
-
         case EXPR_LITERAL_INTEGER:
-            return make_reference_int(
-                        ((NodeExprLiteralInteger *) node)->value);
-
         case EXPR_LITERAL_FLOAT:
-            return make_reference_float(
-                        ((NodeExprLiteralFloat *) node)->value);
+            return constant_value(node);
 
         case EXPR_LITERAL_LIST: {
-            /* Lists start with a dummy element so we construct this first. */
-            Reference list = make_reference_list_node(NULL_REF);
+            NodeList *exprs = ((NodeExprLiteralList *) node)->values;
+
+            /* Make the list big enough for all of its elements up front. */
+            long int length = 0;
+            if (exprs) {
+                for (NodeListEntry *entry = exprs->head; entry;
+                        entry = entry->next) {
+                    length++;
+                }
+            }
+            Reference list = make_reference_list(length);
 
             /* Add the list to the set of temporary globals so that it
              * does not end up getting garbage collected. */
             size_t tglob_idx = add_temporary_global(list);
 
-            NodeList *exprs = ((NodeExprLiteralList *) node)->values;
             if (exprs) {
                 /* Now iterate through the expression list and construct
                  * the list. */
-                Reference tail = list;
                 for (NodeListEntry *entry = exprs->head; entry;
                         entry = entry->next) {
-
-                    Reference next = make_reference_list_node(NONE_REF);
-                    deref_to_list_value(tail)->list_node.next = next;
-
-                    Reference elem = eval_expr(entry->node);
-                    deref_to_list_value(next)->list_node.value = elem;
-
-                    tail = next;
+                    list_append(list, eval_expr(entry->node));
                 }
             }
 
@@ -1337,18 +2006,26 @@ Reference eval_expr(Node *node) {
         case EXPR_LITERAL_DICT: {
              /* Similar to list code. Almost identical, but s/List/Dict, and
               * there are both keys and values... */
-            Reference dict = make_reference_dict_node(NULL_REF, NULL_REF);
+            NodeList *exprs = ((NodeExprLiteralDict *) node)->values;
+
+            /* Make the table big enough for all of the pairs up front. */
+            long int length = 0;
+            if (exprs) {
+                for (NodeListEntry *entry = exprs->head; entry;
+                        entry = entry->next) {
+                    length++;
+                }
+            }
+            Reference dict = make_reference_dict(length);
 
             /* Add the dict to the set of temporary globals so that it
              * does not end up getting garbage collected. */
             size_t tglob_idx = add_temporary_global(dict);
 
-            NodeList *exprs = ((NodeExprLiteralDict *) node)->values;
             if (exprs) {
                 /* Now iterate through the expression list and construct
                  * the dict. Each element of the list should be a
                  * NodeExprLiteralPair. */
-                Reference tail = dict;
                 for (NodeListEntry *entry = exprs->head; entry;
                         entry = entry->next) {
 
@@ -1359,20 +2036,19 @@ Reference eval_expr(Node *node) {
                     NodeExprLiteralPair *pair =
                         (NodeExprLiteralPair *) entry->node;
 
-                    Reference next = make_reference_dict_node(NONE_REF, NONE_REF);
-                    deref_to_dict_value(tail)->dict_node.next = next;
-
                     Reference valueref = eval_expr(pair->value);
+                    size_t value_idx = add_temporary_global(valueref);
+
                     Reference keyref = eval_expr(pair->key);
-                    if (!is_hashable(deref(keyref)->type)) {
+                    if (!is_hashable(ref_type(keyref))) {
                         error("dictionary keys must be hashable");
                     }
 
-                    DictValue *elem = deref_to_dict_value(next);
-                    elem->dict_node.key = keyref;
-                    elem->dict_node.value = valueref;
+                    Reference owner;
+                    *dict_get_entry(dict, keyref, true, &owner) = valueref;
+                    mm_write_barrier(owner, valueref);
 
-                    tail = next;
+                    remove_temporary_global(value_idx);
                 }
             }
 
@@ -1395,8 +2071,7 @@ Reference eval_expr(Node *node) {
             error("unexpected pair");
 
         case EXPR_IDENTIFIER:
-            return *get_global_variable(
-                        ((NodeExprIdentifier *) node)->name, false);
+            return *get_global_slot(((NodeExprIdentifier *) node)->slot, false);
 
         case EXPR_BUILTIN:
             return eval_expr_builtin((NodeExprBuiltin *) node);
@@ -1416,8 +2091,11 @@ Reference eval_expr(Node *node) {
  * Evaluates an expression that can be the target of an assignment.  This is why
  * the method returns a pointer to a Reference - so that we can change the
  * Reference itself to refer to something else.
+ *
+ * If owner is not NULL, it is set to the Value holding the returned Reference
+ * (NULL_REF for a global), so the caller can run the write barrier.
  */
-Reference *eval_expr_lval(Node *node, bool create) {
+Reference *eval_expr_lval(Node *node, bool create, Reference *owner) {
     switch (node->type) {
         case EXPR_LITERAL_STRING:
         case EXPR_LITERAL_INTEGER:
@@ -1433,8 +2111,10 @@ Reference *eval_expr_lval(Node *node, bool create) {
             error("unexpected pair");
 
         case EXPR_IDENTIFIER:
-            return get_global_variable(
-                        ((NodeExprIdentifier *) node)->name, create);
+            if (owner != NULL) {
+                *owner = NULL_REF;
+            }
+            return get_global_slot(((NodeExprIdentifier *) node)->slot, create);
 
         case EXPR_BUILTIN:
             error("cannot assign to result of expression");
@@ -1448,33 +2128,16 @@ Reference *eval_expr_lval(Node *node, bool create) {
 
             size_t tglob_idx = add_temporary_global(keyref);
 
-            Reference objref = *eval_expr_lval(subscript->obj, false);
-            Value *objv = deref(objref);
-            Reference *result;
-
-            switch (objv->type) {
-                case VAL_LIST_NODE: {
-                    ListValue *elem = list_get_elem(objref,
-                            coerce_ref_to_int(keyref));
-                    result = &(elem->list_node.value);
-                    break;
-                }
-
-                case VAL_DICT_NODE: {
-                    /* Find entry with key or, if applicable, create it. */
-                    DictValue *lhs_dict = dict_get_entry(objref,
-                            keyref, create);
-                    result = &(lhs_dict->dict_node.value);
-                    break;
-                }
-
-                default:
-                    error("'%s' does not support item assignment",
-                            get_typestr(objref));
-            }
+            Reference objref = *eval_expr_lval(subscript->obj, false, NULL);
+            Reference result_owner;
+            Reference *result = ref_subscript_lval(objref, keyref, create,
+                                                   &result_owner);
 
             remove_temporary_global(tglob_idx);
 
+            if (owner != NULL) {
+                *owner = result_owner;
+            }
             return result;
         }
 
@@ -1484,156 +2147,1461 @@ Reference *eval_expr_lval(Node *node, bool create) {
 }
 
 
-//// GLOBAL VAR FUNCTIONS ////
+//// CONSTANT FOLDING ////
 
-/*! Adds a new global variable with the provided name. */
-Reference *add_global_variable(const char *name, Reference value) {
-    if (global_vars == NULL) {
-        /* If our global vars array is NULL, let's make a new one. */
-        global_vars = calloc(sizeof(struct GlobalVariable), INITIAL_SIZE);
-        max_vars = INITIAL_SIZE;
-    } else if (num_vars == max_vars) {
-        /* Otherwise, double its size (the JVM internal source said this
-         * was a good resizing semantic, don't sue me!), and zero it out. */
-        max_vars *= 2;
-        global_vars = realloc(global_vars,
-                              sizeof(struct GlobalVariable) * max_vars);
-        // Zero so our loop searching for a new spot doesn't fail.
-        memset(global_vars + num_vars, 0,
-               sizeof(struct GlobalVariable) * num_vars);
-    }
 
-    if (global_vars == NULL) {
-        error("%s", "Allocation failed!");
+/*! Keeps the value of a literal or folded constant alive, and returns it. */
+static Reference add_literal(Reference value) {
+    if (!is_heap_ref(value)) {
+        return value;
     }
 
-    /* Search for a new variable. */
-    for (int i = 0; i < max_vars; i++) {
-        if (global_vars[i].name == NULL) {
-            num_vars++;
-            global_vars[i].name = strndup(name, strlen(name));
-            global_vars[i].ref = value;
-            return &global_vars[i].ref;
+    if (num_literals == max_literals) {
+        max_literals = max_literals ? max_literals * 2 : INITIAL_SIZE;
+        literals = realloc(literals, sizeof(Reference) * max_literals);
+        if (literals == NULL) {
+            error("%s", "Allocation failed!");
         }
     }
 
-    /* We made space for at least 1 new var up there,
-     * so this can't happen..! I swear! */
-    UNREACHABLE();
+    literals[num_literals++] = value;
+    return value;
 }
 
-/*! Tries to retrieve a global variable's reference, creating it if `create`
-    is true. */
-Reference *get_global_variable(const char *name, bool create) {
-    for (int i = 0; i < num_vars; i++) {
-        if (global_vars[i].name != NULL &&
-                strcmp(name, global_vars[i].name) == 0) {
-            return &global_vars[i].ref;
+/*!
+ * Returns the value of a node if it is a constant, or NULL_REF if it is
+ * not.  Literals are given their value the first time they are asked for.
+ * Lists and dicts are never constant, since they can be changed.
+ */
+static Reference constant_value(Node *node) {
+    switch (node->type) {
+        case EXPR_LITERAL_STRING: {
+            NodeExprLiteralString *lit = (NodeExprLiteralString *) node;
+            if (lit->ref == NULL_REF) {
+                lit->ref = add_literal(make_reference_string(lit->value));
+            }
+            return lit->ref;
         }
-    }
 
-    if (create) {
-        return add_global_variable(name, NULL_REF);
-    } else {
-        error("name '%s' is not defined", name);
+        case EXPR_LITERAL_INTEGER: {
+            NodeExprLiteralInteger *lit = (NodeExprLiteralInteger *) node;
+            if (lit->ref == NULL_REF) {
+                lit->ref = add_literal(make_reference_int(lit->value));
+            }
+            return lit->ref;
+        }
+
+        case EXPR_LITERAL_FLOAT: {
+            NodeExprLiteralFloat *lit = (NodeExprLiteralFloat *) node;
+            if (lit->ref == NULL_REF) {
+                lit->ref = add_literal(make_reference_float(lit->value));
+            }
+            return lit->ref;
+        }
+
+        case EXPR_LITERAL_SINGLETON:
+            switch (((NodeExprLiteralSingleton *) node)->singleton) {
+                case S_NONE:  return NONE_REF;
+                case S_TRUE:  return TRUE_REF;
+                case S_FALSE: return FALSE_REF;
+            }
+            return NULL_REF;
+
+        case EXPR_BUILTIN:
+            return ((NodeExprBuiltin *) node)->value;
+
+        default:
+            return NULL_REF;
     }
 }
 
-/*! Delete the global variable with name `name`. Error if no such variable
-    exists. */
-void delete_global_variable(const char *name) {
-    int i;
-    for (i = 0; i < num_vars; i++) {
-        if (strcmp(name, global_vars[i].name) == 0) {
+/*!
+ * Works out the value of a builtin operator whose operands are constants,
+ * or returns NULL_REF if it should be left until run time.  Only the
+ * cases that cannot raise an error are folded, so that errors still happen
+ * after the same side effects; division by zero is left alone too.
+ */
+static Reference fold_builtin(NodeExprBuiltinType type,
+                              Reference l, Reference r) {
+    switch (type) {
+        case UOP_NOT:
+            return get_bool_ref(!coerce_ref_to_bool(l));
+
+        case UOP_NEGATE:
+            return is_numeric(l) ? ref_negate(l) : NULL_REF;
+
+        case UOP_IDENTITY:
+            return is_numeric(l) ? ref_identity(l) : NULL_REF;
+
+        default:
             break;
-        }
     }
 
-    if (i < num_vars) {
-        // Found the variable.  Remove it by sliding the whole array down.
-        free(global_vars[i].name);
+    bool numeric = is_numeric(l) && is_numeric(r);
+    bool strings = ref_type(l) == VAL_STRING && ref_type(r) == VAL_STRING;
 
-        // REVIEW:  Would be faster to do this with a memmove(), but whatever
-        for (int j = i; j < num_vars - 1; j++) {
-            global_vars[j].name = global_vars[j + 1].name;
-            global_vars[j].ref = global_vars[j + 1].ref;
-        }
+    switch (type) {
+        case COMP_EQUALS:
+        case COMP_LT:
+        case COMP_GT:
+        case COMP_LE:
+        case COMP_GE:
+            return numeric || strings ?
+                get_bool_ref(eval_generic_comp(type, l, r)) : NULL_REF;
 
-        num_vars--;
-        global_vars[num_vars].name = NULL;
-        global_vars[num_vars].ref = NULL_REF;
+        case OP_ADD:
+            return numeric || strings ? ref_add(l, r) : NULL_REF;
 
-        // TODO: resize array if too small. We'd need to compact it too.
-    } else {
-        error("Could not delete variable `%s`", name);
-    }
-}
+        case OP_SUBTRACT:
+            return numeric ? ref_subtract(l, r) : NULL_REF;
 
-/*! The current index of the next global variable. We assume that this will
- *  not overflow during the execution of this program. */
-static size_t tglob_next = 0;
+        case OP_MULTIPLY:
+            return numeric ? ref_multiply(l, r) : NULL_REF;
 
-/*!
- * Adds a new temporary global variable that cannot be referred to by the code
- * so that it is a root during execution. These temporary global variables
- * have the naming scheme `$t<id>`.
- *
- * All temporary globals are removed by `clear_temporary_globals` which is
- * called by `error` when an error occurs. */
-int add_temporary_global(Reference value) {
-    char buffer[32];
-    snprintf(buffer, 31, "$t%zu", tglob_next);
+        case OP_DIVIDE:
+            return numeric && coerce_ref_to_bool(r) ?
+                ref_divide(l, r) : NULL_REF;
 
-    add_global_variable(buffer, value);
-    return tglob_next++;
+        case OP_MODULO:
+            return numeric && coerce_ref_to_bool(r) ?
+                ref_modulo(l, r) : NULL_REF;
+
+        default:
+            return NULL_REF;
+    }
 }
 
+static void fold_constants(Node **node);
+
 /*!
- * Removes the specified temporary global value.
+ * Folds the target of an assignment or deletion.  An operator there is an
+ * error, which must be reported as one whatever its operands are, so it is
+ * left as it is.
  */
-void remove_temporary_global(size_t glob) {
-    char buffer[32];
-    snprintf(buffer, 31, "$t%zu", glob);
-
-    delete_global_variable(buffer);
+static void fold_target(Node **node) {
+    if ((*node)->type != EXPR_BUILTIN) {
+        fold_constants(node);
+    }
 }
 
 /*!
- * Removes all temporary global values found in the global variable list.
+ * Folds the builtin operators in a parse tree whose operands are constants
+ * into constants themselves, and gives every literal its value up front.
+ * The values are made afresh each time, since a cached tree can be run
+ * again after the values it was given last time have been collected.
+ * `or` and `and` with a constant left hand side are replaced by whichever
+ * side they would evaluate to, which is why this takes the place in the
+ * tree where the node is kept.
  */
-void clear_temporary_globals() {
-    int new_num_vars = 0;
-    for (int i = 0; i < num_vars; i++) {
-        const char *var_name = global_vars[i].name;
+static void fold_constants(Node **node) {
+    if (*node == NULL) {
+        return;
+    }
 
-        if (var_name[0] == '$' && var_name[1] == 't') {
-            free(global_vars[i].name);
-        } else {
-            if (i != new_num_vars) {
-                global_vars[new_num_vars].name = global_vars[i].name;
-                global_vars[new_num_vars].ref  = global_vars[i].ref;
+    switch ((*node)->type) {
+        case STMT_SEQUENCE:
+            for (NodeListEntry *entry =
+                    ((NodeStmtSequence *) *node)->statements->head;
+                    entry; entry = entry->next) {
+                fold_constants(&entry->node);
             }
-            new_num_vars++;
-        }
-    }
+            break;
 
-    memset(&global_vars[new_num_vars], 0,
-            sizeof(struct GlobalVariable) * (num_vars - new_num_vars));
-    num_vars = new_num_vars;
-}
+        case STMT_ASSIGN:
+            fold_target(&((NodeStmtAssign *) *node)->left);
+            fold_constants(&((NodeStmtAssign *) *node)->right);
+            break;
 
-/*!
- * Invokes a function for each global in the global environment.  Returns the
- * number of globals found.
- */
-int foreach_global(void (*f)(const char *name, Reference Ref)) {
+        case STMT_DEL:
+            fold_target(&((NodeStmtDel *) *node)->arg);
+            break;
 
-    /* Call the callback on each global. */
-    for (int i = 0; i < num_vars; i++) {
-        f(global_vars[i].name, global_vars[i].ref);
-    }
+        case STMT_IF:
+            fold_constants(&((NodeStmtIf *) *node)->cond);
+            fold_constants(&((NodeStmtIf *) *node)->left);
+            fold_constants(&((NodeStmtIf *) *node)->right);
+            break;
 
-    return num_vars;
+        case STMT_WHILE:
+            fold_constants(&((NodeStmtWhile *) *node)->cond);
+            fold_constants(&((NodeStmtWhile *) *node)->body);
+            break;
+
+        case EXPR_LITERAL_STRING:
+            ((NodeExprLiteralString *) *node)->ref = NULL_REF;
+            constant_value(*node);
+            break;
+
+        case EXPR_LITERAL_INTEGER:
+            ((NodeExprLiteralInteger *) *node)->ref = NULL_REF;
+            constant_value(*node);
+            break;
+
+        case EXPR_LITERAL_FLOAT:
+            ((NodeExprLiteralFloat *) *node)->ref = NULL_REF;
+            constant_value(*node);
+            break;
+
+        case EXPR_LITERAL_LIST:
+        case EXPR_LITERAL_DICT: {
+            NodeList *values = (*node)->type == EXPR_LITERAL_LIST ?
+                ((NodeExprLiteralList *) *node)->values :
+                ((NodeExprLiteralDict *) *node)->values;
+            if (values) {
+                for (NodeListEntry *entry = values->head;
+                        entry; entry = entry->next) {
+                    fold_constants(&entry->node);
+                }
+            }
+            break;
+        }
+
+        case EXPR_LITERAL_PAIR:
+            fold_constants(&((NodeExprLiteralPair *) *node)->key);
+            fold_constants(&((NodeExprLiteralPair *) *node)->value);
+            break;
+
+        case EXPR_BUILTIN: {
+            NodeExprBuiltin *builtin = (NodeExprBuiltin *) *node;
+            builtin->value = NULL_REF;
+            fold_constants(&builtin->left);
+            fold_constants(&builtin->right);
+
+            Reference l = constant_value(builtin->left);
+            if (l == NULL_REF) {
+                break;
+            }
+
+            if (builtin->builtin_type == OP_OR ||
+                    builtin->builtin_type == OP_AND) {
+                bool is_or = builtin->builtin_type == OP_OR;
+                *node = coerce_ref_to_bool(l) == is_or ?
+                    builtin->left : builtin->right;
+                break;
+            }
+
+            Reference r = NULL_REF;
+            if (!is_unary_builtin(builtin->builtin_type)) {
+                r = constant_value(builtin->right);
+                if (r == NULL_REF) {
+                    break;
+                }
+            }
+
+            builtin->value =
+                add_literal(fold_builtin(builtin->builtin_type, l, r));
+            break;
+        }
+
+        case EXPR_CALL: {
+            NodeList *args = ((NodeExprCall *) *node)->args;
+            if (args) {
+                for (NodeListEntry *entry = args->head;
+                        entry; entry = entry->next) {
+                    fold_constants(&entry->node);
+                }
+            }
+            break;
+        }
+
+        case EXPR_SUBSCRIPT:
+            fold_constants(&((NodeExprSubscript *) *node)->obj);
+            fold_constants(&((NodeExprSubscript *) *node)->index);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+
+//// BYTECODE COMPILER ////
+
+/*!
+ * The bytecode instructions.  A compiled program is an array of ints: each
+ * instruction is an opcode followed by its operands, if it has any.  The
+ * comments give the operands, and the effect on the operand stack with its
+ * top on the right.
+ */
+typedef enum Opcode {
+    BC_CONST,               /*!< constant:      -- value */
+
+    BC_LOAD_GLOBAL,         /*!< slot:          -- value */
+    BC_STORE_GLOBAL,        /*!< slot:    value -- */
+    BC_DEL_GLOBAL,          /*!< slot:          -- */
+
+    BC_NEGATE,              /*!<              x -- -x */
+    BC_IDENTITY,            /*!<              x -- +x */
+    BC_NOT,                 /*!<              x -- not x */
+    BC_COMPARE,             /*!< COMP_* type: l r -- bool */
+    BC_ADD,                 /*!<            l r -- l + r */
+    BC_SUBTRACT,            /*!<            l r -- l - r */
+    BC_MULTIPLY,            /*!<            l r -- l * r */
+    BC_DIVIDE,              /*!<            l r -- l / r */
+    BC_MODULO,              /*!<            l r -- l % r */
+
+    BC_JUMP,                /*!< target:        -- */
+    BC_JUMP_IF_FALSE,       /*!< target:      x -- */
+    BC_JUMP_IF_TRUE,        /*!< target:      x -- */
+    BC_JUMP_IF_FALSE_OR_POP,/*!< target:      x -- x, if the jump is taken */
+    BC_JUMP_IF_TRUE_OR_POP, /*!< target:      x -- x, if the jump is taken */
+
+    BC_NEW_LIST,            /*!< capacity:      -- list */
+    BC_LIST_APPEND,         /*!<     list value -- list */
+    BC_NEW_DICT,            /*!< capacity:      -- dict */
+    BC_DICT_INSERT,         /*!< dict value key -- dict */
+
+    BC_SUBSCRIPT,           /*!<        key obj -- obj[key] */
+    BC_LVAL_SUBSCRIPT,      /*!<        key obj -- obj[key], to assign into */
+    BC_STORE_SUBSCRIPT,     /*!<  value key obj -- */
+    BC_DEL_SUBSCRIPT,       /*!<        key obj -- */
+
+    BC_CALL,                /*!< function, n: args... -- result */
+    BC_PRINT_EXPR,          /*!<          value -- */
+    BC_ERROR,               /*!< constant: raises the error message */
+    BC_HALT,
+
+    NUM_OPCODES
+} Opcode;
+
+/*! A constant an instruction refers to. */
+typedef union Constant {
+    Reference ref;          /*!< A literal's value, kept alive as a root. */
+    const char *string;     /*!< Points into the AST being run. */
+} Constant;
+
+/*!
+ * A compiled program: its instructions, the constants they refer to, and
+ * the deepest the operand stack gets while it runs.  There is only the one,
+ * which is reused for each tree given to `eval_root`.
+ */
+static struct Program {
+    int *code;
+    int length;
+    int capacity;
+
+    Constant *constants;
+    int num_constants;
+    int max_constants;
+
+    int depth;
+    int max_depth;
+} program;
+
+static void compile_expr(Node *node);
+static void compile_lval_object(Node *node);
+
+static void emit_word(int word) {
+    if (program.length == program.capacity) {
+        program.capacity = program.capacity ? program.capacity * 2
+                                             : INITIAL_SIZE;
+        program.code = realloc(program.code, sizeof(int) * program.capacity);
+        if (program.code == NULL) {
+            error("%s", "Allocation failed!");
+        }
+    }
+
+    program.code[program.length++] = word;
+}
+
+/*! Emits an instruction that changes the stack depth by `effect`. */
+static void emit(Opcode op, int effect) {
+    emit_word(op);
+
+    program.depth += effect;
+    if (program.depth > program.max_depth) {
+        program.max_depth = program.depth;
+    }
+}
+
+static void emit_arg(Opcode op, int arg, int effect) {
+    emit(op, effect);
+    emit_word(arg);
+}
+
+/*! Emits a jump, and returns where its target is so it can be patched. */
+static int emit_jump(Opcode op, int effect) {
+    emit_arg(op, -1, effect);
+    return program.length - 1;
+}
+
+/*! Points the jump target at `at` to the next instruction emitted. */
+static void patch_jump(int at) {
+    program.code[at] = program.length;
+}
+
+static int add_constant(Constant constant) {
+    if (program.num_constants == program.max_constants) {
+        program.max_constants = program.max_constants ?
+            program.max_constants * 2 : INITIAL_SIZE;
+        program.constants = realloc(program.constants,
+                sizeof(Constant) * program.max_constants);
+        if (program.constants == NULL) {
+            error("%s", "Allocation failed!");
+        }
+    }
+
+    program.constants[program.num_constants] = constant;
+    return program.num_constants++;
+}
+
+/*! Emits an instruction that pushes a literal's value. */
+static void emit_const(Reference value) {
+    emit_arg(BC_CONST, add_constant((Constant) { .ref = value }), 1);
+}
+
+/*!
+ * Emits an instruction that raises an error when it is reached.  Errors the
+ * tree-walker would raise are compiled like this, rather than raised by the
+ * compiler, so that they happen after the same side effects.
+ */
+static void emit_error(const char *message, int effect) {
+    emit_arg(BC_ERROR, add_constant((Constant) { .string = message }), effect);
+}
+
+/*!
+ * Returns why a node cannot be assigned to, or NULL if it can be.  These
+ * are the errors `eval_expr_lval` raises.
+ */
+static const char *lval_error(Node *node) {
+    switch (node->type) {
+        case EXPR_LITERAL_STRING:
+        case EXPR_LITERAL_INTEGER:
+        case EXPR_LITERAL_FLOAT:
+        case EXPR_LITERAL_SINGLETON:
+            return "cannot assign to literal";
+
+        case EXPR_LITERAL_DICT:
+        case EXPR_LITERAL_LIST:
+            return "assignment destructuring not implemented";
+
+        case EXPR_LITERAL_PAIR:
+            return "unexpected pair";
+
+        case EXPR_BUILTIN:
+            return "cannot assign to result of expression";
+
+        case EXPR_CALL:
+            return "cannot assign to result of call";
+
+        case EXPR_IDENTIFIER:
+        case EXPR_SUBSCRIPT:
+            return NULL;
+
+        default:
+            error("unimplemented expr lval `%d`", node->type);
+    }
+}
+
+/*! Compiles a binary operator: left, then right, then the instruction. */
+static void compile_binary(Opcode op, int arg, NodeExprBuiltin *node) {
+    compile_expr(node->left);
+    compile_expr(node->right);
+    if (op == BC_COMPARE) {
+        emit_arg(op, arg, -1);
+    } else {
+        emit(op, -1);
+    }
+}
+
+static void compile_builtin(NodeExprBuiltin *node) {
+    if (node->value != NULL_REF) {
+        emit_const(node->value);
+        return;
+    }
+
+    switch (node->builtin_type) {
+        case UOP_NEGATE:
+            compile_expr(node->left);
+            emit(BC_NEGATE, 0);
+            break;
+
+        case UOP_IDENTITY:
+            compile_expr(node->left);
+            emit(BC_IDENTITY, 0);
+            break;
+
+        case UOP_NOT:
+            compile_expr(node->left);
+            emit(BC_NOT, 0);
+            break;
+
+        case COMP_EQUALS:
+        case COMP_LT:
+        case COMP_GT:
+        case COMP_LE:
+        case COMP_GE:
+            compile_binary(BC_COMPARE, node->builtin_type, node);
+            break;
+
+        case OP_OR:
+        case OP_AND: {
+            /* Short-circuit: the left hand side is the result if it
+             * decides the answer on its own. */
+            compile_expr(node->left);
+            int end = emit_jump(node->builtin_type == OP_OR ?
+                    BC_JUMP_IF_TRUE_OR_POP : BC_JUMP_IF_FALSE_OR_POP, -1);
+            compile_expr(node->right);
+            patch_jump(end);
+            break;
+        }
+
+        case OP_ADD:      compile_binary(BC_ADD, 0, node);      break;
+        case OP_SUBTRACT: compile_binary(BC_SUBTRACT, 0, node); break;
+        case OP_MULTIPLY: compile_binary(BC_MULTIPLY, 0, node); break;
+        case OP_DIVIDE:   compile_binary(BC_DIVIDE, 0, node);   break;
+        case OP_MODULO:   compile_binary(BC_MODULO, 0, node);   break;
+
+        default:
+            error("unknown builtin `%d`", node->builtin_type);
+    }
+}
+
+static void compile_call(NodeExprCall *node) {
+    int arity = 0;
+    if (node->args) {
+        for (NodeListEntry *entry = node->args->head;
+                entry; entry = entry->next, arity++) {
+            compile_expr(entry->node);
+        }
+    }
+
+    /* Any error waits until the arguments have been evaluated, as it does
+     * in `eval_expr_call`. */
+    if (node->func->type != EXPR_IDENTIFIER) {
+        emit_error("calling non-identifiers not yet supported", 1 - arity);
+        return;
+    }
+
+    if (node->builtin < 0) {
+        emit_error("calling user-defined functions not yet supported",
+                1 - arity);
+        return;
+    }
+
+    emit_arg(BC_CALL, node->builtin, 1 - arity);
+    emit_word(arity);
+}
+
+/*! Compiles an expression, leaving its value on the stack. */
+static void compile_expr(Node *node) {
+    switch (node->type) {
+        case EXPR_LITERAL_STRING:
+        case EXPR_LITERAL_INTEGER:
+        case EXPR_LITERAL_FLOAT:
+        case EXPR_LITERAL_SINGLETON:
+            emit_const(constant_value(node));
+            break;
+
+        case EXPR_LITERAL_LIST: {
+            NodeList *exprs = ((NodeExprLiteralList *) node)->values;
+
+            emit_arg(BC_NEW_LIST, exprs ? ast_nodelist_length(exprs) : 0, 1);
+            if (exprs) {
+                for (NodeListEntry *entry = exprs->head; entry;
+                        entry = entry->next) {
+                    compile_expr(entry->node);
+                    emit(BC_LIST_APPEND, -1);
+                }
+            }
+            break;
+        }
+
+        case EXPR_LITERAL_DICT: {
+            NodeList *exprs = ((NodeExprLiteralDict *) node)->values;
+
+            emit_arg(BC_NEW_DICT, exprs ? ast_nodelist_length(exprs) : 0, 1);
+            if (exprs) {
+                for (NodeListEntry *entry = exprs->head; entry;
+                        entry = entry->next) {
+                    if (entry->node->type != EXPR_LITERAL_PAIR) {
+                        emit_error("expected pair in dict literal", 0);
+                        continue;
+                    }
+
+                    NodeExprLiteralPair *pair =
+                        (NodeExprLiteralPair *) entry->node;
+                    compile_expr(pair->value);
+                    compile_expr(pair->key);
+                    emit(BC_DICT_INSERT, -2);
+                }
+            }
+            break;
+        }
+
+        case EXPR_LITERAL_PAIR:
+            emit_error("unexpected pair", 1);
+            break;
+
+        case EXPR_IDENTIFIER:
+            emit_arg(BC_LOAD_GLOBAL, ((NodeExprIdentifier *) node)->slot, 1);
+            break;
+
+        case EXPR_BUILTIN:
+            compile_builtin((NodeExprBuiltin *) node);
+            break;
+
+        case EXPR_CALL:
+            compile_call((NodeExprCall *) node);
+            break;
+
+        case EXPR_SUBSCRIPT: {
+            NodeExprSubscript *subscript = (NodeExprSubscript *) node;
+            compile_expr(subscript->index);
+            compile_expr(subscript->obj);
+            emit(BC_SUBSCRIPT, -1);
+            break;
+        }
+
+        default:
+            error("unimplemented expr `%d`", node->type);
+    }
+}
+
+/*!
+ * Compiles the container being subscripted in an assignment or deletion,
+ * which is evaluated the way `eval_expr_lval` does it.
+ */
+static void compile_lval_object(Node *node) {
+    const char *message = lval_error(node);
+
+    if (message != NULL) {
+        emit_error(message, 1);
+    } else if (node->type == EXPR_IDENTIFIER) {
+        emit_arg(BC_LOAD_GLOBAL, ((NodeExprIdentifier *) node)->slot, 1);
+    } else {
+        NodeExprSubscript *subscript = (NodeExprSubscript *) node;
+        compile_expr(subscript->index);
+        compile_lval_object(subscript->obj);
+        emit(BC_LVAL_SUBSCRIPT, -1);
+    }
+}
+
+/*! Compiles storing the value on top of the stack into a target. */
+static void compile_store(Node *node) {
+    const char *message = lval_error(node);
+
+    if (message != NULL) {
+        emit_error(message, -1);
+    } else if (node->type == EXPR_IDENTIFIER) {
+        emit_arg(BC_STORE_GLOBAL, ((NodeExprIdentifier *) node)->slot, -1);
+    } else {
+        NodeExprSubscript *subscript = (NodeExprSubscript *) node;
+        compile_expr(subscript->index);
+        compile_lval_object(subscript->obj);
+        emit(BC_STORE_SUBSCRIPT, -3);
+    }
+}
+
+static void compile_del(NodeStmtDel *node) {
+    switch (node->arg->type) {
+        case EXPR_LITERAL_STRING:
+        case EXPR_LITERAL_INTEGER:
+        case EXPR_LITERAL_FLOAT:
+        case EXPR_LITERAL_SINGLETON:
+            emit_error("cannot delete literal", 0);
+            break;
+
+        case EXPR_LITERAL_DICT:
+        case EXPR_LITERAL_LIST:
+            emit_error("deletion destructuring not implemented", 0);
+            break;
+
+        case EXPR_LITERAL_PAIR:
+            emit_error("unexpected pair", 0);
+            break;
+
+        case EXPR_IDENTIFIER:
+            emit_arg(BC_DEL_GLOBAL, ((NodeExprIdentifier *) node->arg)->slot, 0);
+            break;
+
+        case EXPR_BUILTIN:
+            emit_error("cannot delete result of expression", 0);
+            break;
+
+        case EXPR_CALL:
+            emit_error("cannot delete result of call", 0);
+            break;
+
+        case EXPR_SUBSCRIPT: {
+            NodeExprSubscript *subscript = (NodeExprSubscript *) node->arg;
+            compile_expr(subscript->index);
+            compile_lval_object(subscript->obj);
+            emit(BC_DEL_SUBSCRIPT, -2);
+            break;
+        }
+
+        default:
+            error("unimplemented expr lval `%d`", node->arg->type);
+    }
+}
+
+/*! Compiles a statement, which leaves the stack as it found it. */
+static void compile_stmt(Node *node) {
+    switch (node->type) {
+        case STMT_SEQUENCE:
+            for (NodeListEntry *entry =
+                    ((NodeStmtSequence *) node)->statements->head;
+                    entry; entry = entry->next) {
+                compile_stmt(entry->node);
+            }
+            break;
+
+        case STMT_ASSIGN: {
+            NodeStmtAssign *assign = (NodeStmtAssign *) node;
+            compile_expr(assign->right);
+            compile_store(assign->left);
+            break;
+        }
+
+        case STMT_DEL:
+            compile_del((NodeStmtDel *) node);
+            break;
+
+        case STMT_IF: {
+            NodeStmtIf *ifnode = (NodeStmtIf *) node;
+
+            compile_expr(ifnode->cond);
+            int else_jump = emit_jump(BC_JUMP_IF_FALSE, -1);
+            compile_stmt(ifnode->left);
+
+            if (ifnode->right) {
+                int end_jump = emit_jump(BC_JUMP, 0);
+                patch_jump(else_jump);
+                compile_stmt(ifnode->right);
+                patch_jump(end_jump);
+            } else {
+                patch_jump(else_jump);
+            }
+            break;
+        }
+
+        case STMT_WHILE: {
+            /* The condition goes after the body, so that each iteration
+             * only takes the one jump back to the top. */
+            NodeStmtWhile *wnode = (NodeStmtWhile *) node;
+
+            int cond_jump = emit_jump(BC_JUMP, 0);
+            int body = program.length;
+            compile_stmt(wnode->body);
+            patch_jump(cond_jump);
+            compile_expr(wnode->cond);
+            emit_arg(BC_JUMP_IF_TRUE, body, -1);
+            break;
+        }
+
+        default:
+            if (is_statement(node->type)) {
+                error("unimplemented: %d", node->type);
+            }
+
+            /* An expression statement prints its value. */
+            compile_expr(node);
+            emit(BC_PRINT_EXPR, -1);
+            break;
+    }
+}
+
+/*! Compiles a parse tree into `program`, replacing what was there. */
+static void compile_program(Node *root) {
+    program.length = 0;
+    program.num_constants = 0;
+    program.depth = 0;
+    program.max_depth = 0;
+
+    compile_stmt(root);
+    emit(BC_HALT, 0);
+
+    assert(program.depth == 0);
+}
+
+
+//// BYTECODE VM ////
+
+/*!
+ * The VM's operand stack.  The References on it are roots of the garbage
+ * collector, so everything an instruction is working on stays alive until
+ * the instruction pops it.  It is emptied along with the root stack.
+ */
+static Reference *vm_stack = NULL;
+static int vm_sp = 0;
+static int vm_max_stack = 0;
+
+/* Everything that can allocate must finish before the push, so that the
+ * collector never sees the new slot before it is filled in. */
+#define PUSH(r) do { Reference pushed = (r); vm_stack[vm_sp++] = pushed; } \
+                while (0)
+#define POP()   (vm_stack[--vm_sp])
+#define TOP(n)  (vm_stack[vm_sp - (n)])
+
+/* Threaded dispatch, jumping straight from each instruction to the next,
+ * where the compiler supports taking the address of a label. */
+#if defined(__GNUC__) && !defined(NCOMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(op)  target_##op
+#define DISPATCH()  goto *dispatch_table[code[pc++]]
+#else
+#define TARGET(op)  case op
+#define DISPATCH()  continue
+#endif
+
+/* Applies an arithmetic operator to the top two values, with a fast path
+ * for when both of them are small ints. */
+#define ARITHMETIC(op, ref_op)                                              \
+    do {                                                                    \
+        Reference result;                                                   \
+        if (is_small_int_ref(TOP(2)) && is_small_int_ref(TOP(1))) {         \
+            result = make_reference_int(                                    \
+                    (long int) small_int_value(TOP(2)) op                   \
+                    small_int_value(TOP(1)));                               \
+        } else {                                                            \
+            result = ref_op(TOP(2), TOP(1));                                \
+        }                                                                   \
+        vm_sp--;                                                            \
+        TOP(1) = result;                                                    \
+    } while (0)
+
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/*! Runs `program` to completion. */
+static void vm_run(void) {
+    const int *code = program.code;
+    const Constant *constants = program.constants;
+    int pc = 0;
+
+    if (program.max_depth > vm_max_stack) {
+        vm_max_stack = program.max_depth;
+        vm_stack = realloc(vm_stack, sizeof(Reference) * vm_max_stack);
+        if (vm_stack == NULL) {
+            error("%s", "Allocation failed!");
+        }
+    }
+    vm_sp = 0;
+
+#ifdef USE_COMPUTED_GOTO
+    static void *const dispatch_table[NUM_OPCODES] = {
+        [BC_CONST]                  = &&TARGET(BC_CONST),
+        [BC_LOAD_GLOBAL]            = &&TARGET(BC_LOAD_GLOBAL),
+        [BC_STORE_GLOBAL]           = &&TARGET(BC_STORE_GLOBAL),
+        [BC_DEL_GLOBAL]             = &&TARGET(BC_DEL_GLOBAL),
+        [BC_NEGATE]                 = &&TARGET(BC_NEGATE),
+        [BC_IDENTITY]               = &&TARGET(BC_IDENTITY),
+        [BC_NOT]                    = &&TARGET(BC_NOT),
+        [BC_COMPARE]                = &&TARGET(BC_COMPARE),
+        [BC_ADD]                    = &&TARGET(BC_ADD),
+        [BC_SUBTRACT]               = &&TARGET(BC_SUBTRACT),
+        [BC_MULTIPLY]               = &&TARGET(BC_MULTIPLY),
+        [BC_DIVIDE]                 = &&TARGET(BC_DIVIDE),
+        [BC_MODULO]                 = &&TARGET(BC_MODULO),
+        [BC_JUMP]                   = &&TARGET(BC_JUMP),
+        [BC_JUMP_IF_FALSE]          = &&TARGET(BC_JUMP_IF_FALSE),
+        [BC_JUMP_IF_TRUE]           = &&TARGET(BC_JUMP_IF_TRUE),
+        [BC_JUMP_IF_FALSE_OR_POP]   = &&TARGET(BC_JUMP_IF_FALSE_OR_POP),
+        [BC_JUMP_IF_TRUE_OR_POP]    = &&TARGET(BC_JUMP_IF_TRUE_OR_POP),
+        [BC_NEW_LIST]               = &&TARGET(BC_NEW_LIST),
+        [BC_LIST_APPEND]            = &&TARGET(BC_LIST_APPEND),
+        [BC_NEW_DICT]               = &&TARGET(BC_NEW_DICT),
+        [BC_DICT_INSERT]            = &&TARGET(BC_DICT_INSERT),
+        [BC_SUBSCRIPT]              = &&TARGET(BC_SUBSCRIPT),
+        [BC_LVAL_SUBSCRIPT]         = &&TARGET(BC_LVAL_SUBSCRIPT),
+        [BC_STORE_SUBSCRIPT]        = &&TARGET(BC_STORE_SUBSCRIPT),
+        [BC_DEL_SUBSCRIPT]          = &&TARGET(BC_DEL_SUBSCRIPT),
+        [BC_CALL]                   = &&TARGET(BC_CALL),
+        [BC_PRINT_EXPR]             = &&TARGET(BC_PRINT_EXPR),
+        [BC_ERROR]                  = &&TARGET(BC_ERROR),
+        [BC_HALT]                   = &&TARGET(BC_HALT)
+    };
+
+    DISPATCH();
+#else
+    for (;;) switch (code[pc++]) {
+#endif
+
+    TARGET(BC_CONST): {
+        PUSH(constants[code[pc++]].ref);
+        DISPATCH();
+    }
+
+    TARGET(BC_LOAD_GLOBAL): {
+        struct GlobalVariable *var = &global_vars[code[pc++]];
+        if (!var->defined) {
+            error("name '%s' is not defined", var->name);
+        }
+        PUSH(var->ref);
+        DISPATCH();
+    }
+
+    TARGET(BC_STORE_GLOBAL): {
+        Reference *ref = get_global_slot(code[pc++], true);
+        *ref = POP();
+        mm_write_barrier(NULL_REF, *ref);
+        DISPATCH();
+    }
+
+    TARGET(BC_DEL_GLOBAL): {
+        delete_global_slot(code[pc++]);
+        DISPATCH();
+    }
+
+    TARGET(BC_NEGATE): {
+        Reference result = ref_negate(TOP(1));
+        TOP(1) = result;
+        DISPATCH();
+    }
+
+    TARGET(BC_IDENTITY): {
+        TOP(1) = ref_identity(TOP(1));
+        DISPATCH();
+    }
+
+    TARGET(BC_NOT): {
+        TOP(1) = get_bool_ref(!coerce_ref_to_bool(TOP(1)));
+        DISPATCH();
+    }
+
+    TARGET(BC_COMPARE): {
+        NodeExprBuiltinType type = code[pc++];
+        bool result;
+
+        if (is_small_int_ref(TOP(2)) && is_small_int_ref(TOP(1))) {
+            int l = small_int_value(TOP(2));
+            int r = small_int_value(TOP(1));
+            switch (type) {
+                case COMP_EQUALS:   result = l == r; break;
+                case COMP_LT:       result = l < r;  break;
+                case COMP_GT:       result = l > r;  break;
+                case COMP_LE:       result = l <= r; break;
+                case COMP_GE:       result = l >= r; break;
+                default:
+                    eval_generic_error(type, TOP(2), TOP(1));
+            }
+        } else {
+            result = eval_generic_comp(type, TOP(2), TOP(1));
+        }
+
+        vm_sp--;
+        TOP(1) = get_bool_ref(result);
+        DISPATCH();
+    }
+
+    TARGET(BC_ADD): {
+        ARITHMETIC(+, ref_add);
+        DISPATCH();
+    }
+
+    TARGET(BC_SUBTRACT): {
+        ARITHMETIC(-, ref_subtract);
+        DISPATCH();
+    }
+
+    TARGET(BC_MULTIPLY): {
+        ARITHMETIC(*, ref_multiply);
+        DISPATCH();
+    }
+
+    TARGET(BC_DIVIDE): {
+        Reference result = ref_divide(TOP(2), TOP(1));
+        vm_sp--;
+        TOP(1) = result;
+        DISPATCH();
+    }
+
+    TARGET(BC_MODULO): {
+        ARITHMETIC(%, ref_modulo);
+        DISPATCH();
+    }
+
+    TARGET(BC_JUMP): {
+        pc = code[pc];
+        DISPATCH();
+    }
+
+    TARGET(BC_JUMP_IF_FALSE): {
+        int target = code[pc++];
+        if (!coerce_ref_to_bool(POP())) {
+            pc = target;
+        }
+        DISPATCH();
+    }
+
+    TARGET(BC_JUMP_IF_TRUE): {
+        int target = code[pc++];
+        if (coerce_ref_to_bool(POP())) {
+            pc = target;
+        }
+        DISPATCH();
+    }
+
+    TARGET(BC_JUMP_IF_FALSE_OR_POP): {
+        int target = code[pc++];
+        if (!coerce_ref_to_bool(TOP(1))) {
+            pc = target;
+        } else {
+            vm_sp--;
+        }
+        DISPATCH();
+    }
+
+    TARGET(BC_JUMP_IF_TRUE_OR_POP): {
+        int target = code[pc++];
+        if (coerce_ref_to_bool(TOP(1))) {
+            pc = target;
+        } else {
+            vm_sp--;
+        }
+        DISPATCH();
+    }
+
+    TARGET(BC_NEW_LIST): {
+        PUSH(make_reference_list(code[pc++]));
+        DISPATCH();
+    }
+
+    TARGET(BC_LIST_APPEND): {
+        list_append(TOP(2), TOP(1));
+        vm_sp--;
+        DISPATCH();
+    }
+
+    TARGET(BC_NEW_DICT): {
+        PUSH(make_reference_dict(code[pc++]));
+        DISPATCH();
+    }
+
+    TARGET(BC_DICT_INSERT): {
+        Reference dict = TOP(3);
+        Reference value = TOP(2);
+        Reference key = TOP(1);
+
+        if (!is_hashable(ref_type(key))) {
+            error("dictionary keys must be hashable");
+        }
+
+        Reference owner;
+        *dict_get_entry(dict, key, true, &owner) = value;
+        mm_write_barrier(owner, value);
+
+        vm_sp -= 2;
+        DISPATCH();
+    }
+
+    TARGET(BC_SUBSCRIPT): {
+        Reference result = ref_subscript(TOP(1), TOP(2));
+        vm_sp--;
+        TOP(1) = result;
+        DISPATCH();
+    }
+
+    TARGET(BC_LVAL_SUBSCRIPT): {
+        Reference owner;
+        Reference result = *ref_subscript_lval(TOP(1), TOP(2), false, &owner);
+        vm_sp--;
+        TOP(1) = result;
+        DISPATCH();
+    }
+
+    TARGET(BC_STORE_SUBSCRIPT): {
+        Reference owner;
+        Reference *ref = ref_subscript_lval(TOP(1), TOP(2), true, &owner);
+        *ref = TOP(3);
+        mm_write_barrier(owner, *ref);
+        vm_sp -= 3;
+        DISPATCH();
+    }
+
+    TARGET(BC_DEL_SUBSCRIPT): {
+        ref_delete_subscript(TOP(1), TOP(2));
+        vm_sp -= 2;
+        DISPATCH();
+    }
+
+    TARGET(BC_CALL): {
+        int func = code[pc++];
+        int arity = code[pc++];
+        Reference result = builtin_functions[func].func(arity,
+                &vm_stack[vm_sp - arity]);
+        vm_sp -= arity;
+        PUSH(result);
+        DISPATCH();
+    }
+
+    TARGET(BC_PRINT_EXPR): {
+        Reference result = TOP(1);
+        if (result == NULL_REF) {
+            error("unexpected NULL reference!");
+        } else if (result != NONE_REF) {
+            ref_println(stdout, result);
+        }
+        vm_sp--;
+        DISPATCH();
+    }
+
+    TARGET(BC_ERROR): {
+        error("%s", constants[code[pc]].string);
+    }
+
+    TARGET(BC_HALT): {
+        assert(vm_sp == 0);
+        return;
+    }
+
+#ifndef USE_COMPUTED_GOTO
+    default:
+        UNREACHABLE();
+    }
+#endif
+}
+
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef PUSH
+#undef POP
+#undef TOP
+#undef TARGET
+#undef DISPATCH
+#undef ARITHMETIC
+
+
+//// GLOBAL VAR FUNCTIONS ////
+
+/*! Puts the name at index i of global_vars into the hash index. */
+static void index_global(int i) {
+    unsigned int mask = num_global_slots - 1;
+    unsigned int slot = global_vars[i].hash & mask;
+
+    while (global_index[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    global_index[slot] = i;
+}
+
+/*!
+ * Returns the index of a name in global_vars.  If the name has not been seen
+ * before, it is interned when intern is true, and -1 is returned otherwise.
+ */
+static int find_global(const char *name, bool intern) {
+    unsigned int hash = hash_chars(name);
+
+    if (global_index != NULL) {
+        unsigned int mask = num_global_slots - 1;
+        for (unsigned int slot = hash & mask; global_index[slot] != -1;
+                slot = (slot + 1) & mask) {
+            struct GlobalVariable *var = &global_vars[global_index[slot]];
+            if (var->hash == hash && strcmp(name, var->name) == 0) {
+                return global_index[slot];
+            }
+        }
+    }
+
+    if (!intern) {
+        return -1;
+    }
+
+    if (num_names == max_vars) {
+        /* Double the size of the table, and rebuild the index to match. */
+        max_vars = max_vars ? max_vars * 2 : INITIAL_SIZE;
+        global_vars = realloc(global_vars,
+                              sizeof(struct GlobalVariable) * max_vars);
+        num_global_slots = 2 * max_vars;
+        free(global_index);
+        global_index = malloc(sizeof(int) * num_global_slots);
+
+        if (global_vars == NULL || global_index == NULL) {
+            error("%s", "Allocation failed!");
+        }
+
+        memset(global_index, -1, sizeof(int) * num_global_slots);
+        for (int i = 0; i < num_names; i++) {
+            index_global(i);
+        }
+    }
+
+    struct GlobalVariable *var = &global_vars[num_names];
+    var->name = strndup(name, strlen(name));
+    var->hash = hash;
+    var->ref = NULL_REF;
+    var->defined = false;
+    var->prev = var->next = -1;
+    index_global(num_names);
+
+    return num_names++;
+}
+
+/*!
+ * Binds every identifier in a parse tree to its slot in global_vars, so that
+ * evaluating it indexes the table directly instead of hashing the name.
+ * Slots never move, since names are never removed once interned.  Calls
+ * are bound to the builtin function they call, if there is one, by its
+ * index in builtin_functions; the function being called is not resolved as
+ * a global, since only builtins can be called.
+ */
+static void resolve_names(Node *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->type) {
+        case STMT_SEQUENCE:
+            for (NodeListEntry *entry =
+                    ((NodeStmtSequence *) node)->statements->head;
+                    entry; entry = entry->next) {
+                resolve_names(entry->node);
+            }
+            break;
+
+        case STMT_ASSIGN:
+            resolve_names(((NodeStmtAssign *) node)->left);
+            resolve_names(((NodeStmtAssign *) node)->right);
+            break;
+
+        case STMT_DEL:
+            resolve_names(((NodeStmtDel *) node)->arg);
+            break;
+
+        case STMT_IF:
+            resolve_names(((NodeStmtIf *) node)->cond);
+            resolve_names(((NodeStmtIf *) node)->left);
+            resolve_names(((NodeStmtIf *) node)->right);
+            break;
+
+        case STMT_WHILE:
+            resolve_names(((NodeStmtWhile *) node)->cond);
+            resolve_names(((NodeStmtWhile *) node)->body);
+            break;
+
+        case EXPR_LITERAL_LIST:
+        case EXPR_LITERAL_DICT: {
+            NodeList *values = node->type == EXPR_LITERAL_LIST ?
+                ((NodeExprLiteralList *) node)->values :
+                ((NodeExprLiteralDict *) node)->values;
+            if (values) {
+                for (NodeListEntry *entry = values->head;
+                        entry; entry = entry->next) {
+                    resolve_names(entry->node);
+                }
+            }
+            break;
+        }
+
+        case EXPR_LITERAL_PAIR:
+            resolve_names(((NodeExprLiteralPair *) node)->key);
+            resolve_names(((NodeExprLiteralPair *) node)->value);
+            break;
+
+        case EXPR_IDENTIFIER: {
+            NodeExprIdentifier *ident = (NodeExprIdentifier *) node;
+            if (ident->slot < 0) {
+                ident->slot = find_global(ident->name, true);
+            }
+            break;
+        }
+
+        case EXPR_BUILTIN:
+            resolve_names(((NodeExprBuiltin *) node)->left);
+            resolve_names(((NodeExprBuiltin *) node)->right);
+            break;
+
+        case EXPR_CALL: {
+            NodeExprCall *call = (NodeExprCall *) node;
+            if (call->args) {
+                for (NodeListEntry *entry = call->args->head;
+                        entry; entry = entry->next) {
+                    resolve_names(entry->node);
+                }
+            }
+
+            if (call->builtin < 0 && call->func->type == EXPR_IDENTIFIER) {
+                call->builtin = find_builtin_function(
+                        ((NodeExprIdentifier *) call->func)->name);
+            }
+            break;
+        }
+
+        case EXPR_SUBSCRIPT:
+            resolve_names(((NodeExprSubscript *) node)->obj);
+            resolve_names(((NodeExprSubscript *) node)->index);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*! Defines the global at index i of global_vars, if it is not already. */
+static Reference *define_global(int i, Reference value) {
+    struct GlobalVariable *var = &global_vars[i];
+
+    if (!var->defined) {
+        /* Link it onto the end of the defined globals. */
+        var->defined = true;
+        var->prev = last_var;
+        var->next = -1;
+        if (last_var >= 0) {
+            global_vars[last_var].next = i;
+        } else {
+            first_var = i;
+        }
+        last_var = i;
+        num_vars++;
+    }
+
+    var->ref = value;
+    return &var->ref;
+}
+
+/*! Adds a new global variable with the provided name. */
+Reference *add_global_variable(const char *name, Reference value) {
+    return define_global(find_global(name, true), value);
+}
+
+/*! Tries to retrieve the reference of the global at index i of global_vars,
+    creating it if `create` is true. */
+static Reference *get_global_slot(int i, bool create) {
+    if (global_vars[i].defined) {
+        return &global_vars[i].ref;
+    }
+
+    if (create) {
+        return define_global(i, NULL_REF);
+    } else {
+        error("name '%s' is not defined", global_vars[i].name);
+    }
+}
+
+/*! Delete the global at index i of global_vars. Error if it is not
+    defined. */
+static void delete_global_slot(int i) {
+    struct GlobalVariable *var = &global_vars[i];
+
+    if (!var->defined) {
+        error("Could not delete variable `%s`", var->name);
+    }
+
+    /* Unlink it from the defined globals.  The name stays interned. */
+    if (var->prev >= 0) {
+        global_vars[var->prev].next = var->next;
+    } else {
+        first_var = var->next;
+    }
+    if (var->next >= 0) {
+        global_vars[var->next].prev = var->prev;
+    } else {
+        last_var = var->prev;
+    }
+
+    var->defined = false;
+    var->ref = NULL_REF;
+    num_vars--;
+}
+
+/*!
+ * Pushes a temporary root onto the root stack, so that the Value stays
+ * alive while the evaluator is using it.  Returns the index to pass to
+ * `remove_temporary_global` once it is no longer needed.
+ *
+ * All temporary roots are removed by `clear_temporary_globals`, which is
+ * called after every statement, and after an error. */
+int add_temporary_global(Reference value) {
+    if (num_roots == max_roots) {
+        max_roots = max_roots ? max_roots * 2 : INITIAL_SIZE;
+        root_stack = realloc(root_stack,
+                             sizeof(struct TemporaryRoot) * max_roots);
+        if (root_stack == NULL) {
+            error("%s", "Allocation failed!");
+        }
+    }
+
+    root_stack[num_roots].ref = value;
+    root_stack[num_roots].live = true;
+    return num_roots++;
+}
+
+/*!
+ * Removes the specified temporary root.  Roots need not be removed in the
+ * reverse order they were added, so the stack is only popped down to the
+ * topmost root still in use.
+ */
+void remove_temporary_global(size_t glob) {
+    assert(glob < (size_t) num_roots && root_stack[glob].live);
+    root_stack[glob].live = false;
+
+    while (num_roots > 0 && !root_stack[num_roots - 1].live) {
+        num_roots--;
+    }
+}
+
+/*!
+ * Removes the temporary roots from index first on, all at once.  They
+ * must be the topmost ones, added after everything still in use.
+ */
+static void remove_temporary_globals_from(size_t first) {
+    assert(first <= (size_t) num_roots);
+    num_roots = first;
+
+    while (num_roots > 0 && !root_stack[num_roots - 1].live) {
+        num_roots--;
+    }
+}
+
+/*!
+ * Removes all temporary roots, including the VM's operand stack and the
+ * values of the literals in the tree that was evaluated.
+ */
+void clear_temporary_globals() {
+    num_roots = 0;
+    num_literals = 0;
+    vm_sp = 0;
+}
+
+/*!
+ * Invokes a function for each global in the global environment, in the
+ * order they were defined.  Returns the number of globals found.
+ */
+int foreach_global(void (*f)(const char *name, Reference Ref)) {
+
+    /* Call the callback on each global. */
+    for (int i = first_var; i >= 0; i = global_vars[i].next) {
+        f(global_vars[i].name, global_vars[i].ref);
+    }
+
+    return num_vars;
+}
+
+/*!
+ * Invokes a function for each root of the garbage collector: every global,
+ * and then every temporary root, literal value and value on the VM's operand
+ * stack, which are passed a name of NULL.  Returns the number of roots found.
+ */
+int foreach_root(void (*f)(const char *name, Reference Ref)) {
+    int count = foreach_global(f);
+
+    for (int i = 0; i < num_roots; i++) {
+        if (root_stack[i].live) {
+            f(NULL, root_stack[i].ref);
+            count++;
+        }
+    }
+
+    for (int i = 0; i < num_literals; i++) {
+        f(NULL, literals[i]);
+        count++;
+    }
+
+    for (int i = 0; i < vm_sp; i++) {
+        f(NULL, vm_stack[i]);
+        count++;
+    }
+
+    return count;
 }
 
 void print_global_helper(const char *name, Reference ref) {
@@ -1656,22 +3624,18 @@ void print_globals(void) {
 
 //// NEW REFERENCE FUNCTIONS ////
 
-/*! Creates a new None reference. This should only be called once. */
-Reference make_reference_none() {
-    Value *v = mm_malloc(VAL_NONE, 0);
-    return v->ref;
-}
-
-/*! Creates a new Bool reference. This should only be called twice. */
-Reference make_reference_bool() {
-    Value *v = mm_malloc(VAL_BOOL, 0);
-    return v->ref;
-}
-
-/*! Assigns a long int to a new reference in the ref_table. */
+/*!
+ * Returns a reference to a long int, truncated to an int.  Small ints are
+ * immediates; only the others are assigned a new reference in the ref_table.
+ */
 Reference make_reference_int(long int i) {
+    int value = i;
+    if (fits_small_int(value)) {
+        return make_small_int_ref(value);
+    }
+
     IntegerValue *iv = (IntegerValue *) mm_malloc(VAL_INTEGER, /* ignored */ 0);
-    iv->integer_value = i;
+    iv->integer_value = value;
     return iv->ref;
 }
 
@@ -1683,36 +3647,134 @@ Reference make_reference_float(double f) {
     return fv->ref;
 }
 
+/*!
+ * Returns the data_size of a StringValue holding a string of length len.
+ * The string follows the cached hash, and is NUL-terminated.
+ */
+static int string_data_size(size_t len) {
+    return offsetof(StringValue, string_value) - sizeof(Value) + len + 1;
+}
+
 /*! Assigns a string to a new reference in the ref_table. */
 Reference make_reference_string(const char *value) {
-    StringValue *sv = (StringValue *) mm_malloc(VAL_STRING, strlen(value) + 1);
+    StringValue *sv = (StringValue *) mm_malloc(VAL_STRING,
+                            string_data_size(strlen(value)));
+    sv->hash = 0;
     strcpy(sv->string_value, value);
     return sv->ref;
 }
 
-/*! Assigns a concatenated string to a new referecne in the ref_table. */
-Reference make_reference_string_concat(Reference v1, Reference v2) {
-    int len1 = deref(v1)->data_size, len2 = deref(v2)->data_size;
-    StringValue *sv = (StringValue *) mm_malloc(VAL_STRING, len1 + len2 - 1);
-    strcpy(sv->string_value, ((StringValue *) deref(v1))->string_value);
-    strcpy(sv->string_value + len1 - 1, ((StringValue *) deref(v2))->string_value);
+/*! Makes a new flat string holding the text of v1 followed by that of v2. */
+static Reference make_flat_concat(Reference v1, Reference v2) {
+    int len1 = string_length(v1);
+    int len2 = string_length(v2);
+    StringValue *sv = (StringValue *) mm_malloc(VAL_STRING,
+                            string_data_size(len1 + len2));
+    sv->hash = 0;
+    string_copy(v1, sv->string_value);
+    string_copy(v2, sv->string_value + len1);
+    sv->string_value[len1 + len2] = '\0';
     return sv->ref;
 }
 
-/*! ListNode allocation helper. */
-Reference make_reference_list_node(Reference value) {
-    ListValue *lv = (ListValue *) mm_malloc(VAL_LIST_NODE, /* ignored */ 0);
-    lv->list_node.value = value;
-    lv->list_node.next = NULL_REF;
-    return lv->ref;
+/*! Makes a new rope whose text is that of left followed by that of right. */
+static Reference make_rope(Reference left, Reference right) {
+    int length = string_length(left) + string_length(right);
+    RopeValue *rv = (RopeValue *) mm_malloc(VAL_ROPE, /* ignored */ 0);
+    rv->length = length;
+    rv->left = left;
+    rv->right = right;
+    mm_write_barrier(rv->ref, left);
+    mm_write_barrier(rv->ref, right);
+    return rv->ref;
+}
+
+/*!
+ * Returns true if ref is a flat string short enough to be merged with a
+ * string of length len, rather than given a rope node of its own.
+ */
+static bool is_short_piece(Reference ref, int len) {
+    return deref(ref)->type == VAL_STRING &&
+           string_length(ref) + len < ROPE_MIN_LENGTH;
+}
+
+/*!
+ * Assigns a concatenated string to a new reference in the ref_table.  Short
+ * results are copied into a flat string.  Longer ones are made into a rope,
+ * with a short string merged into the piece it is added next to, so that a
+ * string built a few characters at a time does not need a rope node for
+ * every few characters.
+ */
+Reference make_reference_string_concat(Reference v1, Reference v2) {
+    int len1 = string_length(v1);
+    int len2 = string_length(v2);
+
+    if (len1 + len2 < ROPE_MIN_LENGTH) {
+        return make_flat_concat(v1, v2);
+    }
+
+    RopeValue *rv1 = (RopeValue *) deref(v1);
+    RopeValue *rv2 = (RopeValue *) deref(v2);
+    Reference left, right;
+
+    /* The pieces kept from v1 or v2 are only reachable through them, and
+     * the merged piece is not reachable at all, so both are rooted while
+     * the new rope is allocated. */
+    size_t tglob_idx[2];
+
+    if (rv1->type == VAL_ROPE && rv1->right != NULL_REF &&
+            is_short_piece(rv1->right, len2)) {
+        /* (a + b) + c becomes a + (b + c), with b + c flat. */
+        left = rv1->left;
+        tglob_idx[0] = add_temporary_global(left);
+        right = make_flat_concat(rv1->right, v2);
+        tglob_idx[1] = add_temporary_global(right);
+    } else if (rv2->type == VAL_ROPE && rv2->right != NULL_REF &&
+            is_short_piece(rv2->left, len1)) {
+        /* a + (b + c) becomes (a + b) + c, with a + b flat. */
+        right = rv2->right;
+        tglob_idx[0] = add_temporary_global(right);
+        left = make_flat_concat(v1, rv2->left);
+        tglob_idx[1] = add_temporary_global(left);
+    } else {
+        return make_rope(v1, v2);
+    }
+
+    Reference result = make_rope(left, right);
+    remove_temporary_global(tglob_idx[1]);
+    remove_temporary_global(tglob_idx[0]);
+    return result;
+}
+
+/*! List allocation helper.  The list has room for capacity elements. */
+Reference make_reference_list(long int capacity) {
+    ListValue *lv = (ListValue *) mm_malloc(VAL_LIST, /* ignored */ 0);
+    lv->length = 0;
+    lv->items = NULL_REF;
+
+    Reference list = lv->ref;
+    if (capacity > 0) {
+        size_t tglob_idx = add_temporary_global(list);
+        list_reserve(list, capacity);
+        remove_temporary_global(tglob_idx);
+    }
+
+    return list;
 }
 
-/*! DictNode allocation helper. */
-Reference make_reference_dict_node(Reference key, Reference value) {
-    DictValue *dv = (DictValue *) mm_malloc(VAL_DICT_NODE, /* ignored */ 0);
-    dv->dict_node.key = key;
-    dv->dict_node.value = value;
-    dv->dict_node.next = NULL_REF;
-    return dv->ref;
+/*! Dict allocation helper.  The dict has room for capacity keys. */
+Reference make_reference_dict(long int capacity) {
+    DictValue *dv = (DictValue *) mm_malloc(VAL_DICT, /* ignored */ 0);
+    dv->length = 0;
+    dv->table = NULL_REF;
+
+    Reference dict = dv->ref;
+    if (capacity > 0) {
+        size_t tglob_idx = add_temporary_global(dict);
+        dict_resize(dict, dict_slots_for(capacity));
+        remove_temporary_global(tglob_idx);
+    }
+
+    return dict;
 }
 
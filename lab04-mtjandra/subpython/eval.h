@@ -9,7 +9,14 @@
 void ref_print(FILE *os, Reference ref);
 void ref_println(FILE *os, Reference ref);
 
-void eval_init();
+/*! The ways a parse tree can be evaluated. */
+typedef enum EvalMode {
+    EVAL_BYTECODE,      /*!< Compile it to bytecode, and run that on a VM. */
+    EVAL_TREE           /*!< Walk the tree directly; the reference version. */
+} EvalMode;
+
+void eval_init(EvalMode mode);
+void eval_reset(void);
 Reference eval_root(struct Node *root);
 
 bool ref_is_none(Reference r);
@@ -17,6 +24,7 @@ bool ref_is_true(Reference r);
 bool ref_is_false(Reference r);
 
 int foreach_global(void (*f)(const char *name, Reference ref));
+int foreach_root(void (*f)(const char *name, Reference ref));
 void print_globals(void);
 
 void clear_temporary_globals(void);
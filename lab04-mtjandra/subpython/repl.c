@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifndef NREADLINE
 #include <readline/readline.h>
@@ -13,6 +14,7 @@
 #endif
 
 #include <setjmp.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "alloc.h"
@@ -23,8 +25,31 @@
 #define DEFAULT_MEMORY_SIZE 1024
 
 static int memory_size = DEFAULT_MEMORY_SIZE;
+static GCMode gc_mode = GC_COPY;
+static EvalMode eval_mode = EVAL_BYTECODE;
 static int debug = 0;
 
+/*! How many times batch mode runs the script, or 0 to run the REPL. */
+static int batch_runs = 0;
+
+/*! Whether batch mode keeps the parse tree to use again for later runs. */
+static bool cache_trees = false;
+
+/*! Where to log garbage-collector statistics, if anywhere. */
+static FILE *stats_log = NULL;
+
+
+/*!
+ * Evaluates a tree, returning early if evaluation reports an error.  This is
+ * kept apart from its callers so that none of their locals are live across
+ * the setjmp().
+ */
+static void eval_tree(Node *tree) {
+    if (setjmp(error_jmp) == 0) {
+        eval_root(tree);
+    }
+}
+
 
 /*!
  * This is the Read-Eval-Print-Loop (aka "REPL") function. We don't actually
@@ -67,9 +92,7 @@ void read_eval_print_loop(FILE *input) {
         // If there was no parsing error, then the parse AST is located
         // in udata.tree.
         } else if (result == 0 && udata.tree) {
-            if (setjmp(error_jmp) == 0) {
-                eval_root(udata.tree);
-            }
+            eval_tree(udata.tree);
 
             clear_temporary_globals();
 
@@ -93,12 +116,216 @@ void read_eval_print_loop(FILE *input) {
 }
 
 
+/*! Returns the current time, in nanoseconds. */
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*!
+ * Reads all of a file into memory, so that it can be parsed again for each
+ * run without the time spent reading it counting as parsing.  Returns the
+ * contents, which must be freed, and sets *length to their length.
+ */
+static char *read_whole_file(FILE *input, size_t *length) {
+    size_t capacity = 4096;
+    char *text = malloc(capacity);
+    *length = 0;
+
+    while (text != NULL) {
+        *length += fread(text + *length, 1, capacity - *length, input);
+        if (*length < capacity) {
+            break;
+        }
+
+        capacity *= 2;
+        text = realloc(text, capacity);
+    }
+
+    if (text == NULL) {
+        fprintf(stderr, "read_whole_file: out of memory\n");
+        exit(1);
+    }
+    return text;
+}
+
+/*! The pool that batch mode parses into when trees are not cached. */
+static void *batch_pool = NULL;
+
+/*!
+ * Parses a whole script into a single tree, setting *tree to it (or NULL if
+ * the script is blank) and *time to how long parsing took, in nanoseconds.
+ * The tree goes in the cache if trees are being cached, or in batch_pool if
+ * not.  Returns 0 on success, or the parser's error code.
+ */
+static int parse_script(char *text, size_t length, Node **tree, long *time) {
+    /* fmemopen() will not open an empty buffer, but /dev/null reads the
+     * same as an empty script. */
+    FILE *script = length > 0 ? fmemopen(text, length, "r")
+                              : fopen("/dev/null", "r");
+    if (script == NULL) {
+        fprintf(stderr, "parse_script: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    yyscan_t scanner;
+    yylex_init(&scanner);
+
+    subpy_udata_t udata;
+    subpy_udata_init(&udata, script);
+    yyset_extra(&udata, scanner);
+
+    /* Parse into the batch pool, which keeps its pages from run to run,
+     * rather than the new one the parser's state comes with. */
+    if (!cache_trees) {
+        if (batch_pool == NULL) {
+            batch_pool = udata.pool;
+        } else {
+            ast_free_pool(udata.pool);
+        }
+        udata.pool = batch_pool;
+    }
+
+    long start = now_ns();
+    int result = yyparse(scanner);
+    *time = now_ns() - start;
+
+    /* 3 means there was nothing but blank lines to parse. */
+    if (result == 3) {
+        result = 0;
+    }
+    *tree = result == 0 ? udata.tree : NULL;
+
+    if (cache_trees) {
+        if (result == 0) {
+            ast_cache_insert(text, length, udata.pool, udata.tree);
+        } else {
+            ast_free_pool(udata.pool);
+        }
+    }
+
+    /* The cache or batch_pool has the pool now, or it has been freed. */
+    udata.pool = NULL;
+    subpy_udata_destroy(&udata);
+    yylex_destroy(scanner);
+    fclose(script);
+
+    return result;
+}
+
+/*!
+ * Batch mode parses the whole script into a single tree and then runs it,
+ * runs times over, each time with a new memory pool and no globals.  After
+ * each run it reports on stderr how long parsing and evaluation took, how
+ * much of the evaluation was spent collecting garbage, and the most memory
+ * that was in use at once; then the best of each of the times.  If trees
+ * are cached, the runs after the first use the first one's tree, and take
+ * no time to parse.  Returns the exit status: 1 if the script could not be
+ * parsed.
+ */
+int run_batch(FILE *input, int runs) {
+    size_t length;
+    char *text = read_whole_file(input, &length);
+
+    long best_parse = -1, best_eval = -1, best_gc = -1;
+    int status = 0;
+
+    for (int run = 1; run <= runs; run++) {
+        if (run > 1) {
+            eval_reset();
+            mm_cleanup();
+            mm_init(memory_size, gc_mode);
+        }
+
+        /* With the cache, only the first run parses the script; the rest
+         * run the tree the first one left in the cache. */
+        Node *tree = cache_trees ? ast_cache_lookup(text, length) : NULL;
+        long parse = 0;
+
+        if (tree == NULL && parse_script(text, length, &tree, &parse) != 0) {
+            fprintf(stderr, "run_batch: could not parse the script\n");
+            status = 1;
+            break;
+        }
+
+        long start = now_ns();
+        if (tree) {
+            eval_tree(tree);
+        }
+        clear_temporary_globals();
+        long eval = now_ns() - start;
+        long gc = mm_total_pause();
+
+        fprintf(stderr, "run %d: parse %.3f ms, eval %.3f ms, "
+                "gc %.3f ms in %ld collections, peak heap %d bytes\n",
+                run, parse / 1e6, eval / 1e6, gc / 1e6,
+                mm_num_collections(), mm_peak_memuse());
+
+        if (best_parse < 0 || parse < best_parse)
+            best_parse = parse;
+        if (best_eval < 0 || eval < best_eval)
+            best_eval = eval;
+        if (best_gc < 0 || gc < best_gc)
+            best_gc = gc;
+
+        if (!cache_trees) {
+            ast_reset_pool(batch_pool);
+        }
+    }
+
+    if (status == 0 && runs > 1) {
+        fprintf(stderr, "best of %d: parse %.3f ms, eval %.3f ms, "
+                "gc %.3f ms\n", runs, best_parse / 1e6, best_eval / 1e6,
+                best_gc / 1e6);
+    }
+
+    ast_free_pool(batch_pool);
+    ast_cache_clear();
+    free(text);
+    return status;
+}
+
+
+/*!
+ * Reports the longest garbage-collection pause when the interpreter exits.
+ * This is registered with atexit() so that it also runs after exit().
+ */
+void report_longest_pause(void) {
+    if (!quiet) {
+        printf("Longest GC pause: %.3f ms\n", mm_longest_pause() / 1e6);
+    }
+}
+
+
 /*! Prints the program's usage information. */
 void usage(char *program) {
     printf("usage: %s [OPTION]...\n", program);
     printf("Runs the CS24 Sub-Python interpreter\n\n");
     printf(" -f file        file to run instead of standard input\n");
     printf(" -m memory_size amount of memory (in bytes) to use for the memory pool\n");
+    printf(" -M max_size    let the memory pool grow past memory_size, up to max_size\n");
+    printf("                bytes, when most of it survives collections; it shrinks\n");
+    printf("                back towards memory_size when little does\n");
+    printf(" -c collector   garbage collector to use:\n");
+    printf("                  copy - stop-and-copy over two semispaces (default)\n");
+    printf("                  gen  - generational, with a nursery and old space\n");
+    printf("                  incr - incremental, with bounded pauses\n");
+    printf(" -T threads     threads the copy collector may use on pools of 1MB or\n");
+    printf("                more in use (default 1)\n");
+    printf(" -e evaluator   how to run the code:\n");
+    printf("                  vm   - compile to bytecode for a stack VM (default)\n");
+    printf("                  tree - walk the syntax tree directly\n");
+    printf(" -P pause_cap   longest an incremental collection step may take, in\n");
+    printf("                microseconds\n");
+    printf(" -l log_file    append a line of JSON garbage-collector statistics to\n");
+    printf("                log_file after every collection\n");
+    printf(" -b runs        run in batch mode: parse the whole input into one tree,\n");
+    printf("                then run it runs times, each with a fresh memory pool,\n");
+    printf("                reporting the parse, evaluation and GC times and the\n");
+    printf("                peak heap size of each run on standard error\n");
+    printf(" -a             in batch mode, cache the parse tree, keyed by the\n");
+    printf("                script's text, so that only the first run parses it\n");
     printf(" -q             run in quite mode, supresses extra output\n");
     printf(" -d             run in debug mode:\n");
     printf("                  the REPL will printing out the current bindings and\n");
@@ -116,7 +343,7 @@ int main(int argc, char **argv) {
 
     FILE *input = stdin;
 
-    while ((c = getopt(argc, argv, "f:m:qd")) != -1) {
+    while ((c = getopt(argc, argv, "f:m:M:T:c:e:P:l:b:aqd")) != -1) {
         switch (c) {
             case 'f':
                 input = fopen(optarg, "r");
@@ -136,6 +363,91 @@ int main(int argc, char **argv) {
                 }
                 break;
 
+            case 'M': {
+                long max_size = strtol(optarg, NULL, 10);
+                if (max_size <= 0 || max_size > INT_MAX) {
+                    fprintf(stderr, "%s: invalid maximum memory size\n",
+                                argv[0]);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                mm_set_heap_limit(max_size);
+                break;
+            }
+
+            case 'T': {
+                long threads = strtol(optarg, NULL, 10);
+                if (threads <= 0 || threads > 64) {
+                    fprintf(stderr, "%s: invalid number of GC threads\n",
+                                argv[0]);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                mm_set_gc_threads(threads);
+                break;
+            }
+
+            case 'c':
+                if (strcmp(optarg, "copy") == 0) {
+                    gc_mode = GC_COPY;
+                } else if (strcmp(optarg, "gen") == 0) {
+                    gc_mode = GC_GENERATIONAL;
+                } else if (strcmp(optarg, "incr") == 0) {
+                    gc_mode = GC_INCREMENTAL;
+                } else {
+                    fprintf(stderr, "%s: unknown collector '%s'\n", argv[0],
+                                optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'e':
+                if (strcmp(optarg, "vm") == 0) {
+                    eval_mode = EVAL_BYTECODE;
+                } else if (strcmp(optarg, "tree") == 0) {
+                    eval_mode = EVAL_TREE;
+                } else {
+                    fprintf(stderr, "%s: unknown evaluator '%s'\n", argv[0],
+                                optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'P': {
+                long pause_cap = strtol(optarg, NULL, 10);
+                if (pause_cap <= 0) {
+                    fprintf(stderr, "%s: invalid pause cap\n", argv[0]);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                mm_set_pause_cap(pause_cap);
+                break;
+            }
+
+            case 'l':
+                stats_log = fopen(optarg, "a");
+                if (stats_log == NULL) {
+                    fprintf(stderr, "%s: %s: %s\n", argv[0], optarg,
+                                strerror(errno));
+                    exit(1);
+                }
+                break;
+
+            case 'b':
+                batch_runs = strtol(optarg, NULL, 10);
+                if (batch_runs <= 0) {
+                    fprintf(stderr, "%s: invalid number of runs\n", argv[0]);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'a':
+                cache_trees = true;
+                break;
+
             case 'q':
                 quiet = 1;
                 break;
@@ -163,11 +475,23 @@ int main(int argc, char **argv) {
         printf("Using a memory size of %d bytes.\n", memory_size);
     }
 
-    mm_init(memory_size);
-    eval_init();
-    read_eval_print_loop(input);
+    mm_init(memory_size, gc_mode);
+    mm_set_stats_log(stats_log);
+    atexit(report_longest_pause);
+    eval_init(eval_mode);
+
+    int status = 0;
+    if (batch_runs > 0) {
+        status = run_batch(input, batch_runs);
+    } else {
+        read_eval_print_loop(input);
+    }
+
     mm_cleanup();
 
-    return 0;
+    if (stats_log != NULL)
+        fclose(stats_log);
+
+    return status;
 }
 
@@ -0,0 +1,18 @@
+print(1 + 2 * 3, -(4 - 10), +2.5, 7 / 2, 7 % 3, 7.5 % 2, 2 * 0.25)
+print("ab" + "cd", "ab" < "b", 3 == 3.0, 2 >= 3, not 0, not "x", -+-1)
+print(536870911 + 1, 2147483647 + 1, 0 - 536870912 - 1)
+print(0 or "a", 1 and "b", None or False, 0 and print("never"))
+x = 5
+print(x + 1 * 2, True and x, False or x, x and 3 + 4)
+False or print("evaluated")
+d = {"k" + "ey": 1 + 1, 2.0 * 2: "four"}
+print(d["ke" + "y"], d[4], d[2 + 2])
+s = ""
+i = 0
+while i < 20:
+    s = s + "0123456789"
+    i = i + 1
+print(len(s), s == "0123456789" + s[0], "x" + "y" == "xy")
+l = [1 + 1, "a" + "b"]
+l[0] = l[0] + 1
+print(l, 1 / 0.5)
@@ -0,0 +1,25 @@
+d = {1: "a", "x": [1, 2], 2.5: None}
+print(d, len(d))
+print(d[1.0], d["x"], d[2.5])
+d[1] = "b"
+d["y"] = {"z": 3}
+print(d)
+del d["x"]
+print(d, len(d))
+d["x"] = 0
+print(d)
+e = {}
+i = 0
+while i < 100:
+    e[i] = i * i
+    e["k" + "s"] = i
+    i = i + 1
+i = 0
+while i < 100:
+    if i % 2 == 0:
+        del e[i]
+    i = i + 1
+print(len(e), e[99], e["ks"])
+if {}:
+    print("bad")
+print(len("abc"))
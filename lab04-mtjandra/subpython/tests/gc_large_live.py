@@ -0,0 +1,16 @@
+l = None
+i = 0
+while i < 3000:
+    l = [i, l]
+    i = i + 1
+j = 0
+while j < 2000:
+    t = [j, j, j]
+    j = j + 1
+s = 0
+i = 0
+while i < 3000:
+    s = s + l[0]
+    l = l[1]
+    i = i + 1
+print(s)
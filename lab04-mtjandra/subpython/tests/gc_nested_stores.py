@@ -0,0 +1,19 @@
+l = [1, 2, 3, [4, 5, 6], {"a": 1, "b": [7, 8]}]
+d = {1: "one", 2: "two"}
+i = 0
+while i < 300:
+    l[0] = l[0] + 1
+    l[3][1] = [i, i * 2, "s" + "t"]
+    d[i] = [i, "x"]
+    if i % 3 == 0:
+        del d[i]
+    i = i + 1
+print(l)
+print(len(d))
+print(d[2])
+print(d[299])
+x = ["a", "b", "c"]
+del x[1]
+print(x)
+gc()
+print(l, x)
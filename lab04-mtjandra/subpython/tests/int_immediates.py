@@ -0,0 +1,24 @@
+a = 536870911
+b = a + 1
+c = 0 - 536870912
+d = c - 1
+print(a, b, c, d, b - 1 == a, d + 1 == c, -b, -d)
+e = 2147483647
+print(e + 1, e * 2, -e - 1, (e + 1) - 1)
+k = {b: "big", a: "small", 536870912.0: "f"}
+print(k[536870912], k[b - 1 + 1], len(k), k[536870911.0])
+x = 1
+i = 0
+while i < 40:
+    x = x * 3
+    i = i + 1
+print(x, x % 7, -x, x / 2)
+print(b == 536870912, [b, a] == [536870912, 536870911], b < a, d < c)
+z = {}
+z[None] = 1
+z[True] = 2
+z[False] = 3
+z[0] = 4
+z[1] = 5
+print(z, len(z))
+print(True == 1, None == 0, not None, not 0, not 536870912)
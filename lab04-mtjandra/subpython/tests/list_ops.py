@@ -0,0 +1,20 @@
+a = [1, 2, 3]
+b = [1, 2]
+print(a == b, a < b, a > b, a <= b, a >= b, b < a, [] == [], [] < [1], [[1], 2] == [[1], 2])
+print(a[-1], len(a), len([]))
+del a[0]
+print(a, len(a))
+del a[-1]
+print(a)
+l = []
+i = 0
+while i < 20:
+    append(l, [i, "s"])
+    i = i + 1
+print(l)
+l[3] = 7
+print(l[3], l[19])
+if []:
+    print("bad")
+if [0]:
+    print("ok")
@@ -0,0 +1,27 @@
+a = [1, [2, [3, [4, [5, [6]]]]], {"k": [7, {"x": [8, [9]]}]}]
+print(a)
+a
+print(a, a[1], "and", [], {}, [[]], [{}], None, True, False)
+d = {1: "one", 2: "two", 3: "three", 4: [1.5, -2.25]}
+del d[1]
+del d[3]
+print(d)
+del d[2]
+del d[4]
+print(d, len(d))
+e = {"a": {"b": {"c": {"d": {"e": 1}}}}}
+e
+print(-2147483647 - 1, 2147483647, -7, 0, 10000000000.0 * 10000000000.0, -0.5)
+s = "x"
+i = 0
+while i < 7:
+    s = s + s
+    i = i + 1
+print([s, {s: [s]}])
+l = []
+i = 0
+while i < 3000:
+    append(l, [i, "s" + "t", i * 0.5])
+    i = i + 1
+print(len(l), l[2999])
+l
@@ -0,0 +1,35 @@
+s = ""
+i = 0
+while i < 200:
+    s = s + "abcdefghij"
+    i = i + 1
+print(len(s), s[0], s[1999], s[1005])
+t = "0123456789abcdefghijklmnopqrstuvwxyz" + "0123456789abcdefghijklmnopqrstuvwxyz"
+print(t, len(t), t[40])
+u = t + t
+v = t + (t + "")
+print(u == v, u < v + "a", v + "a" > u, u == t, len(u + u))
+d = {u: 1}
+d[v] = 2
+d[t + t + t] = 3
+print(len(d), d[v], d[u + t])
+w = "[" + t + "|" + u + "]"
+print(w)
+print([w, {w: t}], not "", not u)
+x = ""
+y = ""
+i = 0
+while i < 500:
+    x = "ab" + x
+    y = y + "ba"
+    i = i + 1
+print(len(x), len(y), x[0], y[0], x[999], y[999], x + y == y + x, x[1] + y[1] == "ba")
+r = t + t + t + t + t + t + "x"
+i = 0
+n = 0
+while i < 300:
+    v = {r + "y": i, "k": [i]}[r + "y"]
+    if [r + "z", i] == [r + "z", v]:
+        n = n + 1
+    i = i + 1
+print(len(r), v, n)
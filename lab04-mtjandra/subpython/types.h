@@ -1,12 +1,15 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <limits.h>
+#include <stdbool.h>
 
 /*!
  * An opaque Reference that can be used to indirectly access a Value.  The
- * Reference itself is not a pointer; rather, it is an index into a table of
- * references maintained in the eval.c state.  It can be dereferenced into a
- * Value pointer using the deref() function.
+ * Reference itself is not a pointer; rather, it is a handle holding an index
+ * into a table of references maintained by the allocator, and a generation
+ * that lets the allocator reuse table slots safely.  It can be dereferenced
+ * into a Value pointer using the deref() function.
  */
 typedef int Reference;
 
@@ -19,6 +22,53 @@ typedef int Reference;
 #define NULL_REF (-1)
 
 
+/*
+ * Some values are not kept in the memory pool at all, but are encoded in the
+ * Reference itself, so making one allocates nothing and uses no slot of the
+ * reference table.  These "immediate" References are all negative and below
+ * NULL_REF, while References to Values in the pool are never negative:
+ *
+ *  - None, True and False are the three constants below, and
+ *  - ints from SMALL_INT_MIN to SMALL_INT_MAX are stored as the int plus
+ *    SMALL_INT_BIAS, which puts them at the very bottom of the range.
+ *
+ * Ints outside of that range are still IntegerValues in the pool.
+ */
+#define NONE_IMMEDIATE  (-2)
+#define TRUE_IMMEDIATE  (-3)
+#define FALSE_IMMEDIATE (-4)
+
+#define SMALL_INT_BITS  30
+#define SMALL_INT_MIN   (-(1 << (SMALL_INT_BITS - 1)))
+#define SMALL_INT_MAX   ((1 << (SMALL_INT_BITS - 1)) - 1)
+#define SMALL_INT_BIAS  (INT_MIN - SMALL_INT_MIN)
+
+/*! Returns true if a Reference refers to a Value in the memory pool. */
+static inline bool is_heap_ref(Reference ref) {
+    return ref >= 0;
+}
+
+/*! Returns true if a Reference is an immediate small int. */
+static inline bool is_small_int_ref(Reference ref) {
+    return ref <= SMALL_INT_MAX + SMALL_INT_BIAS;
+}
+
+/*! Returns the int an immediate small int Reference holds. */
+static inline int small_int_value(Reference ref) {
+    return ref - SMALL_INT_BIAS;
+}
+
+/*! Returns true if an int can be stored as an immediate small int. */
+static inline bool fits_small_int(long int value) {
+    return value >= SMALL_INT_MIN && value <= SMALL_INT_MAX;
+}
+
+/*! Returns the immediate Reference for a small int. */
+static inline Reference make_small_int_ref(int value) {
+    return value + SMALL_INT_BIAS;
+}
+
+
 /*!
  * An enumeration of all types of values supported by the interpreter.
  */
@@ -28,31 +78,28 @@ typedef enum ValueType {
     VAL_INTEGER,        /*!< An integer value. */
     VAL_FLOAT,          /*!< A float value */
     VAL_STRING,         /*!< A string value */
-    VAL_LIST_NODE,      /*!< A node in a list */
-    VAL_DICT_NODE       /*!< A node (key/value pair) in a dictionary */
+    VAL_LIST,           /*!< A list */
+    VAL_DICT,           /*!< A dictionary */
+    VAL_ARRAY,          /*!< An array of References, such as a list's items */
+    VAL_DICT_TABLE,     /*!< The hash table holding a dictionary's entries */
+    VAL_ROPE            /*!< A string made by concatenating two others */
 } ValueType;
 
-/*! This is a single element of a linked list. */
-typedef struct ListNode {
-    /*! The value at this index of the list. */
-    Reference value;
-
-    /*! The next node in the list, or NULL_REF if this is the last node. */
-    Reference next;
-} ListNode;
+/*! The number of ValueTypes, for tables indexed by type. */
+#define NUM_VALUE_TYPES (VAL_ROPE + 1)
 
 
-/*! This is a single entry in a dictionary. */
-typedef struct DictNode {
+/*!
+ * This is a single entry in a dictionary.  A deleted entry has a key and
+ * value of NULL_REF.
+ */
+typedef struct DictEntry {
     /*! The key for this dictionary entry. */
     Reference key;
 
     /*! The value associated with the key. */
     Reference value;
-
-    /*! The next key/value pair in the dictionary. */
-    Reference next;
-} DictNode;
+} DictEntry;
 
 
 /*!
@@ -61,10 +108,14 @@ typedef struct DictNode {
  *
  *  - All numbers are floats
  *  - All strings are '\0' terminated
- *  - Lists are represented as a singly-linked list of ListNode values,
- *    which are themselves allocated from the memory pool
- *  - Dictionaries are represented as a singly-linked list of DictNode
- *    key-value pairs, which are themselves allocated from the memory pool
+ *  - Long strings made by concatenation are represented as a RopeValue
+ *    referring to the two strings they join, until their text is needed
+ *  - Lists are represented as a ListValue holding the length, and an
+ *    ArrayValue holding the elements, which is replaced by a larger one
+ *    when the list outgrows it
+ *  - Dictionaries are represented as a DictValue holding the length, and a
+ *    DictTableValue holding the entries and a hash index over them, which
+ *    is replaced by a larger one when the dictionary outgrows it
  */
 typedef struct Value {
     /*!
@@ -193,6 +244,9 @@ typedef struct StringValue {
      * it has been copied. A 0 means that it has not. */
     int seen;
 
+    /*! The hash of the string, or 0 if it has not been computed yet. */
+    unsigned int hash;
+
     /*!
      * The string value this StringValue represents.  We use the undimensioned
      * array syntax so that the string data can immediately follow the Value
@@ -203,11 +257,11 @@ typedef struct StringValue {
 
 
 /*!
- * A "list value" type that represents list elements.  It is a subtype
- * of Value.  This means that we can cast a ListValue* to a Value* and
- * still access all the Value components.  And, if a Value has a type of
- * VAL_LIST_NODE, we can cast the Value* back to a ListValue* to get at
- * all the list-related details.
+ * A "list value" type that represents lists.  It is a subtype of Value.
+ * This means that we can cast a ListValue* to a Value* and still access all
+ * the Value components.  And, if a Value has a type of VAL_LIST, we can
+ * cast the Value* back to a ListValue* to get at all the list-related
+ * details.
  */
 typedef struct ListValue {
     /*!
@@ -232,17 +286,24 @@ typedef struct ListValue {
      */
     int data_size;
 
-    /*! The details of the list element stored in this ListValue. */
-    ListNode list_node;
+    /*! The number of elements in the list. */
+    int length;
+
+    /*!
+     * The ArrayValue holding the elements, or NULL_REF if the list has never
+     * had any.  It has room for at least length elements, and its unused
+     * slots are NULL_REF.
+     */
+    Reference items;
 } ListValue;
 
 
 /*!
- * A "dictionary value" type that represents dictionary entries.  It is a
- * subtype of Value.  This means that we can cast a DictValue* to a Value*
- * and still access all the Value components.  And, if a Value has a type
- * of VAL_DICT_NODE, we can cast the Value* back to a DictValue* to get at
- * all the dictionary-related details.
+ * A "dictionary value" type that represents dictionaries.  It is a subtype
+ * of Value.  This means that we can cast a DictValue* to a Value* and still
+ * access all the Value components.  And, if a Value has a type of VAL_DICT,
+ * we can cast the Value* back to a DictValue* to get at all the
+ * dictionary-related details.
  */
 typedef struct DictValue {
     /*!
@@ -267,9 +328,136 @@ typedef struct DictValue {
      */
     int data_size;
 
-    /*! The details of the dictonary entry stored in this DictValue. */
-    DictNode dict_node;
+    /*! The number of keys in the dictionary. */
+    int length;
+
+    /*!
+     * The DictTableValue holding the entries, or NULL_REF if the dictionary
+     * has never had any.
+     */
+    Reference table;
 } DictValue;
 
 
+/*!
+ * An "array value" type that holds a fixed number of References.  It is a
+ * subtype of Value.  This means that we can cast an ArrayValue* to a Value*
+ * and still access all the Value components.  And, if a Value has a type of
+ * VAL_ARRAY, we can cast the Value* back to an ArrayValue* to get at the
+ * References.  Arrays are never seen by Sub-Python programs; they are the
+ * storage behind other Values.
+ */
+typedef struct ArrayValue {
+    /*!
+     * Every Value knows the Reference associated with it, so that we don't
+     * have to search for what reference goes with a particular value in the
+     * reference table.
+     */
+    Reference ref;
+
+    /*! This specifies what kind of value is actually represented. */
+    ValueType type;
+
+    /* A 0 or 1 value that represents whether the Value has been copied. 1 means that
+     * it has been copied. A 0 means that it has not. */
+    int seen;
+
+    /*!
+     * This is the size of the data in the value.  For arrays, this is the
+     * size of the References, so there are data_size / sizeof(Reference) of
+     * them.
+     */
+    int data_size;
+
+    /*!
+     * The References.  We use the undimensioned array syntax so that they
+     * immediately follow the Value part of the struct.
+     */
+    Reference items[];
+} ArrayValue;
+
+
+/*!
+ * A "dictionary table" type that holds the entries of a dictionary.  It is a
+ * subtype of Value.  This means that we can cast a DictTableValue* to a
+ * Value* and still access all the Value components.  And, if a Value has a
+ * type of VAL_DICT_TABLE, we can cast the Value* back to a DictTableValue*
+ * to get at the entries.
+ *
+ * The entries are kept in the order they were added.  After room for as many
+ * entries as the table may hold comes the hash index: num_slots ints, each
+ * either the number of an entry, or negative for an empty or deleted slot.
+ * Collisions are resolved by probing the following slots.
+ */
+typedef struct DictTableValue {
+    /*!
+     * Every Value knows the Reference associated with it, so that we don't
+     * have to search for what reference goes with a particular value in the
+     * reference table.
+     */
+    Reference ref;
+
+    /*! This specifies what kind of value is actually represented. */
+    ValueType type;
+
+    /* A 0 or 1 value that represents whether the Value has been copied. 1 means that
+     * it has been copied. A 0 means that it has not. */
+    int seen;
+
+    /*! This is the size of the entries and the hash index together. */
+    int data_size;
+
+    /*! The number of slots in the hash index.  This is a power of two. */
+    int num_slots;
+
+    /*! The number of entries used, including deleted ones. */
+    int num_entries;
+
+    /*! The entries, followed by the hash index. */
+    DictEntry entries[];
+} DictTableValue;
+
+
+/*!
+ * A "rope value" type that represents the concatenation of two strings,
+ * without copying their text.  It is a subtype of Value.  This means that we
+ * can cast a RopeValue* to a Value* and still access all the Value
+ * components.  And, if a Value has a type of VAL_ROPE, we can cast the
+ * Value* back to a RopeValue* to get at the two sides.
+ *
+ * To Sub-Python programs a rope is just a str.  When its text is needed as
+ * one string, the rope is flattened: the text is copied into a new
+ * StringValue, which becomes the left side, and the right side is set to
+ * NULL_REF.
+ */
+typedef struct RopeValue {
+    /*!
+     * Every Value knows the Reference associated with it, so that we don't
+     * have to search for what reference goes with a particular value in the
+     * reference table.
+     */
+    Reference ref;
+
+    /*! This specifies what kind of value is actually represented. */
+    ValueType type;
+
+    /* A 0 or 1 value that represents whether the Value has been copied. 1 means that
+     * it has been copied. A 0 means that it has not. */
+    int seen;
+
+    /*!
+     * This is the size of the data in the value.  For ropes, this is the
+     * size of the length and the two sides.
+     */
+    int data_size;
+
+    /*! The length of the whole string, not counting a NUL-terminator. */
+    int length;
+
+    /*! The strings or ropes joined, or the flattened text and NULL_REF. */
+    Reference left;
+    Reference right;
+} RopeValue;
+
+
 #endif /* TYPES_H */